@@ -0,0 +1,576 @@
+// Copyright 2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+/// @file usd_mipmap_textures.cc
+
+// Convert the textures used by a usd stage to tiled, mipmapped .tx files
+//
+// A native replacement for usd_mipmap_images : the textures are found by walking the
+// shaders (and light textures) of the composed stage, are checked and converted in
+// process with OpenImageIO on a TBB pool, and the layers that refer to them are
+// updated to use the .tx files.
+//
+// A manifest records the content hash of every source image next to its output, so
+// that a later run only converts images that are new or have changed. An image is
+// only rehashed if its size or modification time differ from the manifest.
+
+#include <OpenImageIO/imagebufalgo.h>
+#include <OpenImageIO/imageio.h>
+
+#include <pxr/usd/sdf/assetPath.h>
+#include <pxr/usd/sdf/attributeSpec.h>
+#include <pxr/usd/sdf/layer.h>
+#include <pxr/usd/sdf/layerUtils.h>
+#include <pxr/usd/sdf/types.h>
+#include <pxr/usd/usd/primRange.h>
+#include <pxr/usd/usd/stage.h>
+#include <pxr/usd/usdShade/shader.h>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <tbb/task_arena.h>
+
+#include <glob.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// first SIGINT stops starting new conversions, the third one exits
+std::atomic<bool> abortRequested(false);
+std::atomic<int> sigintCount(0);
+
+void
+signalHandler(int)
+{
+    abortRequested = true;
+    if (++sigintCount >= 3) std::_Exit(1);
+}
+
+struct Options
+{
+    std::string inputFile;
+    std::string manifest;
+    unsigned threads = 0; // 0 uses every core
+    bool force = false;
+    bool cleanup = false;
+    bool verbose = false;
+    bool noExport = false;
+    bool dryRun = false;
+};
+
+std::string
+usage(const char* program)
+{
+    std::ostringstream out;
+    out << "Usage: " << program << " [options] input_file\n"
+        << "Convert the textures used by a usd file to tiled, mipmapped .tx files,\n"
+        << "and update the usd layers to refer to them.\n\n"
+        << "  --threads N      number of textures to convert at once (default: one per core)\n"
+        << "  --manifest FILE  manifest of content hashes (default: input_file.mipmap_manifest)\n"
+        << "  --force          keep going if an image cannot be converted\n"
+        << "  --cleanup        delete the original images after conversion\n"
+        << "  --no_export      do not write any usd files, just convert the textures\n"
+        << "  --dry_run        only report what would be converted\n"
+        << "  --verbose        show more details about what is happening\n"
+        << "  -h, --help       show this message\n";
+    return out.str();
+}
+
+// returns false if the arguments are not valid
+bool
+parseArgs(int argc, char* argv[], Options& options, bool& help)
+{
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        auto value = [&](std::string& v) {
+            if (i + 1 >= argc) return false;
+            v = argv[++i];
+            return true;
+        };
+        std::string v;
+        if (arg == "-h" || arg == "--help") {
+            help = true;
+        } else if (arg == "--threads" || arg == "--max_threads") {
+            if (not value(v)) return false;
+            options.threads = unsigned(std::max(0, std::atoi(v.c_str())));
+        } else if (arg == "--manifest") {
+            if (not value(options.manifest)) return false;
+        } else if (arg == "--force") {
+            options.force = true;
+        } else if (arg == "--cleanup") {
+            options.cleanup = true;
+        } else if (arg == "--no_export") {
+            options.noExport = true;
+        } else if (arg == "--dry_run") {
+            options.dryRun = true;
+        } else if (arg == "--verbose") {
+            options.verbose = true;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cerr << "Unknown option " << arg << '\n';
+            return false;
+        } else if (options.inputFile.empty()) {
+            options.inputFile = arg;
+        } else {
+            return false;
+        }
+    }
+    return help || not options.inputFile.empty();
+}
+
+std::mutex logMutex;
+
+template <typename... Args>
+void
+log(std::ostream& out, const Args&... args)
+{
+    std::lock_guard<std::mutex> lock(logMutex);
+    using expand = int[];
+    (void)expand{0, ((out << args), 0)...};
+    out << std::endl;
+}
+
+double
+secondsSince(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+const std::set<std::string> imageExtensions = {
+    ".avif", ".bmp", ".cin", ".dds", ".dcm", ".dpx", ".env", ".exr", ".fits", ".gif",
+    ".hdr", ".heic", ".ico", ".iff", ".jif", ".jfif", ".jfi", ".jpe", ".jpeg", ".jpg",
+    ".jxl", ".jp2", ".j2k", ".pic", ".pbm", ".pfm", ".pgm", ".png", ".ppm", ".psd",
+    ".rla", ".sm", ".tga", ".tif", ".tiff", ".vsm"
+};
+
+// position of the extension's '.' in path, or npos
+size_t
+extensionPos(const std::string& path)
+{
+    const size_t dot = path.rfind('.');
+    const size_t slash = path.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return std::string::npos;
+    return dot;
+}
+
+bool
+isImage(const std::string& path)
+{
+    const size_t dot = extensionPos(path);
+    if (dot == std::string::npos) return false;
+    std::string ext = path.substr(dot);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    return imageExtensions.count(ext) > 0;
+}
+
+std::string
+txPath(const std::string& path)
+{
+    return path.substr(0, extensionPos(path)) + ".tx";
+}
+
+// files matching a path, which may contain a <UDIM> tag
+std::vector<std::string>
+expandUdim(const std::string& path)
+{
+    std::vector<std::string> result;
+    const size_t tag = path.find("<UDIM>");
+    if (tag == std::string::npos) {
+        result.push_back(path);
+        return result;
+    }
+    const std::string pattern = path.substr(0, tag) + "[1-9][0-9][0-9][0-9]" + path.substr(tag + 6);
+    glob_t matches;
+    if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+        for (size_t i = 0; i < matches.gl_pathc; ++i) result.emplace_back(matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+    return result;
+}
+
+// the path of an asset attribute, made absolute. <UDIM> paths are not resolved
+// by Ar, so they are anchored to the layer of the strongest opinion
+std::string
+assetPath(const pxr::UsdAttribute& attr)
+{
+    pxr::SdfAssetPath value;
+    if (not attr.Get(&value) || value.GetAssetPath().empty()) return std::string();
+    if (not value.GetResolvedPath().empty()) return value.GetResolvedPath();
+    for (const pxr::SdfPropertySpecHandle& spec : attr.GetPropertyStack()) {
+        if (spec->HasDefaultValue()) {
+            return pxr::SdfComputeAssetPathRelativeToLayer(spec->GetLayer(), value.GetAssetPath());
+        }
+    }
+    return std::string();
+}
+
+// the image files used by the shaders and light textures of the stage
+std::set<std::string>
+findTextures(const pxr::UsdStageRefPtr& stage)
+{
+    static const pxr::TfToken lightTexture("inputs:texture:file");
+    std::set<std::string> paths;
+    for (const pxr::UsdPrim& prim : stage->Traverse(pxr::UsdTraverseInstanceProxies())) {
+        pxr::UsdShadeShader shader(prim);
+        if (shader) {
+            for (const pxr::UsdShadeInput& input : shader.GetInputs()) {
+                if (input.GetTypeName() == pxr::SdfValueTypeNames->Asset) {
+                    paths.insert(assetPath(input.GetAttr()));
+                }
+            }
+        } else if (pxr::UsdAttribute attr = prim.GetAttribute(lightTexture)) {
+            paths.insert(assetPath(attr));
+        }
+    }
+
+    std::set<std::string> textures;
+    for (const std::string& path : paths) {
+        if (path.empty() || not isImage(path)) continue;
+        for (const std::string& file : expandUdim(path)) textures.insert(file);
+    }
+    return textures;
+}
+
+bool
+isTiledAndMipmapped(const std::string& path)
+{
+    auto in = OIIO::ImageInput::open(path);
+    if (not in) {
+        OIIO::geterror(); // clear it
+        return false;
+    }
+    const bool tiled = in->spec().tile_width > 0;
+    const bool mipmapped = in->seek_subimage(0, 1);
+    in->close();
+    return tiled && mipmapped;
+}
+
+// 64 bit FNV-1a of the file content, in hex. Empty if the file cannot be read
+std::string
+contentHash(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (not in) return std::string();
+    uint64_t h = 0xcbf29ce484222325ull;
+    std::vector<char> buffer(1 << 20);
+    while (in) {
+        in.read(buffer.data(), buffer.size());
+        const std::streamsize n = in.gcount();
+        for (std::streamsize i = 0; i < n; ++i) {
+            h = (h ^ uint8_t(buffer[i])) * 0x100000001b3ull;
+        }
+    }
+    if (in.bad()) return std::string();
+    std::ostringstream out;
+    out << std::hex << std::setw(16) << std::setfill('0') << h;
+    return out.str();
+}
+
+// One line of the manifest
+struct Record
+{
+    std::string hash;
+    long long size = 0;
+    long long mtime = 0;
+    std::string output; // the source itself if it was already tiled and mipmapped
+};
+
+using Manifest = std::map<std::string, Record>;
+const char* const manifestHeader = "# usd_mipmap_textures manifest 1";
+
+Manifest
+readManifest(const std::string& path)
+{
+    Manifest manifest;
+    std::ifstream in(path);
+    std::string line;
+    if (not std::getline(in, line) || line != manifestHeader) return manifest;
+    while (std::getline(in, line)) {
+        // hash size mtime source output, tab separated
+        std::istringstream fields(line);
+        Record record;
+        std::string size, mtime, source;
+        if (std::getline(fields, record.hash, '\t') &&
+            std::getline(fields, size, '\t') &&
+            std::getline(fields, mtime, '\t') &&
+            std::getline(fields, source, '\t') &&
+            std::getline(fields, record.output)) {
+            record.size = std::atoll(size.c_str());
+            record.mtime = std::atoll(mtime.c_str());
+            manifest[source] = record;
+        }
+    }
+    return manifest;
+}
+
+bool
+writeManifest(const std::string& path, const Manifest& manifest)
+{
+    const std::string tmp = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(tmp);
+        out << manifestHeader << '\n';
+        for (const auto& entry : manifest) {
+            const Record& r = entry.second;
+            out << r.hash << '\t' << r.size << '\t' << r.mtime << '\t'
+                << entry.first << '\t' << r.output << '\n';
+        }
+        if (not out) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+    }
+    return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+struct Texture
+{
+    enum Status { Pending, Mipmapped, UpToDate, Converted, WouldConvert, Failed };
+    std::string source;
+    Record record;
+    Status status = Pending;
+};
+
+// Convert to a temporary file and rename it, so that an interrupted conversion
+// never leaves a partial .tx file behind
+bool
+convert(const std::string& source, const std::string& output, bool verbose)
+{
+    const std::string tmp = output.substr(0, output.size() - 3) +
+        ".tmp" + std::to_string(getpid()) + ".tx";
+    OIIO::ImageSpec config;
+    config.attribute("maketx:oiio_options", 1); // as "maketx --oiio"
+    std::ostringstream messages;
+    const bool ok = OIIO::ImageBufAlgo::make_texture(OIIO::ImageBufAlgo::MakeTxTexture,
+                                                     source, tmp, config, &messages);
+    if (not ok || std::rename(tmp.c_str(), output.c_str())) {
+        std::remove(tmp.c_str());
+        log(std::cerr, "Error converting ", source, " to ", output, ": ",
+            ok ? "cannot rename" : OIIO::geterror());
+        return false;
+    }
+    if (verbose && not messages.str().empty()) log(std::cout, messages.str());
+    return true;
+}
+
+void
+processTexture(Texture& texture, const Manifest& previous, const Options& options)
+{
+    struct stat st;
+    if (stat(texture.source.c_str(), &st)) {
+        log(std::cerr, "Cannot read ", texture.source);
+        texture.status = Texture::Failed;
+        return;
+    }
+    Record& record = texture.record;
+    record.size = st.st_size;
+    record.mtime = st.st_mtime;
+
+    if (isTiledAndMipmapped(texture.source)) {
+        record.output = texture.source;
+        texture.status = Texture::Mipmapped;
+        return;
+    }
+    record.output = txPath(texture.source);
+
+    // only hash the content if the file changed since the last run
+    auto it = previous.find(texture.source);
+    const Record* old = it == previous.end() ? nullptr : &it->second;
+    if (old && old->size == record.size && old->mtime == record.mtime) {
+        record.hash = old->hash;
+    } else {
+        record.hash = contentHash(texture.source);
+    }
+
+    // an existing output is current if it was made from the same content, or, when
+    // there is no record of it, if it is newer than the source
+    struct stat outSt;
+    if (stat(record.output.c_str(), &outSt) == 0 &&
+        (old ? old->output == record.output && old->hash == record.hash
+             : outSt.st_mtime >= st.st_mtime) &&
+        isTiledAndMipmapped(record.output)) {
+        texture.status = Texture::UpToDate;
+        return;
+    }
+
+    if (options.dryRun) {
+        texture.status = Texture::WouldConvert;
+        return;
+    }
+    if (abortRequested) return;
+    if (not convert(texture.source, record.output, options.verbose)) {
+        texture.status = Texture::Failed;
+        if (not options.force) abortRequested = true;
+        return;
+    }
+    texture.status = Texture::Converted;
+    if (options.cleanup) std::remove(texture.source.c_str());
+}
+
+// Point the asset paths of the layers at the converted files. Returns false if
+// a layer could not be saved
+bool
+updateLayers(const pxr::UsdStageRefPtr& stage, const std::set<std::string>& converted, bool verbose)
+{
+    bool ok = true;
+    for (const pxr::SdfLayerHandle& layer : stage->GetUsedLayers()) {
+        if (layer->IsAnonymous()) continue;
+
+        std::vector<pxr::SdfPath> attributes;
+        layer->Traverse(pxr::SdfPath::AbsoluteRootPath(), [&](const pxr::SdfPath& path) {
+            if (path.IsPropertyPath()) attributes.push_back(path);
+        });
+
+        bool changed = false;
+        for (const pxr::SdfPath& path : attributes) {
+            pxr::SdfAttributeSpecHandle attr = layer->GetAttributeAtPath(path);
+            if (not attr || attr->GetTypeName() != pxr::SdfValueTypeNames->Asset) continue;
+            const pxr::VtValue value = attr->GetDefaultValue();
+            if (not value.IsHolding<pxr::SdfAssetPath>()) continue;
+            const std::string& asset = value.UncheckedGet<pxr::SdfAssetPath>().GetAssetPath();
+            if (asset.empty() || not isImage(asset)) continue;
+
+            const std::string file = pxr::SdfComputeAssetPathRelativeToLayer(layer, asset);
+            bool any = false;
+            for (const std::string& f : expandUdim(file)) any = any || converted.count(f);
+            if (not any) continue;
+
+            attr->SetDefaultValue(pxr::VtValue(pxr::SdfAssetPath(txPath(asset))));
+            changed = true;
+        }
+
+        if (changed) {
+            if (verbose) log(std::cout, "Updating ", layer->GetRealPath());
+            if (not layer->Save()) {
+                log(std::cerr, "Cannot write ", layer->GetRealPath());
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+}
+
+int
+main(int argc, char* argv[])
+{
+    Options options;
+    bool help = false;
+    if (not parseArgs(argc, argv, options, help)) {
+        std::cerr << usage(argv[0]);
+        return 1;
+    }
+    if (help) {
+        std::cout << usage(argv[0]);
+        return 0;
+    }
+    if (options.manifest.empty()) options.manifest = options.inputFile + ".mipmap_manifest";
+    std::signal(SIGINT, signalHandler);
+
+    auto start = std::chrono::steady_clock::now();
+    pxr::UsdStageRefPtr stage = pxr::UsdStage::Open(options.inputFile);
+    if (not stage) {
+        std::cerr << "Error reading " << options.inputFile << '\n';
+        return 1;
+    }
+    const std::set<std::string> sources = findTextures(stage);
+    log(std::cout, "Found ", sources.size(), " images in ", secondsSince(start), "s");
+    if (sources.empty()) return 0;
+
+    std::vector<Texture> textures;
+    textures.reserve(sources.size());
+    for (const std::string& source : sources) {
+        textures.emplace_back();
+        textures.back().source = source;
+    }
+    const Manifest previous = readManifest(options.manifest);
+
+    // Textures are converted in parallel. OIIO threads are only used to share out
+    // the cores when there are fewer textures than cores
+    start = std::chrono::steady_clock::now();
+    const unsigned threads = options.threads ? options.threads :
+        std::max(1u, std::thread::hardware_concurrency());
+    OIIO::attribute("threads", int(std::max<size_t>(1, threads / textures.size())));
+    std::atomic<size_t> done(0);
+    tbb::task_arena arena(int(threads));
+    arena.execute([&] {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, textures.size(), 1),
+            [&](const tbb::blocked_range<size_t>& r) {
+                for (size_t i = r.begin(); i < r.end(); ++i) {
+                    if (abortRequested) return;
+                    processTexture(textures[i], previous, options);
+                    const size_t n = ++done;
+                    if (options.verbose || textures[i].status == Texture::Converted) {
+                        log(std::cout, "[", n, "/", textures.size(), "] ", textures[i].source);
+                    }
+                }
+            }, tbb::simple_partitioner());
+    });
+
+    size_t counts[Texture::Failed + 1] = {};
+    Manifest manifest;
+    std::set<std::string> converted;
+    for (const Texture& texture : textures) {
+        ++counts[texture.status];
+        switch (texture.status) {
+        case Texture::Mipmapped:
+            manifest[texture.source] = texture.record;
+            break;
+        case Texture::UpToDate:
+        case Texture::Converted:
+            manifest[texture.source] = texture.record;
+            converted.insert(texture.source);
+            break;
+        case Texture::WouldConvert:
+            log(std::cout, "Would convert ", texture.source);
+            break;
+        default:
+            break;
+        }
+    }
+    log(std::cout, counts[Texture::Converted], " converted, ",
+        counts[Texture::UpToDate], " up to date, ",
+        counts[Texture::Mipmapped], " already mipmapped, ",
+        counts[Texture::Failed], " failed in ", secondsSince(start), "s");
+    if (options.dryRun) {
+        log(std::cout, counts[Texture::WouldConvert], " would be converted");
+        return 0;
+    }
+
+    // keep the records of images that were not seen this time (another shot may use them)
+    for (const auto& entry : previous) manifest.insert(entry);
+    if (not writeManifest(options.manifest, manifest)) {
+        std::cerr << "Cannot write " << options.manifest << '\n';
+    }
+    if (abortRequested) {
+        std::cerr << "Aborting without updating any usd files\n";
+        return 1;
+    }
+
+    if (not options.noExport) {
+        start = std::chrono::steady_clock::now();
+        if (not updateLayers(stage, converted, options.verbose)) return 1;
+        log(std::cout, "Updated usd files in ", secondsSince(start), "s");
+    }
+    return counts[Texture::Failed] ? 1 : 0;
+}
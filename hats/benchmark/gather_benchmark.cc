@@ -0,0 +1,173 @@
+// Copyright 2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+// Times the parallel gathers of Gather.h against the serial loops they replaced, and
+// checks that both give the same result. Only a wrong result fails : the times are
+// printed for comparison between builds and machines.
+// Usage: hats_benchmark_gather [instance count] [curve vertex count]
+
+#include <hydramoonray/Gather.h>
+
+#include <pxr/base/gf/matrix4d.h>
+#include <pxr/base/gf/vec3f.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// best of several runs, in milliseconds
+template <typename F>
+double
+bestTime(F f)
+{
+    double best = 0;
+    for (int run = 0; run < 5; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        f();
+        const double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+        if (run == 0 || ms < best) best = ms;
+    }
+    return best;
+}
+
+// Indices in a scattered order, as a point instancer with prototypes mixed together
+// produces for each prototype. Indices >= valueCount wrap around
+pxr::VtIntArray
+makeIndices(size_t count, size_t range)
+{
+    pxr::VtIntArray indices(count);
+    for (size_t i = 0; i < count; ++i) indices[i] = int((i * 7919) % range);
+    return indices;
+}
+
+template <typename T, typename Make>
+pxr::VtArray<T>
+makeValues(size_t count, Make make)
+{
+    pxr::VtArray<T> values(count);
+    for (size_t i = 0; i < count; ++i) values[i] = make(i);
+    return values;
+}
+
+// compare gatherWrapped with the serial modulo loop it replaced in Instancer
+template <typename T>
+bool
+compareWrapped(const std::string& name, const pxr::VtArray<T>& values, const pxr::VtIntArray& indices)
+{
+    std::vector<T> serial;
+    const double serialMs = bestTime([&] {
+        serial.resize(indices.size());
+        for (size_t i = 0; i < indices.size(); ++i) serial[i] = values[indices[i] % values.size()];
+    });
+    std::vector<T> parallel;
+    const double parallelMs = bestTime([&] {
+        hdMoonray::gatherWrapped(parallel, values, indices, [](const T& v) { return v; });
+    });
+
+    std::cout << name << ": " << indices.size() << " instances from " << values.size()
+              << " values, serial " << serialMs << " ms, gatherWrapped " << parallelMs
+              << " ms (x" << serialMs / std::max(parallelMs, 1e-6) << ")" << std::endl;
+    if (serial == parallel) return true;
+    std::cerr << name << ": gatherWrapped does not match the serial gather" << std::endl;
+    return false;
+}
+
+// compare gatherValue, used to expand the vertex primvars of indexed curves, with a
+// serial gather
+template <typename T>
+bool
+compareExpand(const std::string& name, const pxr::VtArray<T>& values, const pxr::VtIntArray& indices)
+{
+    pxr::VtArray<T> serial;
+    const double serialMs = bestTime([&] {
+        serial.resize(indices.size());
+        for (size_t i = 0; i < indices.size(); ++i) serial[i] = values[indices[i]];
+    });
+    pxr::VtValue parallel;
+    const pxr::VtValue value(values);
+    const double parallelMs = bestTime([&] { parallel = hdMoonray::gatherValue(value, indices); });
+
+    std::cout << name << ": " << indices.size() << " curve vertices from " << values.size()
+              << " values, serial " << serialMs << " ms, gatherValue " << parallelMs
+              << " ms (x" << serialMs / std::max(parallelMs, 1e-6) << ")" << std::endl;
+    if (parallel.IsHolding<pxr::VtArray<T>>() && parallel.UncheckedGet<pxr::VtArray<T>>() == serial) {
+        return true;
+    }
+    std::cerr << name << ": gatherValue does not match the serial gather" << std::endl;
+    return false;
+}
+
+// compare the width to radius loop of BasisCurves with the copy and divide it replaced
+bool
+compareRadius(const pxr::VtFloatArray& widths)
+{
+    std::vector<float> before;
+    const double beforeMs = bestTime([&] {
+        before.assign(widths.begin(), widths.end());
+        for (float& r : before) r /= 2;
+    });
+    std::vector<float> after;
+    const double afterMs = bestTime([&] {
+        const float* src = widths.cdata();
+        const size_t n = widths.size();
+        after.resize(n);
+        float* dst = after.data();
+        for (size_t i = 0; i < n; ++i) dst[i] = src[i] * 0.5f;
+    });
+
+    std::cout << "curve radius: " << widths.size() << " widths, copy and divide " << beforeMs
+              << " ms, indexed multiply " << afterMs << " ms (x"
+              << beforeMs / std::max(afterMs, 1e-6) << ")" << std::endl;
+    if (before == after) return true;
+    std::cerr << "curve radius: results differ" << std::endl;
+    return false;
+}
+
+}
+
+int
+main(int argc, char* argv[])
+{
+    const size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 5000000;
+    const size_t curveVertexCount = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 8000000;
+    if (count == 0 || curveVertexCount == 0) {
+        std::cerr << "usage: " << argv[0] << " [instance count] [curve vertex count]" << std::endl;
+        return 2;
+    }
+
+    bool ok = true;
+    const pxr::VtIntArray indices = makeIndices(count, count);
+    // a primvar per instance, the usual case, where the modulo is skipped
+    ok = compareWrapped("float3 primvar", makeValues<pxr::GfVec3f>(count, [](size_t i) {
+        return pxr::GfVec3f(float(i), float(i) * 0.5f, 1.0f); }), indices) && ok;
+    ok = compareWrapped("float primvar", makeValues<float>(count, [](size_t i) {
+        return float(i); }), indices) && ok;
+    // fewer values than instances : every index wraps
+    ok = compareWrapped("wrapped float3 primvar", makeValues<pxr::GfVec3f>(count / 3 + 1, [](size_t i) {
+        return pxr::GfVec3f(float(i)); }), indices) && ok;
+
+    // xform_list, with fewer instances as the matrices are large
+    const size_t xformCount = std::max<size_t>(count / 5, 1);
+    ok = compareWrapped("instance transforms", makeValues<pxr::GfMatrix4d>(xformCount, [](size_t i) {
+        return pxr::GfMatrix4d(1.0).SetTranslateOnly(pxr::GfVec3d(double(i), 0.0, 0.0)); }),
+        makeIndices(xformCount, xformCount)) && ok;
+
+    // An indexed groom : each point is shared by two curve vertices
+    const size_t pointCount = curveVertexCount / 2 + 1;
+    const pxr::VtIntArray curveIndices = makeIndices(curveVertexCount, pointCount);
+    ok = compareExpand("curve points", makeValues<pxr::GfVec3f>(pointCount, [](size_t i) {
+        return pxr::GfVec3f(float(i), 0.0f, float(i % 8)); }), curveIndices) && ok;
+    const pxr::VtFloatArray widths = makeValues<float>(pointCount, [](size_t i) {
+        return 0.01f + float(i % 8) * 0.001f; });
+    ok = compareExpand("curve widths", widths, curveIndices) && ok;
+    ok = compareRadius(makeValues<float>(curveVertexCount, [&](size_t i) {
+        return widths[curveIndices[i]]; })) && ok;
+
+    return ok ? 0 : 1;
+}
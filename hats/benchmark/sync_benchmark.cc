@@ -0,0 +1,428 @@
+// Copyright 2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+// Times Hydra syncs of generated scenes through the hydramoonray library being built,
+// with rendering disabled, as hd_usd2rdl does. Each case builds its scene in memory,
+// times the first sync, then makes the edits it is about and times the syncs they
+// cause. The times are printed : a case only fails if the scene cannot be synced, or
+// if a result it checks is wrong.
+// Usage: hats_benchmark_sync <case> [count]
+
+#include <hd_usd2rdl/FreeCamera.h>
+#include <hd_usd2rdl/SceneDelegate.h>
+
+#include <hydramoonray/NullRenderer.h>
+#include <hydramoonray/RenderDelegate.h>
+
+#include <pxr/base/arch/fileSystem.h>
+#include <pxr/base/tf/fileUtils.h>
+#include <pxr/base/tf/pySafePython.h>
+#include <pxr/base/work/threadLimits.h>
+#include <pxr/imaging/hd/engine.h>
+#include <pxr/imaging/hd/renderIndex.h>
+#include <pxr/imaging/hdx/renderTask.h>
+#include <pxr/usd/sdf/layer.h>
+#include <pxr/usd/usd/stage.h>
+#include <pxr/usd/usdGeom/cube.h>
+#include <pxr/usd/usdGeom/pointInstancer.h>
+#include <pxr/usd/usdGeom/tokens.h>
+#include <pxr/usd/usdGeom/xform.h>
+#include <pxr/usd/usdLux/sphereLight.h>
+#include <pxr/usd/usdShade/material.h>
+#include <pxr/usd/usdShade/materialBindingAPI.h>
+#include <pxr/usd/usdShade/shader.h>
+#include <pxr/usdImaging/usdImaging/delegate.h>
+
+#include <scene_rdl2/scene/rdl2/SceneObject.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace {
+
+// A render delegate with rendering disabled, and the delegates and render task that
+// sync a stage into it
+class Session
+{
+public:
+    Session(const pxr::UsdStageRefPtr& stage,
+            const pxr::HdRenderSettingsMap& settings = pxr::HdRenderSettingsMap()) :
+        mStage(stage),
+        mRenderDelegate(new hdMoonray::NullRenderer(), settings)
+    {
+        mRenderDelegate.setDisableRender(true);
+        mRenderIndex.reset(pxr::HdRenderIndex::New(&mRenderDelegate, {}));
+        mUsdDelegate.reset(new pxr::UsdImagingDelegate(mRenderIndex.get(),
+                                                       pxr::SdfPath::AbsoluteRootPath()));
+        mUsdDelegate->Populate(stage->GetPseudoRoot());
+
+        const pxr::TfTokenVector purposes = { pxr::UsdGeomTokens->default_ };
+        pxr::HdRprimCollection collection(pxr::HdTokens->geometry,
+                                          pxr::HdReprSelector(pxr::HdReprTokens->refined));
+        collection.SetRootPath(pxr::SdfPath::AbsoluteRootPath());
+        const pxr::TfToken aov("color");
+        const int width = 640, height = 480;
+        mAppDelegate.reset(new hd_usd2rdl::SceneDelegate(mRenderIndex.get(),
+            pxr::SdfPath::AbsoluteRootPath().AppendChild(pxr::TfToken("app_scene"))));
+        mAppDelegate->populate(hd_usd2rdl::FreeCamera(stage, float(height) / width,
+                                                      pxr::UsdTimeCode::Default(), purposes),
+                               width, height, collection, purposes, aov,
+                               mRenderDelegate.GetDefaultAovDescriptor(aov));
+        mTasks = { mRenderIndex->GetTask(mAppDelegate->getTaskId()) };
+    }
+
+    // sync the changes made to the stage, returning the time taken in milliseconds
+    double sync()
+    {
+        mUsdDelegate->ApplyPendingUpdates();
+        const auto start = std::chrono::steady_clock::now();
+        mEngine.Execute(mRenderIndex.get(), &mTasks);
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void setTime(double time) { mUsdDelegate->SetTime(pxr::UsdTimeCode(time)); }
+
+    const pxr::UsdStageRefPtr& stage() const { return mStage; }
+    hdMoonray::RenderDelegate& renderDelegate() { return mRenderDelegate; }
+
+private:
+    // in order of destruction
+    pxr::UsdStageRefPtr mStage;
+    hdMoonray::RenderDelegate mRenderDelegate;
+    std::unique_ptr<pxr::HdRenderIndex> mRenderIndex;
+    std::unique_ptr<pxr::UsdImagingDelegate> mUsdDelegate;
+    std::unique_ptr<hd_usd2rdl::SceneDelegate> mAppDelegate;
+    pxr::HdEngine mEngine;
+    pxr::HdTaskSharedPtrVector mTasks;
+};
+
+// path of the i'th of count prims, in groups of 1000
+pxr::SdfPath
+primPath(const std::string& name, size_t i)
+{
+    return pxr::SdfPath("/World/group" + std::to_string(i / 1000) + "/" + name + std::to_string(i));
+}
+
+pxr::SdfPath
+groupPath(size_t group)
+{
+    return pxr::SdfPath("/World/group" + std::to_string(group));
+}
+
+// count cubes on a grid, in groups of 1000
+pxr::UsdStageRefPtr
+makeCubes(size_t count)
+{
+    pxr::UsdStageRefPtr stage = pxr::UsdStage::CreateInMemory();
+    pxr::UsdGeomXform::Define(stage, pxr::SdfPath("/World"));
+    for (size_t g = 0; g < (count + 999) / 1000; ++g) pxr::UsdGeomXform::Define(stage, groupPath(g));
+    for (size_t i = 0; i < count; ++i) {
+        pxr::UsdGeomCube cube = pxr::UsdGeomCube::Define(stage, primPath("cube", i));
+        cube.AddTranslateOp().Set(pxr::GfVec3d(double(i % 1000) * 3, double(i / 1000) * 3, 0));
+    }
+    return stage;
+}
+
+// Isolate selection : hide, then show again, every cube
+int
+visibility(size_t count)
+{
+    Session session(makeCubes(count));
+    std::cout << "visibility: first sync of " << count << " cubes " << session.sync() << " ms" << std::endl;
+
+    const size_t groups = (count + 999) / 1000;
+    for (const pxr::TfToken& v : { pxr::UsdGeomTokens->invisible, pxr::UsdGeomTokens->inherited }) {
+        for (size_t g = 0; g < groups; ++g) {
+            pxr::UsdGeomImageable(session.stage()->GetPrimAtPath(groupPath(g))).CreateVisibilityAttr().Set(v);
+        }
+        std::cout << "visibility: " << (v == pxr::UsdGeomTokens->invisible ? "hide " : "show ")
+                  << count << " cubes " << session.sync() << " ms" << std::endl;
+    }
+    return 0;
+}
+
+const pxr::TfToken diffuseColor("diffuseColor");
+
+// give each cube its own UsdPreviewSurface material
+void
+addMaterials(const pxr::UsdStageRefPtr& stage, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const pxr::SdfPath path = primPath("material", i);
+        pxr::UsdShadeMaterial material = pxr::UsdShadeMaterial::Define(stage, path);
+        pxr::UsdShadeShader shader = pxr::UsdShadeShader::Define(stage, path.AppendChild(pxr::TfToken("surface")));
+        shader.CreateIdAttr(pxr::VtValue(pxr::TfToken("UsdPreviewSurface")));
+        shader.CreateInput(diffuseColor, pxr::SdfValueTypeNames->Color3f).Set(
+            pxr::GfVec3f(float(i % 10) * 0.1f, float(i / 10 % 10) * 0.1f, 0.5f));
+        material.CreateSurfaceOutput().ConnectToSource(shader.ConnectableAPI(), pxr::TfToken("surface"));
+        pxr::UsdShadeMaterialBindingAPI::Apply(stage->GetPrimAtPath(primPath("cube", i))).Bind(material);
+    }
+}
+
+// Material translation with one thread, then with all of them, and the update of
+// edited materials
+int
+materials(size_t count)
+{
+    const unsigned maxThreads = pxr::WorkGetConcurrencyLimit();
+    for (unsigned threads : { 1u, maxThreads }) {
+        pxr::WorkSetConcurrencyLimit(threads);
+        pxr::UsdStageRefPtr stage = makeCubes(count);
+        addMaterials(stage, count);
+        Session session(stage);
+        std::cout << "materials: first sync of " << count << " materials with " << threads
+                  << " threads " << session.sync() << " ms" << std::endl;
+
+        for (size_t i = 0; i < count; ++i) {
+            pxr::UsdShadeShader(stage->GetPrimAtPath(primPath("material", i).AppendChild(pxr::TfToken("surface"))))
+                .GetInput(diffuseColor).Set(pxr::GfVec3f(1.0f, 0.0f, 0.0f));
+        }
+        std::cout << "materials: edit of " << count << " materials with " << threads
+                  << " threads " << session.sync() << " ms" << std::endl;
+    }
+    return 0;
+}
+
+// Material translation in a session that fills an empty Material Cache, then in one
+// that loads it
+int
+materialCache(size_t count)
+{
+    const std::string directory = pxr::ArchMakeTmpSubdir(pxr::ArchGetTmpDir(), "hats_material_cache");
+    if (directory.empty()) {
+        std::cerr << "material cache: cannot make a directory" << std::endl;
+        return 1;
+    }
+    pxr::HdRenderSettingsMap settings;
+    settings[pxr::TfToken("materialCache")] = pxr::VtValue(directory);
+
+    size_t stored = 0;
+    bool ok = true;
+    for (const char* run : { "cold", "warm" }) {
+        pxr::UsdStageRefPtr stage = makeCubes(count);
+        addMaterials(stage, count);
+        Session session(stage, settings);
+        std::cout << "material cache: first sync of " << count << " materials, " << run << " cache "
+                  << session.sync() << " ms" << std::endl;
+
+        const hdMoonray::MaterialCache& cache = session.renderDelegate().materialCache();
+        std::cout << "material cache: " << cache.loadCount() << " fragments loaded, "
+                  << cache.storeCount() << " stored" << std::endl;
+        if (not stored) {
+            // every material is new
+            stored = cache.storeCount();
+            ok = cache.loadCount() == 0 && stored > 0;
+        } else {
+            // every material is loaded, nothing new is written
+            ok = ok && cache.loadCount() == stored && cache.storeCount() == 0;
+        }
+    }
+    pxr::TfRmTree(directory);
+    if (not ok) std::cerr << "material cache: unexpected fragment counts" << std::endl;
+    return ok ? 0 : 1;
+}
+
+// A light rig : scrub the intensity of one light
+int
+lights(size_t count)
+{
+    pxr::UsdStageRefPtr stage = makeCubes(1);
+    for (size_t i = 0; i < count; ++i) {
+        pxr::UsdLuxSphereLight light = pxr::UsdLuxSphereLight::Define(stage, primPath("light", i));
+        light.AddTranslateOp().Set(pxr::GfVec3d(double(i % 100), double(i / 100), 10.0));
+        light.CreateIntensityAttr().Set(1.0f);
+    }
+    Session session(stage);
+    std::cout << "lights: first sync of " << count << " lights " << session.sync() << " ms" << std::endl;
+
+    const int edits = 20;
+    pxr::UsdLuxSphereLight light(stage->GetPrimAtPath(primPath("light", count / 2)));
+    double total = 0;
+    for (int e = 0; e < edits; ++e) {
+        light.GetIntensityAttr().Set(1.0f + float(e + 1) * 0.1f);
+        total += session.sync();
+    }
+    std::cout << "lights: intensity edit of 1 of " << count << " lights " << total / edits
+              << " ms per edit" << std::endl;
+    return 0;
+}
+
+// a strip of two quads, skinned by a joint that bends the top quad until frame 3
+const char* const skinnedMesh = R"(#usda 1.0
+def SkelRoot "Root" {
+    rel skel:skeleton = <skeleton>
+    rel skel:animationSource = <animation>
+
+    def Skeleton "skeleton" {
+        uniform token[] joints = ["joint1", "joint1/joint2"]
+        uniform matrix4d[] bindTransforms = [
+            ( (1, 0, 0, 0), (0, 1, 0, 0), (0, 0, 1, 0), (0, 0, 0, 1) ),
+            ( (1, 0, 0, 0), (0, 1, 0, 0), (0, 0, 1, 0), (0, 1, 0, 1) )
+        ]
+        uniform matrix4d[] restTransforms = [
+            ( (1, 0, 0, 0), (0, 1, 0, 0), (0, 0, 1, 0), (0, 0, 0, 1) ),
+            ( (1, 0, 0, 0), (0, 1, 0, 0), (0, 0, 1, 0), (0, 1, 0, 1) )
+        ]
+    }
+
+    def SkelAnimation "animation" {
+        uniform token[] joints = ["joint1/joint2"]
+        quatf[] rotations.timeSamples = {
+            1: [(1, 0, 0, 0)],
+            3: [(0.7071, 0, 0, 0.7071)],
+        }
+        half3[] scales = [(1, 1, 1)]
+        float3[] translations = [(0, 1, 0)]
+    }
+
+    def Mesh "mesh" (
+        prepend apiSchemas = ["SkelBindingAPI"]
+    ) {
+        int[] faceVertexCounts = [4, 4]
+        int[] faceVertexIndices = [0, 1, 3, 2, 2, 3, 5, 4]
+        point3f[] points = [(0, 0, 0), (1, 0, 0), (0, 1, 0), (1, 1, 0), (0, 2, 0), (1, 2, 0)]
+        int[] primvars:skel:jointIndices = [0, 0, 0, 1, 1, 1] (
+            elementSize = 1
+            interpolation = "vertex"
+        )
+        float[] primvars:skel:jointWeights = [1, 1, 1, 1, 1, 1] (
+            elementSize = 1
+            interpolation = "vertex"
+        )
+    }
+}
+)";
+
+// Cached Skinning : play frames where the joints hold still, then one where they move.
+// The points must only be resent for the last one. They are replaced with an empty list
+// after each sync, so a resend can be seen without committing the scene
+int
+skinning(size_t count)
+{
+    pxr::UsdStageRefPtr stage = pxr::UsdStage::CreateInMemory();
+    stage->GetRootLayer()->ImportFromString(skinnedMesh);
+    pxr::HdRenderSettingsMap settings;
+    settings[pxr::TfToken("cachedSkinning")] = pxr::VtValue(true);
+    Session session(stage, settings);
+    session.setTime(3);
+    std::cout << "skinning: first sync " << session.sync() << " ms" << std::endl;
+
+    scene_rdl2::rdl2::SceneObject* mesh = session.renderDelegate().getSceneObject(pxr::SdfPath("/Root/mesh"));
+    if (not mesh) {
+        std::cerr << "skinning: /Root/mesh was not translated" << std::endl;
+        return 1;
+    }
+    const std::string vertexList("vertex_list_0");
+    auto clearPoints = [&] {
+        scene_rdl2::rdl2::SceneObject::UpdateGuard guard(mesh);
+        mesh->set(vertexList, scene_rdl2::rdl2::Vec3fVector());
+    };
+    if (mesh->get<scene_rdl2::rdl2::Vec3fVector>(vertexList).empty()) {
+        std::cerr << "skinning: no points were sent" << std::endl;
+        return 1;
+    }
+
+    bool ok = true;
+    double total = 0;
+    for (size_t frame = 4; frame < 4 + count; ++frame) {
+        clearPoints();
+        session.setTime(double(frame));
+        total += session.sync();
+        if (not mesh->get<scene_rdl2::rdl2::Vec3fVector>(vertexList).empty()) {
+            std::cerr << "skinning: points resent on frame " << frame << ", where the joints did not move"
+                      << std::endl;
+            ok = false;
+        }
+    }
+    std::cout << "skinning: " << count << " frames with still joints " << total / std::max<size_t>(count, 1)
+              << " ms per frame" << std::endl;
+
+    clearPoints();
+    session.setTime(2);
+    std::cout << "skinning: frame with moving joints " << session.sync() << " ms" << std::endl;
+    if (mesh->get<scene_rdl2::rdl2::Vec3fVector>(vertexList).size() != 6) {
+        std::cerr << "skinning: points not resent on a frame where the joints moved" << std::endl;
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
+
+// point instancer of count instances of prototype, along axis
+pxr::UsdGeomPointInstancer
+defineInstancer(const pxr::UsdStageRefPtr& stage, const pxr::SdfPath& path,
+                const pxr::SdfPath& prototype, size_t count, int axis)
+{
+    pxr::UsdGeomPointInstancer instancer = pxr::UsdGeomPointInstancer::Define(stage, path);
+    instancer.CreatePrototypesRel().AddTarget(prototype);
+    pxr::VtVec3fArray positions(count, pxr::GfVec3f(0.0f));
+    for (size_t i = 0; i < count; ++i) positions[i][axis] = float(i) * 0.1f;
+    instancer.CreatePositionsAttr().Set(positions);
+    instancer.CreateProtoIndicesAttr().Set(pxr::VtIntArray(count, 0));
+    return instancer;
+}
+
+// A light that is the prototype of nested point instancers, rows of 100 lights : move
+// the rows, then edit the light
+int
+instancedLights(size_t count)
+{
+    pxr::UsdStageRefPtr stage = makeCubes(1);
+    const pxr::SdfPath rows("/World/lights");
+    const pxr::SdfPath row = rows.AppendChild(pxr::TfToken("row"));
+    const pxr::SdfPath prototype = row.AppendChild(pxr::TfToken("light"));
+    pxr::UsdGeomPointInstancer outer = defineInstancer(stage, rows, row, std::max<size_t>(count / 100, 1), 2);
+    defineInstancer(stage, row, prototype, 100, 0);
+    pxr::UsdLuxSphereLight light = pxr::UsdLuxSphereLight::Define(stage, prototype);
+    light.CreateIntensityAttr().Set(1.0f);
+    Session session(stage);
+    std::cout << "instanced lights: first sync of " << count << " lights " << session.sync() << " ms" << std::endl;
+
+    pxr::VtVec3fArray positions;
+    outer.GetPositionsAttr().Get(&positions);
+    for (pxr::GfVec3f& p : positions) p[1] += 1.0f;
+    outer.GetPositionsAttr().Set(positions);
+    std::cout << "instanced lights: move " << count << " lights " << session.sync() << " ms" << std::endl;
+
+    light.GetIntensityAttr().Set(2.0f);
+    std::cout << "instanced lights: intensity edit of " << count << " lights " << session.sync()
+              << " ms" << std::endl;
+    return 0;
+}
+
+struct Case
+{
+    std::function<int(size_t)> run;
+    size_t defaultCount;
+};
+
+const std::map<std::string, Case> cases = {
+    { "instanced_lights", { instancedLights, 10000 } },
+    { "lights", { lights, 500 } },
+    { "material_cache", { materialCache, 5000 } },
+    { "materials", { materials, 5000 } },
+    { "skinning", { skinning, 10 } },
+    { "visibility", { visibility, 100000 } },
+};
+
+}
+
+int
+main(int argc, char* argv[])
+{
+    Py_Initialize(); // HDM-133: plugin loader assumes this has been done
+    auto it = argc > 1 ? cases.find(argv[1]) : cases.end();
+    if (it == cases.end()) {
+        std::cerr << "usage: " << argv[0] << " <case> [count]\ncases:";
+        for (const auto& c : cases) std::cerr << ' ' << c.first;
+        std::cerr << std::endl;
+        return 2;
+    }
+    const size_t count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : it->second.defaultCount;
+    return it->second.run(count);
+}
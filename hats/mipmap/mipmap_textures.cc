@@ -0,0 +1,165 @@
+// Copyright 2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+// Checks that usd_mipmap_textures converts a texture to a tiled, mipmapped .tx file and
+// records it in the manifest, that a second run finds it up to date, and that the usd
+// file is then updated to use the .tx file.
+// Usage: hats_mipmap_textures <usd_mipmap_textures> <scratch directory>
+
+#include <OpenImageIO/imageio.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+namespace {
+
+// a small gradient, written as a scanline tiff
+bool
+writeImage(const std::string& filename)
+{
+    const int size = 64;
+    std::vector<unsigned char> pixels(size * size * 3);
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            unsigned char* p = &pixels[(y * size + x) * 3];
+            p[0] = x * 4;
+            p[1] = y * 4;
+            p[2] = 128;
+        }
+    }
+    auto out = OIIO::ImageOutput::create(filename);
+    if (not out) return false;
+    const OIIO::ImageSpec spec(size, size, 3, OIIO::TypeDesc::UINT8);
+    if (not out->open(filename, spec)) return false;
+    const bool ok = out->write_image(OIIO::TypeDesc::UINT8, pixels.data());
+    return out->close() && ok;
+}
+
+void
+writeUsd(const std::string& filename)
+{
+    std::ofstream(filename) <<
+        "#usda 1.0\n"
+        "def Material \"material\"\n"
+        "{\n"
+        "    def Shader \"texture\"\n"
+        "    {\n"
+        "        uniform token info:id = \"UsdUVTexture\"\n"
+        "        asset inputs:file = @./texture.tif@\n"
+        "    }\n"
+        "}\n";
+}
+
+// runs the command, returning its output, or an empty string if it failed
+std::string
+run(const std::string& command)
+{
+    std::cout << command << std::endl;
+    std::string output;
+    FILE* pipe = popen(command.c_str(), "r");
+    if (not pipe) return output;
+    char buffer[256];
+    while (fgets(buffer, sizeof(buffer), pipe)) output += buffer;
+    const int status = pclose(pipe);
+    std::cout << output;
+    if (not WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cerr << "command failed" << std::endl;
+        return std::string();
+    }
+    return output;
+}
+
+bool
+contains(const std::string& text, const std::string& expected)
+{
+    if (text.find(expected) != std::string::npos) return true;
+    std::cerr << "expected '" << expected << "'" << std::endl;
+    return false;
+}
+
+bool
+isTiledAndMipmapped(const std::string& filename)
+{
+    auto in = OIIO::ImageInput::open(filename);
+    if (not in) {
+        std::cerr << "cannot read " << filename << std::endl;
+        return false;
+    }
+    const bool tiled = in->spec().tile_width > 0;
+    const bool mipmapped = in->seek_subimage(0, 1);
+    in->close();
+    if (not tiled || not mipmapped) std::cerr << filename << " is not tiled and mipmapped" << std::endl;
+    return tiled && mipmapped;
+}
+
+// the manifest must have one record, converting texture.tif to texture.tx
+bool
+checkManifest(const std::string& filename)
+{
+    std::ifstream in(filename);
+    std::string header;
+    std::getline(in, header);
+    std::vector<std::vector<std::string>> records;
+    for (std::string line; std::getline(in, line); ) {
+        std::istringstream stream(line);
+        records.emplace_back();
+        for (std::string field; std::getline(stream, field, '\t'); ) records.back().push_back(field);
+    }
+    auto endsWith = [](const std::string& s, const std::string& end) {
+        return s.size() >= end.size() && s.compare(s.size() - end.size(), end.size(), end) == 0;
+    };
+    if (records.size() == 1 && records[0].size() == 5 && records[0][0].size() == 16 &&
+        endsWith(records[0][3], "/texture.tif") && endsWith(records[0][4], "/texture.tx")) {
+        return true;
+    }
+    std::cerr << filename << " does not record the conversion of texture.tif" << std::endl;
+    return false;
+}
+
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <usd_mipmap_textures> <scratch directory>" << std::endl;
+        return 2;
+    }
+    const std::string tool = argv[1];
+    const std::string dir = argv[2];
+    mkdir(dir.c_str(), 0777);
+    const std::string usd = dir + "/scene.usda";
+    const std::string manifest = usd + ".mipmap_manifest";
+    // start from scratch, as the results of a previous run would be up to date
+    for (const std::string& file : { usd, manifest, dir + "/texture.tx" }) std::remove(file.c_str());
+    if (not writeImage(dir + "/texture.tif")) {
+        std::cerr << "cannot write " << dir << "/texture.tif: " << OIIO::geterror() << std::endl;
+        return 1;
+    }
+    writeUsd(usd);
+
+    bool ok = true;
+    std::string output = run("'" + tool + "' --no_export '" + usd + "'");
+    ok = contains(output, "1 converted, 0 up to date") && ok;
+    ok = isTiledAndMipmapped(dir + "/texture.tx") && ok;
+    ok = checkManifest(manifest) && ok;
+
+    // nothing changed : the texture is not converted again
+    output = run("'" + tool + "' '" + usd + "'");
+    ok = contains(output, "0 converted, 1 up to date") && ok;
+    ok = checkManifest(manifest) && ok;
+
+    std::ifstream in(usd);
+    std::stringstream updated;
+    updated << in.rdbuf();
+    ok = contains(updated.str(), "@./texture.tx@") && ok;
+
+    return ok ? 0 : 1;
+}
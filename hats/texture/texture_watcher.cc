@@ -0,0 +1,90 @@
+// Copyright 2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+// Checks that TextureWatcher reports only the texture files that are written, including
+// files replaced by a rename, UDIM tiles, and textures added before the watcher was
+// turned off and on again. Usage: hats_texture_watcher <scratch directory>
+
+#include <hydramoonray/TextureWatcher.h>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace {
+
+void
+write(const std::string& filename)
+{
+    std::ofstream(filename) << "texture";
+}
+
+// waits for the watcher to see a change, and checks it is the expected file
+bool
+check(hdMoonray::TextureWatcher& watcher, const std::string& expected)
+{
+    for (int i = 0; i < 100 && not watcher.hasChanges(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    // let any other (wrong) events arrive
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    const std::vector<std::string> changed = watcher.takeChanged();
+    if (changed.size() == 1 && changed[0] == expected) return true;
+    std::cerr << "expected " << expected << ", got";
+    for (const std::string& file : changed) std::cerr << ' ' << file;
+    std::cerr << std::endl;
+    return false;
+}
+
+}
+
+int
+main(int argc, char* argv[])
+{
+#ifdef __linux__
+    if (argc != 2) {
+        std::cerr << "usage: " << argv[0] << " <scratch directory>" << std::endl;
+        return 2;
+    }
+    const std::string dir = argv[1];
+    mkdir(dir.c_str(), 0777);
+    for (const char* name : { "a.tx", "b.tx", "c.1001.tx", "c.1002.tx", "unwatched.tx" }) {
+        write(dir + "/" + name);
+    }
+
+    hdMoonray::TextureWatcher watcher;
+    watcher.add(dir + "/a.tx"); // added while off
+    watcher.setEnabled(true);
+    watcher.add(dir + "/b.tx");
+    watcher.add(dir + "/c.<UDIM>.tx");
+
+    bool ok = true;
+    write(dir + "/a.tx");
+    ok = check(watcher, dir + "/a.tx") && ok;
+
+    // saved to a temporary file and renamed
+    write(dir + "/c.1002.tmp");
+    std::rename((dir + "/c.1002.tmp").c_str(), (dir + "/c.1002.tx").c_str());
+    ok = check(watcher, dir + "/c.1002.tx") && ok;
+
+    write(dir + "/unwatched.tx");
+    write(dir + "/b.tx");
+    ok = check(watcher, dir + "/b.tx") && ok;
+
+    // the watches are restored when turned on again
+    watcher.setEnabled(false);
+    watcher.setEnabled(true);
+    write(dir + "/c.1001.tx");
+    ok = check(watcher, dir + "/c.1001.tx") && ok;
+
+    return ok ? 0 : 1;
+#else
+    return 0; // no inotify
+#endif
+}
@@ -0,0 +1,66 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "AttributePlan.h"
+
+#include <pxr/imaging/hd/tokens.h>
+
+#include <scene_rdl2/scene/rdl2/SceneClass.h>
+
+#include <unordered_map>
+
+namespace {
+
+// RDL light attributes with an equivalent UsdLux parameter. "intensity" is
+// handled by Light::Sync()
+const std::unordered_map<std::string, pxr::TfToken>&
+luxNames()
+{
+    static const std::unordered_map<std::string, pxr::TfToken> map = {
+        { "color", pxr::HdLightTokens->color },
+        { "exposure", pxr::HdLightTokens->exposure },
+        { "radius", pxr::HdLightTokens->radius },
+        { "normalized", pxr::HdLightTokens->normalize },
+        { "width", pxr::HdLightTokens->width },
+        { "height", pxr::HdLightTokens->height },
+        { "angular_extent", pxr::HdLightTokens->angle },
+        { "texture", pxr::HdLightTokens->textureFile },
+        { "lens_radius", pxr::HdLightTokens->radius },
+        { "outer_cone_angle", pxr::HdLightTokens->shapingConeAngle },
+        { "inner_cone_angle", pxr::HdLightTokens->shapingConeSoftness }
+    };
+    return map;
+}
+
+// prefixes for AttributePlan::prefixed()
+const char* const prefixes[] = { "procedural:", "moonray:sceneVariable:", "sceneVariable_" };
+
+}
+
+namespace hdMoonray {
+
+AttributePlan::AttributePlan(const scene_rdl2::rdl2::SceneClass& sceneClass)
+{
+    const bool isLight = sceneClass.getDeclaredInterface() & scene_rdl2::rdl2::INTERFACE_LIGHT;
+    for (auto it = sceneClass.beginAttributes(); it != sceneClass.endAttributes(); ++it) {
+        const std::string& name = (*it)->getName();
+        Entry entry{*it, pxr::TfToken(name), pxr::TfToken("moonray:" + name), pxr::TfToken()};
+        if (isLight) {
+            auto lux = luxNames().find(name);
+            if (lux != luxNames().end()) entry.luxName = lux->second;
+        }
+        mEntries.push_back(std::move(entry));
+        if ((*it)->getType() == scene_rdl2::rdl2::TYPE_STRING && (*it)->isFilename()) {
+            mFilenames.push_back(*it);
+        }
+    }
+    for (const char* prefix : prefixes) {
+        std::vector<pxr::TfToken>& tokens = mPrefixed[prefix];
+        tokens.reserve(mEntries.size());
+        for (const Entry& entry : mEntries) {
+            tokens.emplace_back(prefix + entry.name.GetString());
+        }
+    }
+}
+
+}
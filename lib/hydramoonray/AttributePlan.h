@@ -0,0 +1,57 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <tbb/tbb_machine.h> // fix for icc-19/tbb bug
+#include <pxr/base/tf/token.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace scene_rdl2 { namespace rdl2 {
+class Attribute;
+class SceneClass;
+}}
+
+namespace hdMoonray {
+
+// The attributes of a SceneClass with the Hydra names used to look them up
+//
+// Syncing a light, camera, procedural, shader or the scene variables walks every
+// attribute of the RDL class and asks Hydra for a parameter named after it. The plan
+// makes those names once per class, so that a sync does no string concatenation or
+// token interning. Plans are owned by the RenderDelegate (see attributePlan()), and are
+// not changed after they are made, so they are read without locking.
+
+class AttributePlan
+{
+public:
+    struct Entry {
+        const scene_rdl2::rdl2::Attribute* attribute;
+        pxr::TfToken name;        // the attribute name, as used by shader node parameters
+        pxr::TfToken moonrayName; // "moonray:" + name
+        pxr::TfToken luxName;     // equivalent UsdLux parameter of a light attribute, or empty
+    };
+
+    explicit AttributePlan(const scene_rdl2::rdl2::SceneClass& sceneClass);
+
+    const std::vector<Entry>& entries() const { return mEntries; }
+
+    // string attributes holding file names, such as textures
+    const std::vector<const scene_rdl2::rdl2::Attribute*>& filenames() const { return mFilenames; }
+
+    // Tokens of prefix + name, in the same order as entries(). Only the prefixes used
+    // by the syncs ("procedural:", "moonray:sceneVariable:" and "sceneVariable_") are
+    // made : others throw std::out_of_range
+    const std::vector<pxr::TfToken>& prefixed(const std::string& prefix) const
+    { return mPrefixed.at(prefix); }
+
+private:
+    std::vector<Entry> mEntries;
+    std::vector<const scene_rdl2::rdl2::Attribute*> mFilenames;
+    std::map<std::string, std::vector<pxr::TfToken>> mPrefixed;
+};
+
+}
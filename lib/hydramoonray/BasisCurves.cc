@@ -6,17 +6,23 @@
 //
 // - linear, bezier and bspline bases (NOT Catmull Rom)
 // - nonperiodic only, periodic curves are NOT supported
-// - non-indexed verts only, indexed verts are NOT supported
+// - indexed verts (curveIndices) are expanded to non-indexed form, since
+//   RdlCurveGeometry has no index list
 //
 // Tessellation rate and roundness are set based on the refineLevel
-// display style ("complexity" in usd_view). As with other RDL geometry
-// attributes, these can be overridden by a primvar.
+// display style ("complexity" in usd_view). If the "Adaptive Tessellation"
+// setting is on, the tessellation rate may be reduced for curves that are
+// small in the render camera. As with other RDL geometry attributes, these
+// can be overridden by a primvar.
 
 #include "BasisCurves.h"
+#include "Gather.h"
 #include "RenderDelegate.h"
 #include "HdmLog.h"
 #include <pxr/base/gf/vec2f.h>
+#include <pxr/base/gf/vec3f.h>
 #include <scene_rdl2/scene/rdl2/Geometry.h>
+#include <algorithm>
 #include <iostream>
 
 using namespace pxr;
@@ -26,10 +32,10 @@ namespace {
 // round curves are more expensive than rayFacing, so are not generated
 // at this refine level and below
 constexpr int REFINE_LEVEL_FLAT_CURVES = 2;
-// tessellation rate used at refine level 0
-constexpr int TESS_RATE_LOW = 1;
-// tessellation rate used at refine level greater than 0
-constexpr int TESS_RATE_NORMAL = 4;
+// log2 of the tessellation rate used at refine level 0 (rate 1)
+constexpr int TESS_LEVEL_LOW = 0;
+// log2 of the tessellation rate used at refine level greater than 0 (rate 4)
+constexpr int TESS_LEVEL_NORMAL = 2;
 
 // constants for RDL attrs and enums used herein
 const std::string rdlClassCurves("RdlCurveGeometry");
@@ -46,6 +52,7 @@ const std::string rdlAttrTessellationRate("tessellation_rate");
 const std::string rdlAttrReverseNormals("reverse_normals");
 const std::string rdlAttrUvList("uv_list");
 const std::string rdlAttrRadiusList("radius_list");
+const TfToken primvarTessellationRate("moonray:tessellation_rate");
 
 }
 
@@ -89,16 +96,54 @@ BasisCurves::GetInitialDirtyBitsMask() const
     return (HdDirtyBits)mask;
 }
 
+bool
+BasisCurves::syncCurveIndices(const HdBasisCurvesTopology& topology)
+{
+    // returns true if the indices changed
+    VtIntArray indices = topology.HasIndices() ? topology.GetCurveIndices() : VtIntArray();
+    if (indices == mCurveIndices) return false;
+    mCurveIndices = std::move(indices);
+
+    mRequiredVertexCount = 0;
+    if (not mCurveIndices.empty()) {
+        auto range = std::minmax_element(mCurveIndices.cbegin(), mCurveIndices.cend());
+        if (*range.first < 0) {
+            Logger::error(GetId(), ": negative curve index, indices ignored");
+            mCurveIndices = VtIntArray();
+        } else {
+            mRequiredVertexCount = size_t(*range.second) + 1;
+        }
+    }
+    return true;
+}
+
+VtValue
+BasisCurves::expandVertexPrimvar(const VtValue& value)
+{
+    // RdlCurveGeometry has no index list, so vertex primvars of indexed
+    // curves have to be expanded to one value per curve vertex
+    if (mCurveIndices.empty() || value.IsEmpty() || not value.IsArrayValued()) {
+        return value;
+    }
+    if (value.GetArraySize() < mRequiredVertexCount) {
+        Logger::error(GetId(), ": primvar has ", value.GetArraySize(),
+                      " values, but curve indices require ", mRequiredVertexCount);
+        return value;
+    }
+    VtValue result = gatherValue(value, mCurveIndices);
+    if (not result.IsEmpty()) {
+        return result;
+    }
+    Logger::warn(GetId(), ": ", value.GetTypeName(), " primvar cannot be expanded by curve indices");
+    return value;
+}
+
 void
 BasisCurves::syncTopology(const HdBasisCurvesTopology& topology)
 {
     VtIntArray curveVertexCounts = topology.GetCurveVertexCounts();
     const int* p = reinterpret_cast<const int*>(&curveVertexCounts[0]);
-    geometry()->set(rdlAttrCurveVertexCounts, IntVector(p, p + curveVertexCounts.size()));
-
-    if (topology.HasIndices()) {
-        Logger::error(GetId(), ": curve indices are not supported");
-    }
+    setChunkedAttribute(rdlAttrCurveVertexCounts, IntVector(p, p + curveVertexCounts.size()));
 
     // note Hydra has separate type (linear, cubic) and basis (bezier, bSpline, catmullRom)
     // where basis is ignored for linear type. RDL has a single type enum (linear, bezier, bspline)
@@ -119,22 +164,51 @@ BasisCurves::syncTopology(const HdBasisCurvesTopology& topology)
 }
 
 void
-BasisCurves::syncDisplayStyle(const HdDisplayStyle& style)
+BasisCurves::syncDisplayStyle(const HdDisplayStyle& style,
+                              HdSceneDelegate* sceneDelegate,
+                              RenderDelegate& renderDelegate)
 {
     // refineLevel is set by the "complexity" menu item in usdview
     // and is an integer 0 to 8. At low refineLevel, we simplify the geometry
     // to improve render performance. These defaults can be overridden by primvars
     // moonray:curves_subtype and moonray::tessellation_rate
     static TfToken curvesSubtypeToken("moonray:curves_subtype");
-    static TfToken tessellationRateToken("moonray:tessellation_rate");
     if (not isPrimvarUsed(curvesSubtypeToken)) {
         bool round = style.refineLevel > REFINE_LEVEL_FLAT_CURVES;
         geometry()->set(rdlAttrCurvesSubtype, round ? rdlCurvesSubtype_round : 
                                                       rdlCurvesSubtype_rayFacing);
     }
-    if (not isPrimvarUsed(tessellationRateToken)) {
-        int tessellationRate = (style.refineLevel < 1) ? TESS_RATE_LOW : TESS_RATE_NORMAL;
-        geometry()->set(rdlAttrTessellationRate, tessellationRate);
+    mRefineLevel = style.refineLevel;
+    syncTessellationRate(sceneDelegate, renderDelegate);
+}
+
+void
+BasisCurves::syncTessellationRate(HdSceneDelegate* sceneDelegate,
+                                  RenderDelegate& renderDelegate)
+{
+    // the rate set by the refine level is the maximum
+    const int maxLevel = (mRefineLevel < 1) ? TESS_LEVEL_LOW : TESS_LEVEL_NORMAL;
+    if (isPrimvarUsed(primvarTessellationRate)) {
+        unregisterTessellation(renderDelegate);
+    } else if (renderDelegate.getAdaptiveTessellation()) {
+        // each span is assumed to cover an equal share of the projected size
+        const VtIntArray& counts = mTopology.GetCurveVertexCounts();
+        size_t spanCount = 0;
+        for (int n : counts) spanCount += std::max(n - 1, 1);
+        const float spansAcross = counts.empty() ? 1.0f : float(spanCount) / counts.size();
+        registerTessellation(sceneDelegate, renderDelegate, maxLevel, spanCount, spansAcross, 1);
+    } else {
+        unregisterTessellation(renderDelegate);
+        setTessellationLevel(geometry(), maxLevel);
+    }
+}
+
+void
+BasisCurves::setTessellationLevel(scene_rdl2::rdl2::Geometry* geometry, int level)
+{
+    const int tessellationRate = 1 << level;
+    if (geometry->get<int>(rdlAttrTessellationRate) != tessellationRate) {
+        geometry->set(rdlAttrTessellationRate, tessellationRate);
     }
 }
 
@@ -147,12 +221,17 @@ BasisCurves::syncAttributes(HdSceneDelegate* sceneDelegate,
     // Overridden from GeometryMixin to sync additional data in the
     // BasicCurves schema to RDL attributes. Will be called from syncAll()
     if (HdChangeTracker::IsTopologyDirty(*dirtyBits, GetId())) {
-        syncTopology(GetBasisCurvesTopology(sceneDelegate));
+        syncTopology(mTopology);
     }    
         
     if (HdChangeTracker::IsDisplayStyleDirty(*dirtyBits, GetId()) ||
         HdChangeTracker::IsTopologyDirty(*dirtyBits, GetId())) {
-        syncDisplayStyle(GetDisplayStyle(sceneDelegate));
+        syncDisplayStyle(GetDisplayStyle(sceneDelegate), sceneDelegate, renderDelegate);
+    } else if (renderDelegate.getAdaptiveTessellation() &&
+               (HdChangeTracker::IsTransformDirty(*dirtyBits, GetId()) ||
+                HdChangeTracker::IsExtentDirty(*dirtyBits, GetId()))) {
+        // the curves moved : update their bounds
+        syncTessellationRate(sceneDelegate, renderDelegate);
     }
 
     // base class handles transform and double-sided
@@ -177,21 +256,25 @@ BasisCurves::primvarChanged(HdSceneDelegate *sceneDelegate,
 
     if (name == stToken || name == uvToken) {
         if (value.IsEmpty()) {
-            geometry()->resetToDefault(rdlAttrUvList);
+            resetChunkedAttribute(rdlAttrUvList);
         } else if (value.IsHolding<VtVec2fArray>()) {
             const VtVec2fArray& v = value.UncheckedGet<VtVec2fArray>();
             const Vec2f* p = reinterpret_cast<const Vec2f*>(&v[0]);
-            geometry()->set(rdlAttrUvList, Vec2fVector(p, p + v.size()));
+            setChunkedAttribute(rdlAttrUvList, Vec2fVector(p, p + v.size()));
         }
     } else if (name ==  HdTokens->widths) {
         if (value.IsEmpty()) {
-            geometry()->resetToDefault(rdlAttrRadiusList);
+            resetChunkedAttribute(rdlAttrRadiusList);
         } else if (value.IsHolding<VtFloatArray>()) {
             const VtFloatArray& v = value.UncheckedGet<VtFloatArray>();
-            FloatVector w{v.begin(), v.end()};
-            // width is diameter : convert to radius
-            for (float& r : w) r /= 2;
-            geometry()->set(rdlAttrRadiusList, std::move(w));
+            // width is diameter : convert to radius. Simple indexed loop
+            // so that the compiler can vectorize it
+            const float* src = v.cdata();
+            const size_t n = v.size();
+            FloatVector w(n);
+            float* dst = w.data();
+            for (size_t i = 0; i < n; ++i) dst[i] = src[i] * 0.5f;
+            setChunkedAttribute(rdlAttrRadiusList, std::move(w));
         }
     } else {
         // allow GeometryMixin to handle all other cases, including
@@ -212,6 +295,28 @@ BasisCurves::Sync(HdSceneDelegate *sceneDelegate,
     
     _UpdateVisibility(sceneDelegate, dirtyBits);
     _UpdateInstancer(sceneDelegate, dirtyBits);
+
+    if (syncAsProxy(sceneDelegate, renderDelegate, dirtyBits)) {
+        hdmLogSyncEnd(GetId());
+        return;
+    }
+
+    // topology is needed before primvars are synced, since the curve
+    // indices are used to expand vertex primvars. If they change, every
+    // vertex primvar has to be resent.
+    if (HdChangeTracker::IsTopologyDirty(*dirtyBits, GetId())) {
+        mTopology = GetBasisCurvesTopology(sceneDelegate);
+        if (syncCurveIndices(mTopology)) {
+            *dirtyBits |= HdChangeTracker::DirtyPoints |
+                          HdChangeTracker::DirtyNormals |
+                          HdChangeTracker::DirtyWidths |
+                          HdChangeTracker::DirtyPrimvar;
+        }
+    }
+
+    // large curve sets may be split into several geometry objects
+    const VtIntArray curveVertexCounts = mTopology.GetCurveVertexCounts();
+    updateChunkLayout(sceneDelegate, renderDelegate, rdlClassCurves, &curveVertexCounts, dirtyBits);
     
     syncAll(rdlClassCurves, sceneDelegate, renderDelegate, dirtyBits, reprToken);
     
@@ -22,6 +22,8 @@ public:
 
     void Finalize(pxr::HdRenderParam* renderParam) override;
 
+    bool supportsProxy() const override { return true; }
+
  protected:
     
     // Hydra overrides
@@ -34,12 +36,26 @@ public:
     void primvarChanged(pxr::HdSceneDelegate *sceneDelegate, RenderDelegate& renderDelegate,
                         const pxr::TfToken& name,  const pxr::VtValue& value,
                         const pxr::HdInterpolation& interp, const pxr::TfToken& role) override;
+    pxr::VtValue expandVertexPrimvar(const pxr::VtValue& value) override;
 private:
     BasisCurves(const BasisCurves&)             = delete;
     BasisCurves &operator =(const BasisCurves&) = delete;
 
     void syncTopology(const pxr::HdBasisCurvesTopology& topology);
-    void syncDisplayStyle(const pxr::HdDisplayStyle& style);
+    void syncDisplayStyle(const pxr::HdDisplayStyle& style,
+                          pxr::HdSceneDelegate* sceneDelegate, RenderDelegate& renderDelegate);
+    void syncTessellationRate(pxr::HdSceneDelegate* sceneDelegate, RenderDelegate& renderDelegate);
+    void setTessellationLevel(scene_rdl2::rdl2::Geometry* geometry, int level) override;
+    bool syncCurveIndices(const pxr::HdBasisCurvesTopology& topology);
+
+    // topology at last sync
+    pxr::HdBasisCurvesTopology mTopology;
+    // curveIndices, if the curves are indexed, otherwise empty
+    pxr::VtIntArray mCurveIndices;
+    // minimum size of a vertex primvar for mCurveIndices to be valid
+    size_t mRequiredVertexCount = 0;
+    // refine level from the display style at last sync
+    int mRefineLevel = 0;
 };
 
 }
@@ -14,6 +14,7 @@
 #include "HdmLog.h"
 
 #include <pxr/imaging/hd/sceneDelegate.h>
+#include <pxr/imaging/cameraUtil/conformWindow.h>
 #include "pxr/base/gf/frustum.h"
 #include "pxr/base/gf/camera.h"
 
@@ -109,6 +110,10 @@ Camera::Sync(pxr::HdSceneDelegate* sceneDelegate,
         updateCamera(sceneDelegate, renderDelegate, bits);
     }
 
+    if (bits & (CamDirtyView | CamDirtyProj)) {
+        renderDelegate.syncCullingCamera(*this, sceneDelegate->GetRenderIndex());
+    }
+
     hdmLogSyncEnd(id);
 }
 
@@ -280,13 +285,11 @@ Camera::updateCamera(pxr::HdSceneDelegate* sceneDelegate, RenderDelegate& render
         }
 
         // overwrite any attributes with moonray:xyz attributes
-        const SceneClass& sceneClass = mCamera->getSceneClass();
-        for (auto it = sceneClass.beginAttributes(); it != sceneClass.endAttributes(); ++it) {
-            const std::string& attrName = (*it)->getName();
-
-            pxr::VtValue val = sceneDelegate->GetCameraParamValue(id, pxr::TfToken("moonray:"+attrName));
+        const AttributePlan& plan = renderDelegate.attributePlan(mCamera->getSceneClass());
+        for (const AttributePlan::Entry& entry : plan.entries()) {
+            pxr::VtValue val = sceneDelegate->GetCameraParamValue(id, entry.moonrayName);
             if (not val.IsEmpty()) {
-                ValueConverter::setAttribute(mCamera, *it, val);
+                ValueConverter::setAttribute(mCamera, entry.attribute, val);
             }
             // Fixme: if value is not set it should be reset to default
         }
@@ -308,6 +311,22 @@ Camera::updateCamera(pxr::HdSceneDelegate* sceneDelegate, RenderDelegate& render
 // 
 // aspectRatio is the shape of the image. The camera's window policy (GetWindowPolicy)
 // will be used to adjust the camera as needed to match.
+pxr::GfMatrix4d
+Camera::worldToNdc() const
+{
+#if PXR_VERSION >= 2203
+    const pxr::GfMatrix4d view(GetTransform().GetInverse());
+    pxr::GfMatrix4d projection(ComputeProjectionMatrix());
+#else
+    const pxr::GfMatrix4d view(GetViewMatrix());
+    pxr::GfMatrix4d projection(GetProjectionMatrix());
+#endif
+    if (mDesiredAspectRatio != 0.0) {
+        projection = pxr::CameraUtilConformedWindow(projection, GetWindowPolicy(), mDesiredAspectRatio);
+    }
+    return view * projection;
+}
+
 void
 Camera::setAsPrimaryCamera(RenderDelegate& renderDelegate, double aspectRatio)
 {
@@ -38,6 +38,8 @@ public:
     std::pair<float, float> getTimeSamplingInterval() const;
 
     void setAsPrimaryCamera(RenderDelegate&, double aspectRatio);
+    // world to NDC matrix, conformed to the aspect ratio of the last render pass
+    pxr::GfMatrix4d worldToNdc() const;
     pxr::HdSceneDelegate* getSceneDelegate() const { return mSceneDelegate; }
 
 private:
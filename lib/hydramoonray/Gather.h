@@ -0,0 +1,110 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+// Parallel indexed gather, used to expand or split primvar arrays
+
+#include <tbb/tbb_machine.h> // fix for icc-19/tbb bug
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <pxr/base/gf/vec2f.h>
+#include <pxr/base/gf/vec3f.h>
+#include <pxr/base/vt/array.h>
+#include <pxr/base/vt/types.h>
+#include <pxr/base/vt/value.h>
+
+#include <string>
+
+namespace hdMoonray {
+
+// arrays smaller than this are gathered serially
+constexpr size_t PARALLEL_GATHER_GRAIN = 16384;
+
+// Returns dst with dst[i] = src[indices[i]] for i in [0,count). Caller must ensure that
+// the indices are in range. Dst may be a std::vector or VtArray (but not a BoolVector,
+// which is a deque)
+template <typename Dst, typename Src>
+Dst
+gather(const Src& src, const int* indices, size_t count)
+{
+    Dst dst(count);
+    auto* d = dst.data();
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, count, PARALLEL_GATHER_GRAIN),
+        [&](const tbb::blocked_range<size_t>& r) {
+            for (size_t i = r.begin(); i < r.end(); ++i) {
+                d[i] = src[indices[i]];
+            }
+        });
+    return dst;
+}
+
+template <typename Dst, typename Src>
+Dst
+gather(const Src& src, const pxr::VtIntArray& indices)
+{
+    return gather<Dst>(src, indices.cdata(), indices.size());
+}
+
+// Index into an array of size n, wrapping out of range indices around as Hydra
+// instancers do. In range indices, the usual case, skip the division
+inline size_t
+wrapIndex(int index, size_t n)
+{
+    const size_t i = size_t(index);
+    return i < n ? i : i % n;
+}
+
+// Sets dst[i] = convert(src[indices[i] % src.size()]) for every index, resizing dst
+// to match. Src is a VtArray and must not be empty
+template <typename Dst, typename Src, typename Convert>
+void
+gatherWrapped(Dst& dst, const Src& src, const pxr::VtIntArray& indices, Convert convert)
+{
+    const size_t count = indices.size();
+    const size_t n = src.size();
+    dst.resize(count);
+    auto* d = dst.data();
+    const auto* s = src.cdata();
+    const int* idx = indices.cdata();
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, count, PARALLEL_GATHER_GRAIN),
+        [&](const tbb::blocked_range<size_t>& r) {
+            for (size_t i = r.begin(); i < r.end(); ++i) {
+                d[i] = convert(s[wrapIndex(idx[i], n)]);
+            }
+        });
+}
+
+namespace detail {
+
+template <typename T>
+bool
+gatherValue(const pxr::VtValue& value, const pxr::VtIntArray& indices, pxr::VtValue& result)
+{
+    if (not value.IsHolding<pxr::VtArray<T>>()) return false;
+    result = pxr::VtValue(gather<pxr::VtArray<T>>(value.UncheckedGet<pxr::VtArray<T>>(), indices));
+    return true;
+}
+
+}
+
+// Gather the VtArray held by value. Returns an empty VtValue if the
+// array type is not supported
+inline pxr::VtValue
+gatherValue(const pxr::VtValue& value, const pxr::VtIntArray& indices)
+{
+    pxr::VtValue result;
+    if (detail::gatherValue<pxr::GfVec3f>(value, indices, result) ||
+        detail::gatherValue<float>(value, indices, result) ||
+        detail::gatherValue<pxr::GfVec2f>(value, indices, result) ||
+        detail::gatherValue<int>(value, indices, result) ||
+        detail::gatherValue<unsigned int>(value, indices, result) ||
+        detail::gatherValue<bool>(value, indices, result) ||
+        detail::gatherValue<std::string>(value, indices, result)) {
+        return result;
+    }
+    return pxr::VtValue();
+}
+
+}
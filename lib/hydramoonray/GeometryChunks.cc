@@ -0,0 +1,293 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+// Contains the functions on GeometryMixin that split large geometry into chunks
+//
+// A Points or BasisCurves prim with more elements (points or curves) than the
+// "Geometry Chunk Size" render setting is split into several RDL geometry objects,
+// each holding a spatially coherent subset of the elements. Each chunk then has a
+// smaller BVH that can be built in parallel with the others, and an edit to the
+// points only resends the chunks whose values actually changed.
+//
+// Chunk 0 is mGeometry, so the usual sync code runs unchanged. Per-vertex and per-element
+// data is split between the chunks by setChunkedAttribute() and primvarUserData(), and
+// all other attributes are copied from mGeometry to the other chunks by syncChunks().
+// The layout only depends on the element and vertex counts, so it is stable while
+// points are animated. Instanced geometry is never chunked.
+
+#include "GeometryMixin.h"
+#include "Gather.h"
+#include "RenderDelegate.h"
+#include "ValueConverter.h"
+#include <scene_rdl2/scene/rdl2/Geometry.h>
+#include <pxr/base/gf/range3f.h>
+#include <tbb/parallel_sort.h>
+#include <algorithm>
+
+using namespace pxr;
+using namespace scene_rdl2::rdl2;
+using scene_rdl2::logging::Logger;
+
+namespace {
+
+    // spread the low 10 bits of v so that there are 2 zero bits between each
+    uint32_t expandBits(uint32_t v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // 30 bit Morton code of a point with coordinates in [0,1]
+    uint32_t mortonCode(const GfVec3f& p)
+    {
+        auto quantize = [](float f) {
+            return uint32_t(std::min(std::max(f * 1024.0f, 0.0f), 1023.0f));
+        };
+        return (expandBits(quantize(p[0])) << 2) |
+               (expandBits(quantize(p[1])) << 1) |
+                expandBits(quantize(p[2]));
+    }
+}
+
+namespace hdMoonray {
+
+void
+GeometryMixin::updateChunkLayout(HdSceneDelegate* sceneDelegate,
+                                 RenderDelegate& renderDelegate,
+                                 const std::string& className,
+                                 const VtIntArray* curveVertexCounts,
+                                 HdDirtyBits* dirtyBits)
+{
+    const SdfPath& id = rprim.GetId();
+    if (not (*dirtyBits & (HdChangeTracker::DirtyPoints |
+                           HdChangeTracker::DirtyTopology |
+                           HdChangeTracker::DirtyInstancer))) {
+        return;
+    }
+
+    // count the elements and vertices
+    const size_t chunkSize = renderDelegate.getGeometryChunkSize();
+    VtValue points;
+    size_t elementCount = 0;
+    size_t vertexCount = 0;
+    if (chunkSize > 0 && rprim.GetInstancerId().IsEmpty()) {
+        if (curveVertexCounts) {
+            elementCount = curveVertexCounts->size();
+            for (int n : *curveVertexCounts) vertexCount += n;
+        } else {
+            points = rprim.GetPrimvar(sceneDelegate, HdTokens->points);
+            elementCount = vertexCount = points.GetArraySize();
+        }
+    }
+    size_t chunkCount = 0;
+    if (chunkSize > 0 && elementCount > chunkSize) {
+        chunkCount = (elementCount + chunkSize - 1) / chunkSize;
+    }
+
+    // keep the current layout if the counts have not changed
+    if (chunkCount == 0 && mChunks.empty()) return;
+    if (chunkCount == mChunks.size() &&
+        elementCount == mChunkElementCount &&
+        vertexCount == mChunkVertexCount &&
+        (not curveVertexCounts || *curveVertexCounts == mChunkCurveVertexCounts)) {
+        return;
+    }
+
+    // make the new layout
+    std::vector<Chunk> chunks(chunkCount);
+    if (chunkCount) {
+        if (points.IsEmpty()) {
+            points = rprim.GetPrimvar(sceneDelegate, HdTokens->points);
+        }
+        points = expandVertexPrimvar(points);
+        if (not points.IsHolding<VtVec3fArray>() || points.GetArraySize() != vertexCount) {
+            Logger::warn(id, ": points do not match topology, geometry is not chunked");
+            chunks.clear();
+            chunkCount = 0;
+        }
+    }
+    if (chunkCount) {
+        const VtVec3fArray& p = points.UncheckedGet<VtVec3fArray>();
+
+        // index of the first vertex of each element
+        std::vector<int> firstVertex(elementCount + 1);
+        for (size_t e = 0; e < elementCount; ++e) {
+            firstVertex[e + 1] = firstVertex[e] + (curveVertexCounts ? (*curveVertexCounts)[e] : 1);
+        }
+
+        // order the elements along a Morton curve through the bounding box. Each
+        // element is represented by its first vertex (the root, for hair)
+        GfRange3f bbox;
+        for (size_t e = 0; e < elementCount; ++e) bbox.UnionWith(p[firstVertex[e]]);
+        const GfVec3f size = bbox.GetSize();
+        const GfVec3f scale(size[0] > 0 ? 1 / size[0] : 0,
+                            size[1] > 0 ? 1 / size[1] : 0,
+                            size[2] > 0 ? 1 / size[2] : 0);
+        std::vector<std::pair<uint32_t, int>> order(elementCount);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, elementCount, PARALLEL_GATHER_GRAIN),
+            [&](const tbb::blocked_range<size_t>& r) {
+                for (size_t e = r.begin(); e < r.end(); ++e) {
+                    const GfVec3f q = GfCompMult(p[firstVertex[e]] - bbox.GetMin(), scale);
+                    order[e] = std::make_pair(mortonCode(q), int(e));
+                }
+            });
+        tbb::parallel_sort(order.begin(), order.end());
+
+        // consecutive runs of chunkSize elements form the chunks
+        tbb::parallel_for(size_t(0), chunkCount, [&](size_t c) {
+            const size_t begin = c * chunkSize;
+            const size_t end = std::min(begin + chunkSize, elementCount);
+            std::vector<int> elements(end - begin);
+            for (size_t i = begin; i < end; ++i) elements[i - begin] = order[i].second;
+            // keep the original order within a chunk, for better locality when gathering
+            std::sort(elements.begin(), elements.end());
+            Chunk& chunk = chunks[c];
+            chunk.elements.assign(elements.begin(), elements.end());
+            size_t chunkVertexCount = 0;
+            for (int e : elements) chunkVertexCount += firstVertex[e + 1] - firstVertex[e];
+            chunk.vertices.resize(chunkVertexCount);
+            int* v = chunk.vertices.data();
+            for (int e : elements) {
+                for (int i = firstVertex[e]; i < firstVertex[e + 1]; ++i) *v++ = i;
+            }
+        });
+
+        // create the chunk objects. Chunk 0 is mGeometry
+        for (size_t c = 1; c < chunkCount; ++c) {
+            const std::string name = id.GetString() + "/Chunk" + std::to_string(c);
+            SceneObject* object = renderDelegate.createSceneObject(className, name);
+            if (not object) {
+                // already printed an error message
+                chunks.clear();
+                chunkCount = 0;
+                break;
+            }
+            chunks[c].geometry = object->asA<Geometry>();
+            if (c >= mChunks.size()) {
+                // may get back an unused chunk from an earlier layout
+                UpdateGuard guard(renderDelegate, chunks[c].geometry);
+                chunks[c].geometry->resetAllToDefault();
+            }
+        }
+    }
+
+    // RDL objects cannot be deleted, so hide chunks that are no longer used
+    for (size_t c = std::max(chunkCount, size_t(1)); c < mChunks.size(); ++c) {
+        UpdateGuard guard(renderDelegate, mChunks[c].geometry);
+        hideGeometry(mChunks[c].geometry);
+    }
+
+    mChunks = std::move(chunks);
+    mChunkElementCount = chunkCount ? elementCount : 0;
+    mChunkVertexCount = chunkCount ? vertexCount : 0;
+    mChunkCurveVertexCounts = (chunkCount && curveVertexCounts) ? *curveVertexCounts : VtIntArray();
+    // the new chunks need every attribute copied to them
+    mChunksCopyAll = true;
+    // unchunked attributes are only set on mGeometry
+    if (not chunkCount) mChunkedAttributes.clear();
+    mUserDataChanged = true;
+    if (chunkCount) {
+        Logger::info(id, ": split into ", chunkCount, " chunks");
+    }
+
+    // all the chunked data has to be resent, and new chunks need a layer assignment
+    *dirtyBits |= HdChangeTracker::DirtyPoints |
+                  HdChangeTracker::DirtyNormals |
+                  HdChangeTracker::DirtyWidths |
+                  HdChangeTracker::DirtyPrimvar |
+                  HdChangeTracker::DirtyTopology |
+                  HdChangeTracker::DirtyMaterialId |
+                  HdChangeTracker::DirtyCategories;
+}
+
+template <typename T>
+void
+GeometryMixin::setChunked(const std::string& name, T&& values)
+{
+    if (mChunks.empty()) {
+        mGeometry->set(name, std::move(values));
+        return;
+    }
+
+    mChunkedAttributes.insert(name);
+    const bool perVertex = values.size() == mChunkVertexCount;
+    if (not perVertex && values.size() != mChunkElementCount) {
+        Logger::warn(rprim.GetId(), ": ", name, " with ", values.size(),
+                     " values cannot be split between chunks");
+        for (size_t c = 0; c < mChunks.size(); ++c) {
+            chunkGeometry(c)->set(name, values);
+        }
+        return;
+    }
+
+    for (size_t c = 0; c < mChunks.size(); ++c) {
+        const VtIntArray& indices = perVertex ? mChunks[c].vertices : mChunks[c].elements;
+        T part = gather<T>(values, indices);
+        Geometry* geometry = chunkGeometry(c);
+        // unchanged chunks are not touched, so that they are not resent
+        if (geometry->get<T>(name) != part) {
+            geometry->set(name, std::move(part));
+        }
+    }
+}
+
+void
+GeometryMixin::setChunkedAttribute(const std::string& name, IntVector&& values)
+{
+    setChunked(name, std::move(values));
+}
+
+void
+GeometryMixin::setChunkedAttribute(const std::string& name, FloatVector&& values)
+{
+    setChunked(name, std::move(values));
+}
+
+void
+GeometryMixin::setChunkedAttribute(const std::string& name, Vec2fVector&& values)
+{
+    setChunked(name, std::move(values));
+}
+
+void
+GeometryMixin::setChunkedAttribute(const std::string& name, Vec3fVector&& values)
+{
+    setChunked(name, std::move(values));
+}
+
+void
+GeometryMixin::resetChunkedAttribute(const std::string& name)
+{
+    if (not mChunks.empty()) mChunkedAttributes.insert(name);
+    for (size_t c = 0; c < std::max(mChunks.size(), size_t(1)); ++c) {
+        chunkGeometry(c)->resetToDefault(name);
+    }
+}
+
+void
+GeometryMixin::syncChunks()
+{
+    // copy the attributes that are not chunked (transform, visibility, primvar
+    // overrides etc) from mGeometry to the other chunks. After a new layout all of them
+    // are copied, otherwise only the ones set since the last commit, and only changed
+    // values are set. primitive_attributes is handled by syncPrimitiveAttributes()
+    if (mChunks.size() < 2) return;
+    const SceneClass& sceneClass = mGeometry->getSceneClass();
+    std::vector<const Attribute*> attributes;
+    for (auto it = sceneClass.beginAttributes(); it != sceneClass.endAttributes(); ++it) {
+        const std::string& attrName = (*it)->getName();
+        if (attrName == "primitive_attributes" || mChunkedAttributes.count(attrName)) continue;
+        if (mChunksCopyAll || mGeometry->hasChanged(*it)) attributes.push_back(*it);
+    }
+    mChunksCopyAll = false;
+    for (size_t c = 1; c < mChunks.size(); ++c) {
+        for (const Attribute* attribute : attributes) {
+            ValueConverter::copyAttribute(mChunks[c].geometry, *mGeometry, attribute);
+        }
+    }
+}
+
+}
@@ -12,7 +12,9 @@
 #include <scene_rdl2/scene/rdl2/Geometry.h>
 #include <scene_rdl2/scene/rdl2/Layer.h>
 #include <scene_rdl2/scene/rdl2/UserData.h>
+#include <pxr/base/gf/range3d.h>
 #include <pxr/base/gf/vec2f.h>
+#include <deque>
 #include <iostream>
 
 using namespace pxr;
@@ -22,6 +24,23 @@ using scene_rdl2::logging::Logger;
 namespace {
     // primvar used to set side type
     const TfToken primvarMoonraySideType{"moonray:side_type"};
+
+    // bounding box proxies are RdlMeshGeometry boxes
+    const std::string rdlClassProxy("RdlMeshGeometry");
+
+    struct AttrPair {const scene_rdl2::rdl2::AttributeKey<bool>& moonrayKey; pxr::TfToken usdKey;};
+
+    const AttrPair visibleAttrs[] = {
+        { scene_rdl2::rdl2::Geometry::sVisibleCamera, pxr::TfToken("moonray:visible_in_camera") },
+        { scene_rdl2::rdl2::Geometry::sVisibleShadow, pxr::TfToken("moonray:visible_shadow") },
+        { scene_rdl2::rdl2::Geometry::sVisibleDiffuseReflection, pxr::TfToken("moonray:visible_diffuse_reflection") },
+        { scene_rdl2::rdl2::Geometry::sVisibleDiffuseTransmission, pxr::TfToken("moonray:visible_diffuse_transmission") },
+        { scene_rdl2::rdl2::Geometry::sVisibleGlossyReflection, pxr::TfToken("moonray:visible_glossy_reflection") },
+        { scene_rdl2::rdl2::Geometry::sVisibleGlossyTransmission, pxr::TfToken("moonray:visible_glossy_transmission") },
+        { scene_rdl2::rdl2::Geometry::sVisibleMirrorReflection, pxr::TfToken("moonray:visible_mirror_reflection") },
+        { scene_rdl2::rdl2::Geometry::sVisibleMirrorTransmission, pxr::TfToken("moonray:visible_mirror_transmission") },
+        { scene_rdl2::rdl2::Geometry::sVisiblePhase, pxr::TfToken("moonray:visible_volume") },
+};
 }
 
 namespace hdMoonray {
@@ -37,6 +56,26 @@ GeometryMixin::resetGeometryObject(RenderDelegate& renderDelegate)
         forceInvisible();
         mGeometry = nullptr;
     }
+    // a new object starts visible and unassigned
+    mForcedInvisible = false;
+    mAssigned = false;
+    unregisterTessellation(renderDelegate);
+    releaseAllSharedUserData(renderDelegate);
+    mSkinning = SkinningCache();
+    // chunk 0 was mGeometry
+    for (size_t c = 1; c < mChunks.size(); ++c) {
+        UpdateGuard guard(renderDelegate, mChunks[c].geometry);
+        hideGeometry(mChunks[c].geometry);
+    }
+    mChunks.clear();
+    for (const CategoryCopy& copy : mCategoryCopies) {
+        UpdateGuard guard(renderDelegate, copy.geometry);
+        hideGeometry(copy.geometry);
+    }
+    mCategoryCopies.clear();
+    hideProxy(renderDelegate);
+    mChunkElementCount = mChunkVertexCount = 0;
+    mChunkCurveVertexCounts = VtIntArray();
 }
 
 bool
@@ -65,6 +104,7 @@ GeometryMixin::createGeometry(RenderDelegate& renderDelegate,
         // is no longer in use. We want to reset all attributes so that sync is correct.
         UpdateGuard guard(renderDelegate, mGeometry);
         mGeometry->resetAllToDefault();
+        mUserDataChanged = true;
     } 
     return mGeometry != nullptr;
 }
@@ -81,6 +121,11 @@ GeometryMixin::syncAll(const std::string& className,
 
         // mGeometry must be non-null
         UpdateGuard guard(renderDelegate, mGeometry);
+        // other chunks are updated along with mGeometry
+        std::deque<UpdateGuard> chunkGuards;
+        for (size_t c = 1; c < mChunks.size(); ++c) {
+            chunkGuards.emplace_back(mChunks[c].geometry);
+        }
 
         // primvars may override other means of setting attributes
         // we handle this by syncing primvars first...
@@ -95,12 +140,162 @@ GeometryMixin::syncAll(const std::string& className,
 
         // populate the "primitive_attributes" list with user data
         syncPrimitiveAttributes();
+
+        // copy everything else to the other chunks
+        syncChunks();
+
+        // copies made while instancing need everything
+        syncCategoryCopies();
     }
 
     // clear dirty bits to indicate everything is synced
     *dirtyBits &= ~HdChangeTracker::AllSceneDirtyBits;
 }
 
+void
+GeometryMixin::registerTessellation(HdSceneDelegate* sceneDelegate, RenderDelegate& renderDelegate,
+                                    int maxLevel, size_t elementCount, float elementsAcross,
+                                    int costExponent)
+{
+    RenderDelegate::TessellationPrim prim;
+    prim.geometry = this;
+    prim.maxLevel = maxLevel;
+    prim.elementCount = elementCount;
+    prim.elementsAcross = std::max(elementsAcross, 1.0f);
+    prim.costExponent = costExponent;
+    // instances may be anywhere, so they keep the maximum level (empty extent)
+    const SdfPath& id = rprim.GetId();
+    if (rprim.GetInstancerId().IsEmpty()) {
+        prim.extent = sceneDelegate->GetExtent(id);
+        prim.xform = sceneDelegate->GetTransform(id);
+    }
+    renderDelegate.setTessellationPrim(id, prim);
+    mTessellationRegistered = true;
+}
+
+void
+GeometryMixin::unregisterTessellation(RenderDelegate& renderDelegate)
+{
+    if (mTessellationRegistered) {
+        renderDelegate.removeTessellationPrim(rprim.GetId());
+        mTessellationRegistered = false;
+    }
+}
+
+void
+GeometryMixin::applyTessellationLevel(RenderDelegate& renderDelegate, int level)
+{
+    if (not mGeometry) return;
+    for (size_t c = 0; c < std::max(mChunks.size(), size_t(1)); ++c) {
+        Geometry* geometry = chunkGeometry(c);
+        UpdateGuard guard(renderDelegate, geometry);
+        setTessellationLevel(geometry, level);
+    }
+}
+
+bool
+GeometryMixin::syncAsProxy(HdSceneDelegate* sceneDelegate,
+                           RenderDelegate& renderDelegate,
+                           HdDirtyBits* dirtyBits)
+{
+    // non-hero geometry may be replaced by a bounding box
+    if (supportsProxy() && rprim.GetInstancerId().IsEmpty() &&
+        renderDelegate.isProxy(rprim.GetId())) {
+        syncProxy(sceneDelegate, renderDelegate, dirtyBits);
+        *dirtyBits &= ~HdChangeTracker::AllSceneDirtyBits;
+        return true;
+    }
+    hideProxy(renderDelegate);
+    return false;
+}
+
+void
+GeometryMixin::syncProxy(HdSceneDelegate* sceneDelegate,
+                         RenderDelegate& renderDelegate,
+                         HdDirtyBits* dirtyBits)
+{
+    const SdfPath& id = rprim.GetId();
+
+    // the full geometry may have been translated before
+    if (mGeometry) resetGeometryObject(renderDelegate);
+
+    bool created = false;
+    if (not mProxy) {
+        SceneObject* object = renderDelegate.createSceneObject(rdlClassProxy, id.GetString() + "/Proxy");
+        // if there was an error this already printed an error message
+        if (not object) return;
+        mProxy = object->asA<Geometry>();
+        created = true;
+    }
+    UpdateGuard guard(renderDelegate, mProxy);
+    if (created || not mProxyActive) {
+        // everything has to be set
+        mProxy->resetAllToDefault();
+        // boxes may be seen from inside
+        mProxy->set(mProxy->sSideTypeKey, 0);
+        *dirtyBits |= HdChangeTracker::DirtyExtent |
+                      HdChangeTracker::DirtyTransform |
+                      HdChangeTracker::DirtyVisibility |
+                      HdChangeTracker::DirtyMaterialId |
+                      HdChangeTracker::DirtyCategories;
+        mProxyActive = true;
+    }
+
+    if (*dirtyBits & (HdChangeTracker::DirtyExtent | HdChangeTracker::DirtyPoints)) {
+        const GfRange3d extent = sceneDelegate->GetExtent(id);
+        Vec3fVector vertices(8);
+        if (not extent.IsEmpty()) {
+            for (size_t i = 0; i < 8; ++i) {
+                const GfVec3d c = extent.GetCorner(i);
+                vertices[i] = Vec3f(float(c[0]), float(c[1]), float(c[2]));
+            }
+        }
+        // GfRange3d corner i has x from bit 0, y from bit 1 and z from bit 2
+        static const IntVector faceVertexCounts(6, 4);
+        static const IntVector verticesByIndex {
+            0, 2, 3, 1,   4, 5, 7, 6,   0, 1, 5, 4,
+            2, 6, 7, 3,   0, 4, 6, 2,   1, 3, 7, 5 };
+        mProxy->set("vertex_list_0", std::move(vertices));
+        mProxy->set("face_vertex_count", faceVertexCounts);
+        mProxy->set("vertices_by_index", verticesByIndex);
+        mProxy->set("is_subd", false);
+    }
+
+    if (HdChangeTracker::IsTransformDirty(*dirtyBits, id)) {
+        const GfMatrix4d xform = sceneDelegate->GetTransform(id);
+        mProxy->set(mProxy->sNodeXformKey, reinterpret_cast<const Mat4d&>(xform));
+    }
+
+    if (*dirtyBits & (HdChangeTracker::DirtyCategories |
+                      HdChangeTracker::DirtyMaterialId |
+                      HdChangeTracker::DirtyVisibility)) {
+        if (rprim.IsVisible() && not sceneDelegate->GetExtent(id).IsEmpty()) {
+            for (const auto& i : visibleAttrs) mProxy->set(i.moonrayKey, true);
+            LayerAssignment assignment;
+            renderDelegate.updateAssignmentFromCategories(assignment, sceneDelegate->GetCategories(id));
+            rprim.SetMaterialId(sceneDelegate->GetMaterialId(id));
+            Material::get(assignment, rprim.GetMaterialId(), renderDelegate,
+                          sceneDelegate, &rprim, isVolume());
+            // displacing a box is not useful
+            assignment.mDisplacement = nullptr;
+            renderDelegate.assign(mProxy, assignment);
+        } else {
+            hideGeometry(mProxy);
+            renderDelegate.addUnassigned(mProxy);
+        }
+    }
+}
+
+void
+GeometryMixin::hideProxy(RenderDelegate& renderDelegate)
+{
+    if (mProxy && mProxyActive) {
+        UpdateGuard guard(renderDelegate, mProxy);
+        hideGeometry(mProxy);
+        mProxyActive = false;
+    }
+}
+
 void
 GeometryMixin::syncAttributes(HdSceneDelegate* sceneDelegate,
                               RenderDelegate& renderDelegate,
@@ -168,6 +363,17 @@ GeometryMixin::syncPrimitiveAttributes()
             userDatas.push_back(i.second);
         }
         mGeometry->set("primitive_attributes", userDatas);
+        // other chunks have their own copies of the non-constant UserData
+        for (size_t c = 1; c < mChunks.size(); ++c) {
+            const auto& chunkUserData = mChunks[c].userData;
+            SceneObjectVector chunkUserDatas;
+            chunkUserDatas.reserve(mUserData.size());
+            for (auto& i : mUserData) {
+                auto it = chunkUserData.find(i.first);
+                chunkUserDatas.push_back(it != chunkUserData.end() ? it->second : i.second);
+            }
+            mChunks[c].geometry->set("primitive_attributes", chunkUserDatas);
+        }
         mUserDataChanged = false;
     }
 }
@@ -186,14 +392,30 @@ GeometryMixin::assign(HdSceneDelegate* sceneDelegate,
         rprim.SetMaterialId(sceneDelegate->GetMaterialId(id));
     }
 
-    if (*dirtyBits & (HdChangeTracker::DirtyCategories | 
-                      HdChangeTracker::DirtyMaterialId |
-                      HdChangeTracker::DirtyVisibility)) {
+    const bool assignmentDirty = *dirtyBits & (HdChangeTracker::DirtyCategories |
+                                               HdChangeTracker::DirtyMaterialId);
+
+    if (assignmentDirty && not rprim.IsVisible()) {
+        // hidden geometry is not reassigned, so do it when it is shown
+        mAssigned = false;
+    }
+
+    if (not assignmentDirty && (*dirtyBits & HdChangeTracker::DirtyVisibility) && mAssigned) {
+        // Visibility toggle of geometry that is already assigned : the layer
+        // assignment is still valid, so only the visible_xyz flags change. This
+        // avoids the category and material lookups and the layer lock when
+        // many prims are shown or hidden at once (e.g. isolate selection)
+        if (rprim.IsVisible()) {
+            restoreVisibility();
+        } else {
+            forceInvisible();
+        }
+    } else if (assignmentDirty || (*dirtyBits & HdChangeTracker::DirtyVisibility)) {
                 
         if (rprim.IsVisible()) {
 
             // make sure RDL visible_xyz flags are set correctly
-            restoreVisibility(sceneDelegate);
+            restoreVisibility();
 
             // categories associated with the geometry define which light
             // sets are assigned
@@ -201,61 +423,28 @@ GeometryMixin::assign(HdSceneDelegate* sceneDelegate,
             if (instancerId.IsEmpty()) {
                 categories = sceneDelegate->GetCategories(id);
             } else {
-                // if this geometry is instanced, we have to use GetInstanceCategories()
-                std::vector<VtArray<TfToken>> instCategories =
-                    sceneDelegate->GetInstanceCategories(instancerId);
-                // instCategories is a vector of per-instance Category sets. 
-                // Currently we can only apply a single set to the entire set of instances, 
-                // so we use the first
-                if (instCategories.size() == 0) {
-                    // point instancer
-                    categories = sceneDelegate->GetCategories(instancerId);
-                } else {
-                    categories = instCategories[0];
+                // if this geometry is instanced, the instancer has the categories. Instances
+                // with other categories than these use copies made by categoryCopy()
+                Instancer* instancer = static_cast<Instancer*>(
+                    sceneDelegate->GetRenderIndex().GetInstancer(instancerId));
+                if (instancer) {
+                    if (*dirtyBits & HdChangeTracker::DirtyCategories) instancer->invalidateCategories();
+                    categories = instancer->prototypeCategories(id);
                 }
             }
-        
-            // renderDelegate can translate the categories to RDL objects and
-            // fill in an RDL LayerAssignment object with the proper light set
-            LayerAssignment assignment;
-            renderDelegate.updateAssignmentFromCategories(assignment, categories);
-        
-            // fill in the material assignment
-            Material::get(assignment, 
-                          rprim.GetMaterialId(), 
-                          renderDelegate, 
-                          sceneDelegate, 
-                          &rprim, 
-                          isVolume());
-
-            // add the assignment to the Layer table
-            renderDelegate.assign(mGeometry, assignment);
-
-            // repeat for all parts in the part list
-            for (size_t i = 0; i < partList.size(); ++i) {
-                // when instanced. light linking for parts can only be inherited from the instancer
-                if (instancerId.IsEmpty()) {
-                    // not instanced : there could be light linking on the GeomSubset
-                    // ---
-                    // HDM-374 : GetCategories() does not work for GeomSubset paths, at least in 
-                    //    HdSceneIndexAdapterSceneDelegate at ver 0.22.5 : in fact the subsets don't seem to have
-                    //    an HdSceneIndexPrim at all. So we use the categories of the full mesh:
-                    renderDelegate.updateAssignmentFromCategories(assignment, categories);
-                    // This is the correct implementation (if it worked...)
-                    //renderDelegate.updateAssignmentFromCategories(assignment, sceneDelegate->GetCategories(partPaths[i]));
-                }
-                Material::get(assignment, 
-                              partMaterials[i], 
-                              renderDelegate, 
-                              sceneDelegate, 
-                              &rprim, 
-                              isVolume());
-                renderDelegate.assign(mGeometry, partList[i], assignment);
+
+            assignCategories(sceneDelegate, renderDelegate, mGeometry, categories);
+            for (const CategoryCopy& copy : mCategoryCopies) {
+                assignCategories(sceneDelegate, renderDelegate, copy.geometry, copy.categories);
             }
+            mAssigned = true;
 
         } else {
             forceInvisible();
             renderDelegate.addUnassigned(mGeometry);
+            for (size_t c = 1; c < mChunks.size(); ++c) {
+                renderDelegate.addUnassigned(mChunks[c].geometry);
+            }
         }
     }
 
@@ -271,48 +460,156 @@ GeometryMixin::assign(HdSceneDelegate* sceneDelegate,
     }
    
 }
-namespace {
 
-    struct AttrPair {const scene_rdl2::rdl2::AttributeKey<bool>& moonrayKey; pxr::TfToken usdKey;};
+void
+GeometryMixin::assignCategories(HdSceneDelegate* sceneDelegate,
+                                RenderDelegate& renderDelegate,
+                                Geometry* geometry,
+                                const VtArray<TfToken>& categories)
+{
+    const bool instanced = not rprim.GetInstancerId().IsEmpty();
+
+    // renderDelegate can translate the categories to RDL objects and
+    // fill in an RDL LayerAssignment object with the proper light set
+    LayerAssignment assignment;
+    renderDelegate.updateAssignmentFromCategories(assignment, categories);
+
+    // fill in the material assignment
+    Material::get(assignment, 
+                  rprim.GetMaterialId(), 
+                  renderDelegate, 
+                  sceneDelegate, 
+                  &rprim, 
+                  isVolume());
+
+    // add the assignment to the Layer table
+    renderDelegate.assign(geometry, assignment);
+    if (geometry == mGeometry) {
+        for (size_t c = 1; c < mChunks.size(); ++c) {
+            renderDelegate.assign(mChunks[c].geometry, assignment);
+        }
+    }
 
-    const AttrPair visibleAttrs[] = {
-        { scene_rdl2::rdl2::Geometry::sVisibleCamera, pxr::TfToken("moonray:visible_in_camera") },
-        { scene_rdl2::rdl2::Geometry::sVisibleShadow, pxr::TfToken("moonray:visible_shadow") },
-        { scene_rdl2::rdl2::Geometry::sVisibleDiffuseReflection, pxr::TfToken("moonray:visible_diffuse_reflection") },
-        { scene_rdl2::rdl2::Geometry::sVisibleDiffuseTransmission, pxr::TfToken("moonray:visible_diffuse_transmission") },
-        { scene_rdl2::rdl2::Geometry::sVisibleGlossyReflection, pxr::TfToken("moonray:visible_glossy_reflection") },
-        { scene_rdl2::rdl2::Geometry::sVisibleGlossyTransmission, pxr::TfToken("moonray:visible_glossy_transmission") },
-        { scene_rdl2::rdl2::Geometry::sVisibleMirrorReflection, pxr::TfToken("moonray:visible_mirror_reflection") },
-        { scene_rdl2::rdl2::Geometry::sVisibleMirrorTransmission, pxr::TfToken("moonray:visible_mirror_transmission") },
-        { scene_rdl2::rdl2::Geometry::sVisiblePhase, pxr::TfToken("moonray:visible_volume") },
-};
+    // repeat for all parts in the part list
+    for (size_t i = 0; i < partList.size(); ++i) {
+        // when instanced. light linking for parts can only be inherited from the instancer
+        if (not instanced) {
+            // not instanced : there could be light linking on the GeomSubset
+            // ---
+            // HDM-374 : GetCategories() does not work for GeomSubset paths, at least in 
+            //    HdSceneIndexAdapterSceneDelegate at ver 0.22.5 : in fact the subsets don't seem to have
+            //    an HdSceneIndexPrim at all. So we use the categories of the full mesh:
+            renderDelegate.updateAssignmentFromCategories(assignment, categories);
+            // This is the correct implementation (if it worked...)
+            //renderDelegate.updateAssignmentFromCategories(assignment, sceneDelegate->GetCategories(partPaths[i]));
+        }
+        Material::get(assignment, 
+                      partMaterials[i], 
+                      renderDelegate, 
+                      sceneDelegate, 
+                      &rprim, 
+                      isVolume());
+        renderDelegate.assign(geometry, partList[i], assignment);
+    }
+}
 
+Geometry*
+GeometryMixin::categoryCopy(HdSceneDelegate* sceneDelegate,
+                            RenderDelegate& renderDelegate,
+                            const VtArray<TfToken>& categories)
+{
+    for (const CategoryCopy& copy : mCategoryCopies) {
+        if (copy.categories == categories) return copy.geometry;
+    }
+    const std::string name = rprim.GetId().GetString() + "/Categories" +
+                             std::to_string(mCategoryCopies.size() + 1);
+    SceneObject* object = renderDelegate.createSceneObject(mGeometry->getSceneClass().getName(), name);
+    // if there was an error this already printed an error message
+    if (not object) return nullptr;
+    Geometry* geometry = object->asA<Geometry>();
+    {   // may get back an unused copy from an earlier object
+        UpdateGuard guard(renderDelegate, geometry);
+        geometry->resetAllToDefault();
+    }
+    mCategoryCopies.push_back(CategoryCopy{categories, geometry});
+    assignCategories(sceneDelegate, renderDelegate, geometry, categories);
+    // the attributes are copied at the end of syncAll
+    return geometry;
 }
 
 void
-GeometryMixin::forceInvisible()
+GeometryMixin::syncCategoryCopies()
 {
-    // make sure the geometry object is invisible in all cases
+    if (mCategoryCopies.empty()) return;
+    const SceneClass& sceneClass = mGeometry->getSceneClass();
+    for (const CategoryCopy& copy : mCategoryCopies) {
+        // copies may be made during sync, so they are not guarded with the chunks
+        UpdateGuard guard(copy.geometry);
+        for (auto it = sceneClass.beginAttributes(); it != sceneClass.endAttributes(); ++it) {
+            ValueConverter::copyAttribute(copy.geometry, *mGeometry, *it);
+        }
+    }
+}
+
+void
+GeometryMixin::hideGeometry(Geometry* geometry)
+{
+    for (const auto& i : visibleAttrs) {
+        geometry->set(i.moonrayKey, false);
+    }
+}
+
+bool
+GeometryMixin::visibilityOverride(const std::string& name, const VtValue& value)
+{
+    // while forced invisible, "moonray:visible_xyz" primvars update mVisibleMask
+    // instead of the RDL attribute. Returns true if name was handled
+    if (not mForcedInvisible) return false;
+    uint32_t bit = 1;
     for (const auto& i : visibleAttrs) {
-        mGeometry->set(i.moonrayKey, false);
+        if (i.usdKey.GetString().compare(8, std::string::npos, name) != 0) {
+            bit <<= 1;
+            continue;
+        }
+        // allow the primvars to be int or bool. Removing the primvar restores the default
+        bool vis = true;
+        if (value.IsHolding<bool>()) vis = value.UncheckedGet<bool>();
+        else if (value.IsHolding<int>()) vis = (value.UncheckedGet<int>() != 0);
+        if (vis) mVisibleMask |= bit;
+        else mVisibleMask &= ~bit;
+        return true;
     }
+    return false;
+}
+
+void
+GeometryMixin::forceInvisible()
+{
+    if (!mForcedInvisible) {
+        // remember the current flags, which include any primvar overrides
+        mVisibleMask = 0;
+        uint32_t bit = 1;
+        for (const auto& i : visibleAttrs) {
+            if (mGeometry->get(i.moonrayKey)) mVisibleMask |= bit;
+            bit <<= 1;
+        }
+    }
+    // make sure the geometry object is invisible in all cases
+    hideGeometry(mGeometry);
     // flag that we did this, to avoid restoring unnecessarily
     mForcedInvisible = true;
 }
 
 void
-GeometryMixin::restoreVisibility(HdSceneDelegate* sceneDelegate)
+GeometryMixin::restoreVisibility()
 {
     // check that we are in a forced invisible state
     if (!mForcedInvisible) return;
-    // we have to reread every primvar that affects visibility
+    // all the flags are false : only set the ones that should be true
+    uint32_t bit = 1;
     for (const auto& i : visibleAttrs) {
-        VtValue val = rprim.GetPrimvar(sceneDelegate, i.usdKey);
-        bool vis = true;
-        // allow the primvars to be int or bool
-        if (val.IsHolding<bool>()) vis = val.UncheckedGet<bool>();
-        else if (val.IsHolding<int>()) vis = (val.UncheckedGet<int>() != 0);
-        mGeometry->set(i.moonrayKey, vis);
+        if (mVisibleMask & bit) mGeometry->set(i.moonrayKey, true);
+        bit <<= 1;
     }
     mForcedInvisible = false;
 }
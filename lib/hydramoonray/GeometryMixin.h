@@ -4,7 +4,10 @@
 #pragma once
 
 #include <pxr/imaging/hd/rprim.h>
+#include <pxr/base/gf/matrix4d.h>
 #include <pxr/base/gf/matrix4f.h>
+#include <pxr/base/vt/types.h>
+#include <scene_rdl2/scene/rdl2/Types.h>
 
 namespace scene_rdl2 {namespace rdl2 {
     class Geometry;
@@ -38,6 +41,13 @@ class RenderDelegate;
 // GeometryMixin::primvarChanged() from the overridden version to handle the standard cases.
 //
 // See Mesh and BasisCurves for typical subclass examples
+//
+// Points and BasisCurves may be split into several RDL geometry objects ("chunks"), each
+// holding a spatially coherent subset of the points or curves (see GeometryChunks.cc).
+// Per-vertex and per-element attributes must then be set using setChunkedAttribute().
+//
+// If the "Cached Skinning" setting is on, UsdSkel skinned points are computed by
+// syncSkinnedPoints() (see Skinning.cc) instead of by Hydra.
 
 class GeometryMixin
 {
@@ -51,6 +61,21 @@ public:
 
     bool isPrimvarUsed(const pxr::TfToken& name) { return mAppliedPrimvars.count(name) > 0; }
 
+    // return true if this geometry may be replaced by a bounding box proxy when the
+    // "Bounding Box Proxies" setting is on
+    virtual bool supportsProxy() const { return false; }
+
+    // Set the tessellation level picked by RenderDelegate::allocateTessellation() on
+    // the geometry and its chunks
+    void applyTessellationLevel(RenderDelegate& renderDelegate, int level);
+
+    // Return a copy of the geometry assigned with the light sets for categories, for
+    // instances whose categories differ from the prototype's. Copies are made on
+    // demand by the Instancer, and kept up to date by syncAll
+    scene_rdl2::rdl2::Geometry* categoryCopy(pxr::HdSceneDelegate* sceneDelegate,
+                                             RenderDelegate& renderDelegate,
+                                             const pxr::VtArray<pxr::TfToken>& categories);
+
 protected:
 
     // Creates geometry if needed and performs sync.
@@ -74,6 +99,11 @@ protected:
                                 const pxr::TfToken& name,  const pxr::VtValue& value,
                                 const pxr::HdInterpolation& interp, const pxr::TfToken& role);
 
+    // Expand a vertex-rate primvar value to one value per vertex. The default impl
+    // returns the value unchanged : subclasses with indexed vertices (e.g. BasisCurves
+    // with curveIndices) should override this. Called before primvarChanged.
+    virtual pxr::VtValue expandVertexPrimvar(const pxr::VtValue& value) { return value; }
+
     // return true if this is a volume (affects default material assignment)
     virtual bool isVolume() { return false; }
     // return true if this geometry supports UserData
@@ -91,12 +121,47 @@ protected:
     bool isMirror() const { return mMirror; }
 
     // force the object to be invisible, regardless of "primvar:moonray:visible_xyz"
-    // settings
+    // settings. The current visible_xyz values are remembered in mVisibleMask
     void forceInvisible();
 
     // restore visibility to what it should be, taking account of "primvar:moonray:visible_xyz"
     // settings. Has no effect if forceInvisible is not in effect.
-    void restoreVisibility(pxr::HdSceneDelegate* sceneDelegate);
+    void restoreVisibility();
+
+    // Set the attribute that controls tessellation from a level in [0,maxLevel].
+    // Overridden by geometry that tessellates
+    virtual void setTessellationLevel(scene_rdl2::rdl2::Geometry* geometry, int level) {}
+
+    // Have the render delegate pick the tessellation level from the size of the rprim's
+    // extent in the render camera (adaptive tessellation). The size of one element on
+    // screen is taken as the projected size / elementsAcross. Each level multiplies the
+    // cost (elementCount at level 0) by 2^costExponent. Call again when the topology or
+    // transform changes
+    void registerTessellation(pxr::HdSceneDelegate* sceneDelegate, RenderDelegate& renderDelegate,
+                              int maxLevel, size_t elementCount, float elementsAcross,
+                              int costExponent);
+    void unregisterTessellation(RenderDelegate& renderDelegate);
+
+    // If this rprim is a bounding box proxy, sync the proxy and return true, in which case
+    // Sync() should return. Should be called from Sync() before any other data is fetched
+    bool syncAsProxy(pxr::HdSceneDelegate* sceneDelegate, RenderDelegate& renderDelegate,
+                     pxr::HdDirtyBits* dirtyBits);
+
+    // Decide how the geometry is split into chunks, creating the chunk objects as
+    // needed. Should be called from Sync() before syncAll(). curveVertexCounts is null
+    // for points (one vertex per element). If the layout changes, dirtyBits are set so
+    // that all the chunked data is resent.
+    void updateChunkLayout(pxr::HdSceneDelegate* sceneDelegate, RenderDelegate& renderDelegate,
+                           const std::string& className, const pxr::VtIntArray* curveVertexCounts,
+                           pxr::HdDirtyBits* dirtyBits);
+
+    // Set a per-vertex or per-element attribute. If the geometry is chunked, the values are
+    // split between the chunks, and only chunks whose values changed are updated
+    void setChunkedAttribute(const std::string& name, scene_rdl2::rdl2::IntVector&& values);
+    void setChunkedAttribute(const std::string& name, scene_rdl2::rdl2::FloatVector&& values);
+    void setChunkedAttribute(const std::string& name, scene_rdl2::rdl2::Vec2fVector&& values);
+    void setChunkedAttribute(const std::string& name, scene_rdl2::rdl2::Vec3fVector&& values);
+    void resetChunkedAttribute(const std::string& name);
 
 private:
     friend class Mesh; // for geometryForMeshLight()
@@ -105,23 +170,74 @@ private:
     // sync should not proceed
     bool createGeometry(RenderDelegate& renderDelegate, const std::string& className);
 
+    // layer assignment of geometry and its parts, with the light sets for categories
+    void assignCategories(pxr::HdSceneDelegate* sceneDelegate, RenderDelegate& renderDelegate,
+                          scene_rdl2::rdl2::Geometry* geometry,
+                          const pxr::VtArray<pxr::TfToken>& categories);
+
+    // copy all the attributes from mGeometry to the category copies
+    void syncCategoryCopies();
+
+    // sync a box made from the rprim's extent, in place of the full geometry. This
+    // only needs the extent, transform, visibility, material and categories
+    void syncProxy(pxr::HdSceneDelegate* sceneDelegate, RenderDelegate& renderDelegate,
+                   pxr::HdDirtyBits* dirtyBits);
+
+    // hide the proxy, if there is one
+    void hideProxy(RenderDelegate& renderDelegate);
+
     // process and sync all primvars. calls primvarChanged for every changed primvar
     void syncPrimvars(pxr::HdSceneDelegate *sceneDelegate,
                       RenderDelegate& renderDelegate,
                       pxr::HdDirtyBits *dirtyBits);
 
+    // Compute the points of a UsdSkel skinning computation from cached rest points and
+    // influences, and call primvarChanged() if they moved. Returns false if compPrimvar
+    // is not a skinning computation that can be handled, in which case Hydra must
+    // compute it. If force is true the points are resent even if the joints did not move
+    bool syncSkinnedPoints(pxr::HdSceneDelegate* sceneDelegate, RenderDelegate& renderDelegate,
+                           const pxr::HdExtComputationPrimvarDescriptor& compPrimvar,
+                           pxr::HdDirtyBits dirtyBits, bool force);
+
     // syncs an overriding primvar ("moonray:...")
     void primvarAttributeOverride(const std::string& name, const pxr::VtValue& value);
 
+    // handles a "moonray:visible_xyz" override while the object is forced invisible.
+    // Returns false if it should be handled by primvarAttributeOverride
+    bool visibilityOverride(const std::string& name, const pxr::VtValue& value);
+
     // creates/updates userData for a primvar
     void primvarUserData(RenderDelegate& renderDelegate,
                          const pxr::TfToken& name, const pxr::VtValue& value,
                          const pxr::HdInterpolation& interp, const pxr::TfToken& role);
 
-    // set a Vec3f attribute from a primvar with possible motion blur
+    // creates userData (named after geometryName) if it is null, and sets its values
+    void updateUserData(RenderDelegate& renderDelegate, scene_rdl2::rdl2::UserData*& userData,
+                        const std::string& geometryName,
+                        const pxr::TfToken& name, const pxr::VtValue& value,
+                        const pxr::HdInterpolation& interp, const pxr::TfToken& role);
+
+    // drop a reference to a UserData object shared through the ResourceRegistry, and
+    // set userData to null. Does nothing if userData is not shared
+    void releaseSharedUserData(RenderDelegate& renderDelegate, scene_rdl2::rdl2::UserData*& userData);
+    // release all shared UserData, removing it from mUserData
+    void releaseAllSharedUserData(RenderDelegate& renderDelegate);
+
+    // set a Vec3f attribute from a primvar value
+    void setVec3fAttribute(const std::string& rdlName, const pxr::VtValue& value);
+
+    // set a Vec3f attribute from a primvar with possible motion blur. If singleSample
+    // is true, only the first attribute is set, even if the primvar has multiple samples
     void setVec3fPrimvarMb(pxr::HdSceneDelegate* sceneDelegate,
                            const pxr::TfToken& hydraName, const pxr::VtValue& value,
-                           const std::string& rdlName_0, const std::string& rdlName_1);
+                           const std::string& rdlName_0, const std::string& rdlName_1,
+                           bool singleSample = false);
+
+    // returns true if the rprim has a primvar (regular or computed) with the given name
+    bool hasPrimvar(pxr::HdSceneDelegate* sceneDelegate, const pxr::TfToken& name);
+
+    // set "motion_blur_type" to match mVelocityBlur, unless overridden by a primvar
+    void syncMotionBlurType();
 
     // perform material and light assignment and instance creation
     void assign(pxr::HdSceneDelegate* sceneDelegate, RenderDelegate& renderDelegate, 
@@ -133,6 +249,17 @@ private:
     // update the primitive_attributes list of user data (if defined)
     void syncPrimitiveAttributes();
 
+    // copy the attributes that are not chunked from mGeometry to the other chunks
+    void syncChunks();
+
+    // the part of a per-vertex or per-element value belonging to a chunk
+    pxr::VtValue chunkValue(const pxr::VtValue& value, size_t chunk) const;
+
+    template <typename T> void setChunked(const std::string& name, T&& values);
+
+    // make a geometry object invisible
+    static void hideGeometry(scene_rdl2::rdl2::Geometry* geometry);
+
     // rprim that this is mixed into
     pxr::HdRprim& rprim;
 
@@ -149,6 +276,66 @@ private:
     bool mMirror = false; // true if xform is a reflection
     bool mUserDataChanged = false;
     bool mForcedInvisible = false;
+    // visible_xyz values to restore when mForcedInvisible is cleared, one bit per flag.
+    // "moonray:visible_xyz" primvars that change while invisible update this instead
+    // of the RDL attribute
+    uint32_t mVisibleMask = 0;
+    // true if mGeometry has a layer assignment, so that showing it again only needs
+    // the visible_xyz flags restored
+    bool mAssigned = false;
+    // true if points are sent as a single sample, with motion blur
+    // provided by velocities (and possibly accelerations)
+    bool mVelocityBlur = false;
+    bool mAccelerationBlur = false;
+
+    // Inputs of the UsdSkel skinning computation at last syncSkinnedPoints(). The rest
+    // data is refetched if the computation or the topology changes
+    struct SkinningCache {
+        pxr::SdfPath computationId; // empty if nothing is cached
+        pxr::VtVec3fArray restPoints;
+        pxr::GfMatrix4f geomBindXform{1.0f};
+        pxr::VtVec2fArray influences; // (joint index, weight) pairs
+        int numInfluencesPerPoint = 0;
+        bool hasConstantInfluences = false;
+        pxr::VtMatrix4fArray skinningXforms;
+        pxr::GfMatrix4d skelToPrim{1.0};
+    };
+    SkinningCache mSkinning;
+
+    // true if registered with RenderDelegate::setTessellationPrim
+    bool mTessellationRegistered = false;
+
+    // bounding box proxy, used instead of mGeometry (see syncProxy)
+    scene_rdl2::rdl2::Geometry* mProxy = nullptr;
+    bool mProxyActive = false;
+
+    // Chunks that the geometry is split into. Empty if not chunked
+    struct Chunk {
+        // RDL object for the chunk. Chunk 0 uses mGeometry, and this is null
+        scene_rdl2::rdl2::Geometry* geometry = nullptr;
+        // elements (points or curves) in the chunk, and their vertices
+        pxr::VtIntArray elements;
+        pxr::VtIntArray vertices;
+        // the chunk's part of non-constant UserData. For chunk 0 this is in mUserData
+        std::map<pxr::TfToken, scene_rdl2::rdl2::UserData*> userData;
+    };
+    std::vector<Chunk> mChunks;
+    scene_rdl2::rdl2::Geometry* chunkGeometry(size_t i) const { return i ? mChunks[i].geometry : mGeometry; }
+    // element and vertex counts the chunk layout was made for
+    size_t mChunkElementCount = 0;
+    size_t mChunkVertexCount = 0;
+    pxr::VtIntArray mChunkCurveVertexCounts;
+    // attributes set by setChunkedAttribute, which are not copied between chunks
+    std::set<std::string> mChunkedAttributes;
+    // true if syncChunks() must copy all other attributes, not just the changed ones
+    bool mChunksCopyAll = false;
+
+    // copies made by categoryCopy()
+    struct CategoryCopy {
+        pxr::VtArray<pxr::TfToken> categories;
+        scene_rdl2::rdl2::Geometry* geometry;
+    };
+    std::vector<CategoryCopy> mCategoryCopies;
 
     GeometryMixin(const GeometryMixin&)             = delete;
     GeometryMixin &operator =(const GeometryMixin&) = delete;
@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "Instancer.h"
+#include "Gather.h"
 #include "RenderDelegate.h"
 
 #include <pxr/imaging/hd/sceneDelegate.h>
@@ -13,8 +14,13 @@
 #include <scene_rdl2/scene/rdl2/Layer.h>
 
 #include <pxr/base/gf/vec2f.h>
+#include <pxr/base/gf/quatd.h>
 #include <pxr/base/gf/quath.h>
 
+#include <tbb/parallel_sort.h>
+
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 
 namespace hdMoonray {
@@ -76,6 +82,9 @@ Instancer::Sync(pxr::HdSceneDelegate* sceneDelegate,
         // Possibly clear out all the prototype references and it will refill it
     }
 
+    // categories are fetched again when next needed
+    invalidateCategories();
+
     if (pxr::HdChangeTracker::IsTransformDirty(*dirtyBits, id)) {
         mXform = sceneDelegate->GetInstancerTransform(id);
         // std::cout << id << " transform = " << mXform << std::endl;
@@ -102,22 +111,68 @@ Instancer::Sync(pxr::HdSceneDelegate* sceneDelegate,
         }
     }
 
+    ++mSyncCount;
     *dirtyBits = 0;
 }
 
 
-// The SceneDelegate api only allows access to the indices by using the prototypeId, which
-// we don't have until this is called. Even the number of indices is unavailable as far
-// as I can tell. So this function must update the data for that subset of indices.
-// Curently a different InstanceGeometry is created for each prototype. It may be possible
-// to use a single one if there is a way to incrementally update the references and refIndices.
+namespace {
+
+// Remove all the instances from an instancer that is no longer used, as RDL
+// objects cannot be deleted
 void
-Instancer::makeInstanceGeometry(const pxr::SdfPath& prototypeId, scene_rdl2::rdl2::Geometry* prototype,
-                                GeometryMixin* geometry, size_t level, size_t childCount)
+clearInstances(scene_rdl2::rdl2::Geometry* instancer)
 {
-    const pxr::SdfPath& id = GetId();
-    pxr::HdSceneDelegate* sceneDelegate = GetDelegate();
+    UpdateGuard guard(instancer);
+    instancer->set<int>("method", Method::XFORM_LIST);
+    instancer->set("xform_list", scene_rdl2::rdl2::Mat4dVector());
+}
 
+// Update out, which holds the values of prev gathered by indices, to the values of src.
+// If the indices are unchanged and prev has the same size, only the entries whose
+// source value changed are converted, otherwise all of them are. Returns false if
+// nothing changed, so the attribute does not have to be resent.
+template <typename Out, typename Src, typename Convert>
+bool
+updateInstanceValues(Out& out, const pxr::VtArray<Src>& src, const pxr::VtValue& prev,
+                     const pxr::VtIntArray& indices, bool indicesChanged, Convert convert)
+{
+    const size_t count = indices.size();
+    if (not indicesChanged && out.size() == count && prev.IsHolding<pxr::VtArray<Src>>() &&
+        prev.UncheckedGet<pxr::VtArray<Src>>().size() == src.size()) {
+        const Src* s = src.cdata();
+        const Src* old = prev.UncheckedGet<pxr::VtArray<Src>>().cdata();
+        const int* idx = indices.cdata();
+        const size_t n = src.size();
+        auto* d = out.data();
+        std::atomic<bool> changed(false);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, count, PARALLEL_GATHER_GRAIN),
+            [&](const tbb::blocked_range<size_t>& r) {
+                bool rangeChanged = false;
+                for (size_t i = r.begin(); i < r.end(); ++i) {
+                    const size_t j = wrapIndex(idx[i], n);
+                    if (s[j] != old[j]) {
+                        d[i] = convert(s[j]);
+                        rangeChanged = true;
+                    }
+                }
+                if (rangeChanged) changed = true;
+            });
+        return changed;
+    }
+    gatherWrapped(out, src, indices, convert);
+    return true;
+}
+
+}
+
+// Prototypes call this before using the instancer data, as there is no other sync
+// call to the instancer with older Hydra versions
+void
+Instancer::syncInstancer()
+{
+    pxr::HdSceneDelegate* sceneDelegate = GetDelegate();
+    const pxr::SdfPath& id = GetId();
 #if PXR_VERSION < 2102
     pxr::HdChangeTracker& changeTracker = sceneDelegate->GetRenderIndex().GetChangeTracker();
     if (pxr::HdChangeTracker::IsDirty(changeTracker.GetInstancerDirtyBits(id))) {
@@ -131,63 +186,180 @@ Instancer::makeInstanceGeometry(const pxr::SdfPath& prototypeId, scene_rdl2::rdl
 #else
     _SyncInstancerAndParents(sceneDelegate->GetRenderIndex(), id);
 #endif
+}
 
-    RenderDelegate& renderDelegate = *reinterpret_cast<RenderDelegate*>(sceneDelegate->GetRenderIndex().GetRenderDelegate());
+std::vector<pxr::GfMatrix4d>
+Instancer::instanceMatrices(const pxr::VtIntArray& indices) const
+{
+    std::vector<pxr::GfMatrix4d> result(indices.size(), pxr::GfMatrix4d(1.0));
+    auto find = [&](const pxr::TfToken& name) -> const pxr::VtValue& {
+        static const pxr::VtValue none;
+        auto i = mPrimvars.find(name);
+        return i == mPrimvars.end() ? none : i->second.value;
+    };
 
-    pxr::VtIntArray indices = sceneDelegate->GetInstanceIndices(id, prototypeId);
-    const size_t count = indices.size();
+    const pxr::VtValue& xforms = find(pxr::HdInstancerTokens->instanceTransform);
+    if (not xforms.IsEmpty()) {
+        if (xforms.IsHolding<pxr::VtMatrix4dArray>() && xforms.GetArraySize()) {
+            gatherWrapped(result, xforms.UncheckedGet<pxr::VtMatrix4dArray>(), indices,
+                          [](const pxr::GfMatrix4d& m) { return m; });
+        }
+        return result;
+    }
 
-    // may want to do something special if 0 or 1 indices?
-    //std::cout << id << "::makeInstanceGeometry(" << prototypeId << ") indices.size = " << count << std::endl;
+    // same order as the XFORM_ATTRIBUTES method : scale, then rotate, then translate
+    const pxr::VtValue& scales = find(pxr::HdInstancerTokens->scale);
+    const pxr::VtValue& rotates = find(pxr::HdInstancerTokens->rotate);
+    const pxr::VtValue& translates = find(pxr::HdInstancerTokens->translate);
+    const bool hasScales = scales.IsHolding<pxr::VtVec3fArray>() && scales.GetArraySize();
+    const bool hasQuaths = rotates.IsHolding<pxr::VtQuathArray>() && rotates.GetArraySize();
+    const bool hasVec4fs = rotates.IsHolding<pxr::VtVec4fArray>() && rotates.GetArraySize();
+    const bool hasTranslates = translates.IsHolding<pxr::VtVec3fArray>() && translates.GetArraySize();
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, indices.size(), PARALLEL_GATHER_GRAIN),
+        [&](const tbb::blocked_range<size_t>& r) {
+            for (size_t i = r.begin(); i < r.end(); ++i) {
+                const int index = indices[i];
+                pxr::GfMatrix4d& m = result[i];
+                if (hasScales) {
+                    const pxr::VtVec3fArray& v = scales.UncheckedGet<pxr::VtVec3fArray>();
+                    m.SetScale(pxr::GfVec3d(v[wrapIndex(index, v.size())]));
+                }
+                if (hasQuaths || hasVec4fs) {
+                    pxr::GfQuatd q;
+                    if (hasQuaths) {
+                        const pxr::VtQuathArray& v = rotates.UncheckedGet<pxr::VtQuathArray>();
+                        const pxr::GfQuath& h = v[wrapIndex(index, v.size())];
+                        q = pxr::GfQuatd(h.GetReal(), pxr::GfVec3d(h.GetImaginary()));
+                    } else {
+                        const pxr::VtVec4fArray& v = rotates.UncheckedGet<pxr::VtVec4fArray>();
+                        const pxr::GfVec4f& f = v[wrapIndex(index, v.size())];
+                        q = pxr::GfQuatd(f[0], f[1], f[2], f[3]);
+                    }
+                    m *= pxr::GfMatrix4d().SetRotate(q.GetNormalized());
+                }
+                if (hasTranslates) {
+                    const pxr::VtVec3fArray& v = translates.UncheckedGet<pxr::VtVec3fArray>();
+                    m.SetTranslateOnly(pxr::GfVec3d(v[wrapIndex(index, v.size())]));
+                }
+            }
+        });
+    return result;
+}
 
-    scene_rdl2::rdl2::Geometry* instancer;
-    scene_rdl2::rdl2::UserData* instanceId;
-    {   std::lock_guard<std::mutex> lock(mMapMutex);
-        scene_rdl2::rdl2::Geometry*& mapEntry = mInstancers[prototype];
-        if (not mapEntry) {
-            std::string name = prototype->getName() + "/Instancer";
-            scene_rdl2::rdl2::SceneObject* object = renderDelegate.createSceneObject("RdlInstancerGeometry", name);
-            if (not object) return; // it already printed an error, give up
-            mapEntry = object->asA<scene_rdl2::rdl2::Geometry>();
-            renderDelegate.assign(mapEntry, scene_rdl2::rdl2::LayerAssignment());
-            instanceId = renderDelegate.createSceneObject("UserData", prototype->getName() + "/instanceId")->asA<scene_rdl2::rdl2::UserData>();
-        } else {
-            instanceId = mapEntry->get<scene_rdl2::rdl2::SceneObjectVector>("primitive_attributes")[0]->asA<scene_rdl2::rdl2::UserData>();
+std::vector<pxr::GfMatrix4d>
+Instancer::prototypeTransforms(const pxr::SdfPath& prototypeId)
+{
+    syncInstancer();
+    const pxr::VtIntArray indices = GetDelegate()->GetInstanceIndices(GetId(), prototypeId);
+    std::vector<pxr::GfMatrix4d> result = instanceMatrices(indices);
+    for (pxr::GfMatrix4d& m : result) m *= mXform;
+
+    if (not GetParentId().IsEmpty()) {
+        Instancer* parent = static_cast<Instancer*>(GetDelegate()->GetRenderIndex().GetInstancer(GetParentId()));
+        if (parent) {
+            // every instance of this instancer is repeated in each instance of the parent
+            const std::vector<pxr::GfMatrix4d> outer = parent->prototypeTransforms(GetId());
+            std::vector<pxr::GfMatrix4d> nested;
+            nested.reserve(result.size() * outer.size());
+            for (const pxr::GfMatrix4d& o : outer) {
+                for (const pxr::GfMatrix4d& m : result) nested.push_back(m * o);
+            }
+            result.swap(nested);
         }
-        instancer = mapEntry;
     }
+    return result;
+}
 
-    {   UpdateGuard guard(renderDelegate, instanceId);
-        std::string name("instanceId");
-        if (level) name.push_back('A'+level-1);
-        // std::cout << geometry->getId() << ' ' << name << ' ' << count << 'x' << childCount << std::endl;
-        // at the moment you cannot get ints into a RenderOutput so convert to float
-        scene_rdl2::rdl2::FloatVector out(count);
-        for (size_t i = 0; i < count; ++i)
-            out[i] = i * childCount;
-        instanceId->setFloatData(name, out);
-    }
+// Remove the instances that cannot be seen from the culling camera : those whose
+// bounds are outside the frustum expanded by the margin, entirely behind the camera,
+// or smaller than the pixel threshold. Ids is set to the position in the original
+// indices of each instance kept. Returns false, leaving indices as they are, if every
+// instance is kept or the camera is not known yet
+bool
+Instancer::cullInstances(RenderDelegate& renderDelegate, const pxr::SdfPath& prototypeId,
+                         pxr::VtIntArray& indices, std::vector<int>& ids) const
+{
+    if (not renderDelegate.hasCullingCamera() || indices.empty()) return false;
+    // before the first render pass the image size is unknown : only cull to the frustum
+    const int imageHeight = renderDelegate.getCullingImageHeight();
+    pxr::HdSceneDelegate* sceneDelegate = GetDelegate();
+    const pxr::GfRange3d extent = sceneDelegate->GetExtent(prototypeId);
+    if (extent.IsEmpty()) return false;
+
+    const pxr::GfMatrix4d prototypeXform = sceneDelegate->GetTransform(prototypeId);
+    const pxr::GfMatrix4d instancerToNdc = mXform * renderDelegate.getCullingCamera();
+    const std::vector<pxr::GfMatrix4d> matrices = instanceMatrices(indices);
+    const double limit = 1.0 + renderDelegate.getInstanceCullMargin();
+    const double minPixels = imageHeight > 0 ? renderDelegate.getInstanceCullPixels() : 0.0;
+
+    std::vector<char> keep(indices.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, indices.size(), PARALLEL_GATHER_GRAIN),
+        [&](const tbb::blocked_range<size_t>& r) {
+            for (size_t i = r.begin(); i < r.end(); ++i) {
+                const pxr::GfMatrix4d m = prototypeXform * matrices[i] * instancerToNdc;
+                pxr::GfRange3d ndc;
+                size_t behind = 0;
+                for (size_t c = 0; c < 8; ++c) {
+                    const pxr::GfVec3d corner = extent.GetCorner(c);
+                    const pxr::GfVec4d p = pxr::GfVec4d(corner[0], corner[1], corner[2], 1.0) * m;
+                    if (p[3] <= 0) {
+                        ++behind;
+                    } else {
+                        ndc.UnionWith(pxr::GfVec3d(p[0] / p[3], p[1] / p[3], 0.0));
+                    }
+                }
+                if (behind == 8) {
+                    keep[i] = false;
+                } else if (behind) {
+                    // crosses the camera plane : its size on screen is unbounded
+                    keep[i] = true;
+                } else {
+                    const pxr::GfVec3d& lo = ndc.GetMin();
+                    const pxr::GfVec3d& hi = ndc.GetMax();
+                    const pxr::GfVec3d size = ndc.GetSize();
+                    keep[i] = lo[0] <= limit && hi[0] >= -limit &&
+                              lo[1] <= limit && hi[1] >= -limit &&
+                              std::max(size[0], size[1]) * 0.5 * imageHeight >= minPixels;
+                }
+            }
+        });
 
+    ids.clear();
+    for (size_t i = 0; i < keep.size(); ++i) {
+        if (keep[i]) ids.push_back(int(i));
+    }
+    if (ids.size() == indices.size()) {
+        ids.clear();
+        return false;
+    }
+    indices = gather<pxr::VtIntArray>(indices, ids.data(), ids.size());
+    return true;
+}
 
-    // add crytomatte id if enabled
+// add crytomatte id if enabled. This only depends on the name of the instancer
+void
+Instancer::makeCryptoId(RenderDelegate& renderDelegate, PrototypeState& state, const std::string& prefix)
+{
     const std::string m_name("prim_id");
-    std::string prim_id = prototype->getName() + "/Instancer.primvars:" + m_name;
-    scene_rdl2::rdl2::UserData* cryptoId =
+    std::string prim_id = prefix + "/Instancer.primvars:" + m_name;
+    state.cryptoId =
             renderDelegate.createSceneObject("UserData", prim_id)->asA<scene_rdl2::rdl2::UserData>();
-    UpdateGuard guard(cryptoId);
+    UpdateGuard guard(state.cryptoId);
     scene_rdl2::rdl2::FloatVector data(1);
-    data[0]=MurmurHash3_to_float(instancer->getName().c_str());
-    //std::cout << instancer->getName() << ": " << data[0] <<std::endl;
-    cryptoId->setFloatData(m_name, data);
-
-    // MOONSHINE-1533: Moonray uses the number of transforms to count instances, while Hydra Prman
-    // and Embree use the size of the protoIndices array. For bad data where these are unequal,
-    // resize the primvars to match the number of instances, so all the renderers produce the same
-    // number of instances.
-    scene_rdl2::rdl2::SceneObjectVector primitiveAttributes{instanceId};
-    primitiveAttributes.push_back(cryptoId);
+    data[0]=MurmurHash3_to_float(state.instancer->getName().c_str());
+    //std::cout << state.instancer->getName() << ": " << data[0] <<std::endl;
+    state.cryptoId->setFloatData(m_name, data);
+}
 
-    for (auto p : mPrimvars) {
+// Make the UserData for the instancer primvars, for the instances selected by indices,
+// and add them to primitiveAttributes. UserData for unchanged values is reused
+void
+Instancer::updatePrimvars(RenderDelegate& renderDelegate, PrototypeState& state,
+                          const std::string& prefix, const pxr::VtIntArray& indices,
+                          const std::set<pxr::TfToken>& skipPrimvars, bool indicesChanged,
+                          scene_rdl2::rdl2::SceneObjectVector& primitiveAttributes)
+{
+    for (auto& p : mPrimvars) {
         const pxr::TfToken& name = p.first;
         if (name == pxr::HdInstancerTokens->instanceTransform ||
             name == pxr::HdInstancerTokens->scale ||
@@ -195,14 +367,22 @@ Instancer::makeInstanceGeometry(const pxr::SdfPath& prototypeId, scene_rdl2::rdl
             name == pxr::HdInstancerTokens->translate)
             continue; // skip the ones used directly
 
-        // HDM-130: Moonray InstanceGeometry primvars override primvars on the prototype, which
-        // is opposite how USD works. Don't create the primvar if it will override incorrectly.
-        if (geometry->isPrimvarUsed(name)) continue;
-        // Fixme: this also needs to be done with each intermediate instancer.
+        if (skipPrimvars.count(name)) continue;
 
         const pxr::VtValue& value = p.second.value;
         const pxr::TfToken& role = p.second.role;
-        std::string objname = prototype->getName() + "/Instancer.primvars:" + name.GetString();
+
+        // unchanged since the last call, reuse the UserData as it is
+        if (not indicesChanged && not state.changed(name, value)) {
+            scene_rdl2::rdl2::UserData* primvar = state.primvars[name];
+            if (primvar) primitiveAttributes.push_back(primvar);
+            continue;
+        }
+        state.sent[name] = value;
+        scene_rdl2::rdl2::UserData*& translated = state.primvars[name];
+        translated = nullptr;
+
+        std::string objname = prefix + "/Instancer.primvars:" + name.GetString();
         scene_rdl2::rdl2::UserData* primvar =
             renderDelegate.createSceneObject("UserData", objname)->asA<scene_rdl2::rdl2::UserData>();
 
@@ -211,25 +391,25 @@ Instancer::makeInstanceGeometry(const pxr::SdfPath& prototypeId, scene_rdl2::rdl
         if (value.IsHolding<pxr::VtFloatArray>()) {
             const pxr::VtFloatArray& v = value.UncheckedGet<pxr::VtFloatArray>();
             if (v.empty()) continue; // don't crash on error
-            scene_rdl2::rdl2::FloatVector out(count);
-            for (size_t i = 0; i < count; ++i) out[i] = v[indices[i] % v.size()];
+            scene_rdl2::rdl2::FloatVector out;
+            gatherWrapped(out, v, indices, [](float f) { return f; });
             primvar->setFloatData(name.GetString(), out);
         } else if (value.IsHolding<pxr::VtVec2fArray>()) {
             const pxr::VtVec2fArray& v = value.UncheckedGet<pxr::VtVec2fArray>();
             if (v.empty()) continue; // don't crash on error
-            scene_rdl2::rdl2::Vec2fVector out(count);
-            for (size_t i = 0; i < count; ++i) out[i] = reinterpret_cast<const scene_rdl2::rdl2::Vec2f&>(v[indices[i] % v.size()]);
+            scene_rdl2::rdl2::Vec2fVector out;
+            gatherWrapped(out, v, indices, [](const pxr::GfVec2f& f) { return reinterpret_cast<const scene_rdl2::rdl2::Vec2f&>(f); });
             primvar->setVec2fData(name.GetString(), out);
         } else if (value.IsHolding<pxr::VtVec3fArray>()) {
             const pxr::VtVec3fArray& v = value.UncheckedGet<pxr::VtVec3fArray>();
             if (v.empty()) continue; // don't crash on error
             if (role == pxr::HdPrimvarRoleTokens->color) {
-                scene_rdl2::rdl2::RgbVector out(count);
-                for (size_t i = 0; i < count; ++i) out[i] = reinterpret_cast<const scene_rdl2::rdl2::Rgb&>(v[indices[i] % v.size()]);
+                scene_rdl2::rdl2::RgbVector out;
+                gatherWrapped(out, v, indices, [](const pxr::GfVec3f& c) { return reinterpret_cast<const scene_rdl2::rdl2::Rgb&>(c); });
                 primvar->setColorData(name.GetString(), out);
             } else {
-                scene_rdl2::rdl2::Vec3fVector out(count);
-                for (size_t i = 0; i < count; ++i) out[i] = reinterpret_cast<const scene_rdl2::rdl2::Vec3f&>(v[indices[i] % v.size()]);
+                scene_rdl2::rdl2::Vec3fVector out;
+                gatherWrapped(out, v, indices, [](const pxr::GfVec3f& f) { return reinterpret_cast<const scene_rdl2::rdl2::Vec3f&>(f); });
                 primvar->setVec3fData(name.GetString(), out);
             }
         } else if (value.IsHolding<pxr::GfVec3f>()) {
@@ -242,97 +422,267 @@ Instancer::makeInstanceGeometry(const pxr::SdfPath& prototypeId, scene_rdl2::rdl
         } else if (value.IsHolding<pxr::VtIntArray>()) {
             const pxr::VtIntArray& v = value.UncheckedGet<pxr::VtIntArray>();
             if (v.empty()) continue; // don't crash on error
-            scene_rdl2::rdl2::IntVector out(count);
-            for (size_t i = 0; i < count; ++i) out[i] = v[indices[i] % v.size()];
+            scene_rdl2::rdl2::IntVector out;
+            gatherWrapped(out, v, indices, [](int n) { return n; });
             primvar->setIntData(name.GetString(), out);
         } else {
             Logger::warn(primvar->getName(),": ",value.GetTypeName()," not translated");
+            continue;
         }
+        translated = primvar;
         primitiveAttributes.push_back(primvar);
     }
+}
+
+// Update the attributes and UserData of state.instancer, other than the references,
+// for the instances selected by indices. Ids are the instance ids to output, if they are
+// not the position in indices. Names of the objects created start with prefix.
+// Only the data whose inputs changed since the last call is rebuilt and set.
+void
+Instancer::updateInstances(RenderDelegate& renderDelegate, PrototypeState& state,
+                           const std::string& prefix, const pxr::VtIntArray& indices,
+                           const std::vector<int>& ids,
+                           const std::set<pxr::TfToken>& skipPrimvars, bool created,
+                           size_t level, size_t childCount)
+{
+    scene_rdl2::rdl2::Geometry* instancer = state.instancer;
+    const size_t count = indices.size();
+
+    const bool indicesChanged = created || indices != state.indices;
+    state.indices = indices;
+
+    auto valueChanged = [&](const pxr::TfToken& name, const pxr::VtValue& value) {
+        return indicesChanged || state.changed(name, value);
+    };
+
+    if (indicesChanged || count != state.instanceIdCount ||
+        level != state.level || childCount != state.childCount) {
+        UpdateGuard guard(renderDelegate, state.instanceId);
+        std::string name("instanceId");
+        if (level) name.push_back('A'+level-1);
+        // at the moment you cannot get ints into a RenderOutput so convert to float
+        scene_rdl2::rdl2::FloatVector out(count);
+        for (size_t i = 0; i < count; ++i)
+            out[i] = (ids.empty() ? i : ids[i]) * childCount;
+        state.instanceId->setFloatData(name, out);
+        state.instanceIdCount = count;
+        state.level = level;
+        state.childCount = childCount;
+    }
+
+    if (created) makeCryptoId(renderDelegate, state, prefix);
+
+    // MOONSHINE-1533: Moonray uses the number of transforms to count instances, while Hydra Prman
+    // and Embree use the size of the protoIndices array. For bad data where these are unequal,
+    // resize the primvars to match the number of instances, so all the renderers produce the same
+    // number of instances.
+    scene_rdl2::rdl2::SceneObjectVector primitiveAttributes{state.instanceId};
+    primitiveAttributes.push_back(state.cryptoId);
+
+    updatePrimvars(renderDelegate, state, prefix, indices, skipPrimvars, indicesChanged,
+                   primitiveAttributes);
 
     {   UpdateGuard guard(instancer);
-        instancer->set("primitive_attributes", primitiveAttributes);
+        if (created || instancer->get<scene_rdl2::rdl2::SceneObjectVector>("primitive_attributes") != primitiveAttributes) {
+            instancer->set("primitive_attributes", primitiveAttributes);
+        }
 
-        instancer->set(instancer->sNodeXformKey, reinterpret_cast<const scene_rdl2::rdl2::Mat4d&>(mXform));
+        if (created || mXform != state.xform) {
+            instancer->set(instancer->sNodeXformKey, reinterpret_cast<const scene_rdl2::rdl2::Mat4d&>(mXform));
+            state.xform = mXform;
+        }
 
-        instancer->set("references", scene_rdl2::rdl2::SceneObjectVector{prototype});
-        // there is also refIndices but that can be left at default value
+        if (created) {
+            instancer->set("use_reference_xforms", true);
+        }
 
-        instancer->set("use_reference_xforms", true);
+        // values for the transform attributes are patched in place. They must be forgotten
+        // when switching method, as the other attributes are not kept up to date
+        const pxr::VtValue none;
+        auto sentValue = [&](const pxr::TfToken& name) -> const pxr::VtValue& {
+            auto i = state.sent.find(name);
+            return i == state.sent.end() ? none : i->second;
+        };
 
         auto i = mPrimvars.find(pxr::HdInstancerTokens->instanceTransform);
         if (i != mPrimvars.end()) {
-            instancer->set<int>("method", Method::XFORM_LIST);
+            if (created || instancer->get<int>("method") != Method::XFORM_LIST) {
+                instancer->set<int>("method", Method::XFORM_LIST);
+                state.sent.erase(pxr::HdInstancerTokens->scale);
+                state.sent.erase(pxr::HdInstancerTokens->rotate);
+                state.sent.erase(pxr::HdInstancerTokens->translate);
+            }
             const pxr::VtValue& value = i->second.value;
             const pxr::VtMatrix4dArray& v = value.Get<pxr::VtMatrix4dArray>();
-            if (not v.empty()) {
-                std::vector<pxr::GfMatrix4d> mv(count);
-                for (size_t i = 0; i < count; ++i)
-                    mv[i] = v[indices[i] % v.size()];
-                instancer->set("xform_list", reinterpret_cast<const std::vector<scene_rdl2::rdl2::Mat4d>&>(mv));
+            if (not v.empty() && valueChanged(i->first, value)) {
+                scene_rdl2::rdl2::Mat4dVector mv = instancer->get<scene_rdl2::rdl2::Mat4dVector>("xform_list");
+                if (updateInstanceValues(mv, v, sentValue(i->first), indices, indicesChanged,
+                        [](const pxr::GfMatrix4d& m) { return reinterpret_cast<const scene_rdl2::rdl2::Mat4d&>(m); })) {
+                    instancer->set("xform_list", mv);
+                }
+                state.sent[i->first] = value;
             }
 
         } else {
-            instancer->set<int>("method", Method::XFORM_ATTRIBUTES);
+            if (created || instancer->get<int>("method") != Method::XFORM_ATTRIBUTES) {
+                instancer->set<int>("method", Method::XFORM_ATTRIBUTES);
+                state.sent.erase(pxr::HdInstancerTokens->instanceTransform);
+            }
 
             i = mPrimvars.find(pxr::HdInstancerTokens->scale);
             if (i != mPrimvars.end()) {
                 const pxr::VtValue& value = i->second.value;
                 const pxr::VtVec3fArray& v = value.Get<pxr::VtVec3fArray>();
-                if (not v.empty()) {
-                    std::vector<pxr::GfVec3f> mv(count);
-                    for (size_t i = 0; i < count; ++i)
-                        mv[i] = v[indices[i] % v.size()];
-                    instancer->set("scales", reinterpret_cast<const std::vector<scene_rdl2::rdl2::Vec3f>&>(mv));
+                if (not v.empty() && valueChanged(i->first, value)) {
+                    scene_rdl2::rdl2::Vec3fVector mv = instancer->get<scene_rdl2::rdl2::Vec3fVector>("scales");
+                    if (updateInstanceValues(mv, v, sentValue(i->first), indices, indicesChanged,
+                            [](const pxr::GfVec3f& s) { return reinterpret_cast<const scene_rdl2::rdl2::Vec3f&>(s); })) {
+                        instancer->set("scales", mv);
+                    }
+                    state.sent[i->first] = value;
                 }
             }
 
             i = mPrimvars.find(pxr::HdInstancerTokens->rotate);
-            if (i != mPrimvars.end()) {
+            if (i != mPrimvars.end() && valueChanged(i->first, i->second.value)) {
                 const pxr::VtValue& value = i->second.value;
+                scene_rdl2::rdl2::Vec4fVector vecs = instancer->get<scene_rdl2::rdl2::Vec4fVector>("orientations");
+                bool changed = false;
 
                 // in 0.21.11 the type of the rotations attr switched from VtVec4fArray to VtQuathArray
                 if (value.IsHolding<pxr::VtQuathArray>()) {
                     const pxr::VtQuathArray& quats = value.Get<pxr::VtQuathArray>();
                     if (not quats.empty()) {
-                        std::vector<scene_rdl2::rdl2::Vec4f> vecs(count);
-                        for (size_t i = 0; i < count; ++i) {
-                            const pxr::GfQuath& quat = quats[indices[i] % quats.size()];
-                            vecs[i] =
-                                scene_rdl2::rdl2::Vec4f(float(quat.GetImaginary()[0]),
-                                                        float(quat.GetImaginary()[1]),
-                                                        float(quat.GetImaginary()[2]),
-                                                        float(quat.GetReal()));
-                        }
-                        instancer->set("orientations", vecs);
+                        changed = updateInstanceValues(vecs, quats, sentValue(i->first), indices, indicesChanged,
+                            [](const pxr::GfQuath& quat) {
+                                return scene_rdl2::rdl2::Vec4f(float(quat.GetImaginary()[0]),
+                                                               float(quat.GetImaginary()[1]),
+                                                               float(quat.GetImaginary()[2]),
+                                                               float(quat.GetReal()));
+                            });
                     }
                 } else {
                     const pxr::VtVec4fArray& v = value.Get<pxr::VtVec4fArray>();
                     if (not v.empty()) {
-                        std::vector<pxr::GfVec4f> mv(count);
-                        for (size_t i = 0; i < count; ++i) {
-                            const pxr::GfVec4f& q = v[indices[i] % v.size()];
-                            mv[i] = pxr::GfVec4f(q[1],q[2],q[3],q[0]);
-                        }
-                        instancer->set("orientations", reinterpret_cast<const std::vector<scene_rdl2::rdl2::Vec4f>&>(mv));
+                        changed = updateInstanceValues(vecs, v, sentValue(i->first), indices, indicesChanged,
+                            [](const pxr::GfVec4f& q) {
+                                return scene_rdl2::rdl2::Vec4f(q[1],q[2],q[3],q[0]);
+                            });
                     }
                 }
+                if (changed) instancer->set("orientations", vecs);
+                state.sent[i->first] = value;
             }
+
             i = mPrimvars.find(pxr::HdInstancerTokens->translate);
             if (i != mPrimvars.end()) {
                 const pxr::VtValue& value = i->second.value;
                 const pxr::VtVec3fArray& v = value.Get<pxr::VtVec3fArray>();
-                if (not v.empty()) {
-                    std::vector<pxr::GfVec3f> mv(count);
-                    for (size_t i = 0; i < count; ++i)
-                        mv[i] = v[indices[i] % v.size()];
-                    instancer->set("positions", reinterpret_cast<const std::vector<scene_rdl2::rdl2::Vec3f>&>(mv));
+                if (not v.empty() && valueChanged(i->first, value)) {
+                    scene_rdl2::rdl2::Vec3fVector mv = instancer->get<scene_rdl2::rdl2::Vec3fVector>("positions");
+                    if (updateInstanceValues(mv, v, sentValue(i->first), indices, indicesChanged,
+                            [](const pxr::GfVec3f& p) { return reinterpret_cast<const scene_rdl2::rdl2::Vec3f&>(p); })) {
+                        instancer->set("positions", mv);
+                    }
+                    state.sent[i->first] = value;
                 }
             }
         }
     }
 
+}
+
+// The SceneDelegate api only allows access to the indices by using the prototypeId, which
+// we don't have until this is called. Even the number of indices is unavailable as far
+// as I can tell. So this function must update the data for that subset of indices.
+// Curently a different InstanceGeometry is created for each prototype. It may be possible
+// to use a single one if there is a way to incrementally update the references and refIndices.
+//
+// This is called whenever the prototype syncs, often when nothing about the instancer
+// changed. The indices and primvar values last used are kept per prototype, and only the
+// attributes and UserData whose inputs changed are rebuilt and set, so that unchanged
+// data is not resent to the renderer. Transform arrays are patched in place when only
+// some of the instances moved.
+void
+Instancer::makeInstanceGeometry(const pxr::SdfPath& prototypeId, scene_rdl2::rdl2::Geometry* prototype,
+                                GeometryMixin* geometry, size_t level, size_t childCount)
+{
+    const pxr::SdfPath& id = GetId();
+    pxr::HdSceneDelegate* sceneDelegate = GetDelegate();
+
+    syncInstancer();
+
+    RenderDelegate& renderDelegate = *reinterpret_cast<RenderDelegate*>(sceneDelegate->GetRenderIndex().GetRenderDelegate());
+
+    pxr::VtIntArray indices = sceneDelegate->GetInstanceIndices(id, prototypeId);
+    const size_t count = indices.size();
+
+    // may want to do something special if 0 or 1 indices?
+    //std::cout << id << "::makeInstanceGeometry(" << prototypeId << ") indices.size = " << count << std::endl;
+
+    // HDM-130: Moonray InstanceGeometry primvars override primvars on the prototype, which
+    // is opposite how USD works. Don't create the primvar if it will override incorrectly.
+    // Fixme: this also needs to be done with each intermediate instancer.
+    std::set<pxr::TfToken> usedPrimvars;
+    for (const auto& p : mPrimvars) {
+        if (geometry->isPrimvarUsed(p.first)) usedPrimvars.insert(p.first);
+    }
+
+    // A point instancer that is not nested can put all its prototypes in one instance
+    // geometry. The prototypes sync in parallel, so they only register their indices
+    // here, and the geometry is built by commitSharedInstances() once they are all done.
+    // The primvars of the shared geometry apply to every prototype, so a prototype that
+    // defines some of them keeps an instance geometry of its own. Culling and per-instance
+    // light linking are done per prototype, so they also use the instancer per prototype
+    if (renderDelegate.getSharedInstancers() && level == 0 && GetParentId().IsEmpty() &&
+        usedPrimvars.empty() && not renderDelegate.getInstanceCulling() &&
+        not hasInstanceCategories()) {
+        std::lock_guard<std::mutex> lock(mMapMutex);
+        auto i = mPrototypes.find(prototype);
+        if (i != mPrototypes.end()) {
+            // switched from an instancer per prototype
+            clearInstances(i->second.instancer);
+            mPrototypes.erase(i);
+        }
+        std::vector<scene_rdl2::rdl2::Geometry*> none;
+        clearCategoryCopies(prototype, none);
+        SharedPrototype& shared = mSharedPrototypes[prototype];
+        shared.indices = indices;
+        renderDelegate.addSharedInstancer(this);
+        return;
+    }
+
+    // instances that cannot be seen are not translated, but keep their ids for picking
+    std::vector<int> ids;
+    if (renderDelegate.getInstanceCulling() && level == 0 && GetParentId().IsEmpty()) {
+        cullInstances(renderDelegate, prototypeId, indices, ids);
+    }
+
+    // instances with other light linking than the prototype use copies of it
+    if (level == 0 && GetParentId().IsEmpty()) {
+        splitCategoryGroups(renderDelegate, prototype, geometry, indices, ids, usedPrimvars);
+    }
+
+    bool created = false;
+    PrototypeState* statePtr = prototypeState(renderDelegate, prototype, created);
+    if (not statePtr) return; // it already printed an error, give up
+    PrototypeState& state = *statePtr;
+    scene_rdl2::rdl2::Geometry* instancer = state.instancer;
+
+    if (level == 0 && not GetParentId().IsEmpty() &&
+        flattenInstances(renderDelegate, state, created, prototype, indices, usedPrimvars)) {
+        return;
+    }
+
+    // everything is resent after the instancer was flattened
+    updateInstances(renderDelegate, state, prototype->getName(), indices, ids, usedPrimvars,
+                    created || state.flattened, level, childCount);
+    state.flattened = false;
+    if (created) {
+        UpdateGuard guard(instancer);
+        instancer->set("references", scene_rdl2::rdl2::SceneObjectVector{prototype});
+    }
+
     // This instancer may itself be a prototype for another instancer!
     if (not GetParentId().IsEmpty()) {
         Instancer* parent = (Instancer*)sceneDelegate->GetRenderIndex().GetInstancer(GetParentId());
@@ -341,4 +691,376 @@ Instancer::makeInstanceGeometry(const pxr::SdfPath& prototypeId, scene_rdl2::rdl
 
 }
 
+// true if instances of the instancer have different categories, so that
+// splitCategoryGroups() puts some of them in copies of their prototype
+bool
+Instancer::hasInstanceCategories()
+{
+    std::vector<pxr::VtArray<pxr::TfToken>> instanceCategories;
+    pxr::VtArray<pxr::TfToken> categories;
+    fetchCategories(instanceCategories, categories);
+    for (size_t i = 1; i < instanceCategories.size(); ++i) {
+        if (instanceCategories[i] != instanceCategories[0]) return true;
+    }
+    return false;
+}
+
+// A prototype is only synced by one thread at a time, so its state can be used
+// without the lock once found (std::map entries do not move)
+Instancer::PrototypeState*
+Instancer::prototypeState(RenderDelegate& renderDelegate, scene_rdl2::rdl2::Geometry* prototype,
+                          bool& created)
+{
+    std::lock_guard<std::mutex> lock(mMapMutex);
+    if (mSharedPrototypes.erase(prototype)) {
+        // switched from the shared instance geometry
+        renderDelegate.addSharedInstancer(this);
+    }
+    PrototypeState* state = &mPrototypes[prototype];
+    created = false;
+    if (not state->instancer) {
+        std::string name = prototype->getName() + "/Instancer";
+        scene_rdl2::rdl2::SceneObject* object = renderDelegate.createSceneObject("RdlInstancerGeometry", name);
+        if (not object) return nullptr;
+        state->instancer = object->asA<scene_rdl2::rdl2::Geometry>();
+        renderDelegate.assign(state->instancer, scene_rdl2::rdl2::LayerAssignment());
+        state->instanceId = renderDelegate.createSceneObject("UserData", prototype->getName() + "/instanceId")->asA<scene_rdl2::rdl2::UserData>();
+        created = true;
+    }
+    return state;
+}
+
+void
+Instancer::fetchCategories(std::vector<pxr::VtArray<pxr::TfToken>>& instanceCategories,
+                           pxr::VtArray<pxr::TfToken>& categories)
+{
+    std::lock_guard<std::mutex> lock(mCategoriesMutex);
+    if (not mCategoriesValid) {
+        pxr::HdSceneDelegate* sceneDelegate = GetDelegate();
+        mInstanceCategories = sceneDelegate->GetInstanceCategories(GetId());
+        // point instancer
+        mCategories = mInstanceCategories.empty() ? sceneDelegate->GetCategories(GetId())
+                                                  : pxr::VtArray<pxr::TfToken>();
+        mCategoriesValid = true;
+    }
+    instanceCategories = mInstanceCategories;
+    categories = mCategories;
+}
+
+void
+Instancer::invalidateCategories()
+{
+    std::lock_guard<std::mutex> lock(mCategoriesMutex);
+    mCategoriesValid = false;
+}
+
+pxr::VtArray<pxr::TfToken>
+Instancer::prototypeCategories(const pxr::SdfPath& prototypeId)
+{
+    syncInstancer();
+    std::vector<pxr::VtArray<pxr::TfToken>> instanceCategories;
+    pxr::VtArray<pxr::TfToken> categories;
+    fetchCategories(instanceCategories, categories);
+    if (instanceCategories.empty()) return categories;
+    const pxr::VtIntArray indices = GetDelegate()->GetInstanceIndices(GetId(), prototypeId);
+    if (not indices.empty() && size_t(indices[0]) < instanceCategories.size()) {
+        return instanceCategories[indices[0]];
+    }
+    return instanceCategories[0];
+}
+
+// Moonray takes the light sets of instances from the layer assignment of the prototype,
+// so instances with different categories cannot share it. They are grouped by category
+// set, and each group other than the prototype's own instances a copy of the prototype
+// assigned with its categories. The instances stay instanced, and only the prototype is
+// duplicated, once per distinct category set.
+void
+Instancer::splitCategoryGroups(RenderDelegate& renderDelegate, scene_rdl2::rdl2::Geometry* prototype,
+                               GeometryMixin* geometry, pxr::VtIntArray& indices, std::vector<int>& ids,
+                               const std::set<pxr::TfToken>& usedPrimvars)
+{
+    std::vector<pxr::VtArray<pxr::TfToken>> instanceCategories;
+    pxr::VtArray<pxr::TfToken> ownCategories;
+    fetchCategories(instanceCategories, ownCategories);
+    std::vector<scene_rdl2::rdl2::Geometry*> copies;
+    if (instanceCategories.size() > 1 && not indices.empty()) {
+        auto categoriesOf = [&](int index) -> const pxr::VtArray<pxr::TfToken>& {
+            return size_t(index) < instanceCategories.size() ? instanceCategories[index] : ownCategories;
+        };
+
+        // positions in indices of the instances in each group. Group 0 is the prototype's
+        std::vector<const pxr::VtArray<pxr::TfToken>*> groupCategories{&categoriesOf(indices[0])};
+        std::vector<std::vector<int>> groups(1);
+        for (size_t i = 0; i < indices.size(); ++i) {
+            const pxr::VtArray<pxr::TfToken>& categories = categoriesOf(indices[i]);
+            size_t g = 0;
+            while (g < groups.size() && *groupCategories[g] != categories) ++g;
+            if (g == groups.size()) {
+                groupCategories.push_back(&categories);
+                groups.emplace_back();
+            }
+            groups[g].push_back(int(i));
+        }
+
+        pxr::HdSceneDelegate* sceneDelegate = GetDelegate();
+        for (size_t g = 1; g < groups.size(); ++g) {
+            scene_rdl2::rdl2::Geometry* copy =
+                geometry->categoryCopy(sceneDelegate, renderDelegate, *groupCategories[g]);
+            if (not copy) continue;
+            pxr::VtIntArray groupIndices(groups[g].size());
+            std::vector<int> groupIds(groups[g].size());
+            for (size_t i = 0; i < groups[g].size(); ++i) {
+                const int p = groups[g][i];
+                groupIndices[i] = indices[p];
+                groupIds[i] = ids.empty() ? p : ids[p];
+            }
+            bool created = false;
+            PrototypeState* state = prototypeState(renderDelegate, copy, created);
+            if (not state) continue;
+            updateInstances(renderDelegate, *state, copy->getName(), groupIndices, groupIds,
+                            usedPrimvars, created, 0, 1);
+            if (created) {
+                UpdateGuard guard(state->instancer);
+                state->instancer->set("references", scene_rdl2::rdl2::SceneObjectVector{copy});
+            }
+            copies.push_back(copy);
+        }
+
+        if (groups.size() > 1) {
+            pxr::VtIntArray ownIndices(groups[0].size());
+            std::vector<int> ownIds(groups[0].size());
+            for (size_t i = 0; i < groups[0].size(); ++i) {
+                const int p = groups[0][i];
+                ownIndices[i] = indices[p];
+                ownIds[i] = ids.empty() ? p : ids[p];
+            }
+            indices = ownIndices;
+            ids = std::move(ownIds);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mMapMutex);
+    clearCategoryCopies(prototype, copies);
+}
+
+// empty the instancers of the prototype's copies that are not in keep. mMapMutex must be locked
+void
+Instancer::clearCategoryCopies(scene_rdl2::rdl2::Geometry* prototype,
+                               std::vector<scene_rdl2::rdl2::Geometry*>& keep)
+{
+    std::vector<scene_rdl2::rdl2::Geometry*>& previous = mCategoryCopies[prototype];
+    for (scene_rdl2::rdl2::Geometry* copy : previous) {
+        if (std::find(keep.begin(), keep.end(), copy) != keep.end()) continue;
+        auto i = mPrototypes.find(copy);
+        if (i != mPrototypes.end()) {
+            clearInstances(i->second.instancer);
+            mPrototypes.erase(i);
+        }
+    }
+    previous = std::move(keep);
+}
+
+// Nested instancers normally make a chain of RDL instancers, one per level. If the total
+// number of instances is within the "Flatten Instance Limit" setting, this makes a
+// single instancer for the prototype instead, with the transforms of all the levels
+// composed, and the primvars of all the levels expanded to every instance. The
+// instanceId, instanceIdA... UserData keep the id of each level, so the ids are the
+// same as for the chain. Returns false if the chain must be used.
+bool
+Instancer::flattenInstances(RenderDelegate& renderDelegate, PrototypeState& state, bool created,
+                            scene_rdl2::rdl2::Geometry* prototype, const pxr::VtIntArray& indices,
+                            const std::set<pxr::TfToken>& usedPrimvars)
+{
+    const size_t limit = renderDelegate.getFlattenInstanceLimit();
+    if (limit == 0) return false;
+    pxr::HdRenderIndex& renderIndex = GetDelegate()->GetRenderIndex();
+
+    // the instancers from this one outwards, with the indices of their instances
+    // of the level below. Flattened instance k is instance i0 + n0 * (i1 + n1 * ...)
+    std::vector<std::pair<Instancer*, pxr::VtIntArray>> levels{{this, indices}};
+    size_t total = indices.size();
+    for (Instancer* child = this; not child->GetParentId().IsEmpty(); ) {
+        Instancer* parent = static_cast<Instancer*>(renderIndex.GetInstancer(child->GetParentId()));
+        if (not parent) break;
+        parent->syncInstancer();
+        pxr::VtIntArray parentIndices = parent->GetDelegate()->GetInstanceIndices(parent->GetId(), child->GetId());
+        total *= parentIndices.size();
+        if (total > limit) return false;
+        levels.emplace_back(parent, std::move(parentIndices));
+        child = parent;
+    }
+    std::vector<size_t> strides(levels.size());
+    size_t stride = 1;
+    for (size_t l = 0; l < levels.size(); ++l) {
+        strides[l] = stride;
+        stride *= levels[l].second.size();
+    }
+    // index of the instance of level l that flattened instance k is in
+    auto levelIndex = [&](size_t k, size_t l) {
+        return (k / strides[l]) % levels[l].second.size();
+    };
+
+    // compose the transforms from the innermost level outwards. The transform of the
+    // outermost instancer is the node_xform
+    std::vector<std::vector<pxr::GfMatrix4d>> levelMatrices(levels.size());
+    for (size_t l = 0; l < levels.size(); ++l) {
+        levelMatrices[l] = levels[l].first->instanceMatrices(levels[l].second);
+    }
+    scene_rdl2::rdl2::Mat4dVector xforms(total);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, total, PARALLEL_GATHER_GRAIN),
+        [&](const tbb::blocked_range<size_t>& r) {
+            for (size_t k = r.begin(); k < r.end(); ++k) {
+                pxr::GfMatrix4d m = levelMatrices[0][levelIndex(k, 0)];
+                for (size_t l = 1; l < levels.size(); ++l) {
+                    m *= levels[l - 1].first->mXform;
+                    m *= levelMatrices[l][levelIndex(k, l)];
+                }
+                xforms[k] = reinterpret_cast<const scene_rdl2::rdl2::Mat4d&>(m);
+            }
+        });
+
+    scene_rdl2::rdl2::Geometry* instancer = state.instancer;
+    const std::string prefix = prototype->getName();
+    if (created || not state.cryptoId) makeCryptoId(renderDelegate, state, prefix);
+
+    // the id table : each level's instance id, scaled as in the chain of instancers
+    scene_rdl2::rdl2::SceneObjectVector primitiveAttributes;
+    state.levelIds.resize(levels.size());
+    state.levelIds[0] = state.instanceId;
+    for (size_t l = 0; l < levels.size(); ++l) {
+        std::string name("instanceId");
+        if (l) name.push_back('A'+l-1);
+        if (not state.levelIds[l]) {
+            scene_rdl2::rdl2::SceneObject* object =
+                renderDelegate.createSceneObject("UserData", prefix + "/" + name);
+            if (not object) return false; // already printed an error
+            state.levelIds[l] = object->asA<scene_rdl2::rdl2::UserData>();
+        }
+        scene_rdl2::rdl2::FloatVector out(total);
+        for (size_t k = 0; k < total; ++k) out[k] = levelIndex(k, l) * strides[l];
+        UpdateGuard guard(renderDelegate, state.levelIds[l]);
+        state.levelIds[l]->setFloatData(name, out);
+        primitiveAttributes.push_back(state.levelIds[l]);
+    }
+    primitiveAttributes.push_back(state.cryptoId);
+
+    // primvars of inner levels override those of outer ones. The UserData are rebuilt
+    // every time, as the instance count is bounded by the limit
+    std::set<pxr::TfToken> skipPrimvars(usedPrimvars);
+    for (size_t l = 0; l < levels.size(); ++l) {
+        Instancer* level = levels[l].first;
+        const pxr::VtIntArray& levelIndices = levels[l].second;
+        pxr::VtIntArray flatIndices(total);
+        for (size_t k = 0; k < total; ++k) flatIndices[k] = levelIndices[levelIndex(k, l)];
+        PrototypeState unused;
+        level->updatePrimvars(renderDelegate, unused, prefix, flatIndices, skipPrimvars, true,
+                              primitiveAttributes);
+        for (const auto& p : level->mPrimvars) skipPrimvars.insert(p.first);
+    }
+
+    {   UpdateGuard guard(instancer);
+        if (created || instancer->get<scene_rdl2::rdl2::SceneObjectVector>("primitive_attributes") != primitiveAttributes) {
+            instancer->set("primitive_attributes", primitiveAttributes);
+        }
+        const pxr::GfMatrix4d& xform = levels.back().first->mXform;
+        instancer->set(instancer->sNodeXformKey, reinterpret_cast<const scene_rdl2::rdl2::Mat4d&>(xform));
+        if (created) {
+            instancer->set("references", scene_rdl2::rdl2::SceneObjectVector{prototype});
+            instancer->set("use_reference_xforms", true);
+        }
+        if (created || instancer->get<int>("method") != Method::XFORM_LIST) {
+            instancer->set<int>("method", Method::XFORM_LIST);
+        }
+        if (created || instancer->get<scene_rdl2::rdl2::Mat4dVector>("xform_list") != xforms) {
+            instancer->set("xform_list", std::move(xforms));
+        }
+    }
+    state.flattened = true;
+
+    // empty the chain of instancers used before flattening, RDL objects cannot be deleted
+    scene_rdl2::rdl2::Geometry* child = instancer;
+    for (size_t l = 1; l < levels.size() && child; ++l) {
+        Instancer* level = levels[l].first;
+        std::lock_guard<std::mutex> lock(level->mMapMutex);
+        auto i = level->mPrototypes.find(child);
+        child = nullptr;
+        if (i != level->mPrototypes.end()) {
+            child = i->second.instancer;
+            clearInstances(child);
+            level->mPrototypes.erase(i);
+        }
+    }
+    return true;
+}
+
+void
+Instancer::commitSharedInstances(RenderDelegate& renderDelegate)
+{
+    std::lock_guard<std::mutex> lock(mMapMutex);
+    const pxr::SdfPath& id = GetId();
+
+    if (mSharedPrototypes.empty()) {
+        if (mShared.instancer) clearInstances(mShared.instancer);
+        mShared = PrototypeState();
+        return;
+    }
+
+    // prototypes are referenced in name order so the result does not depend on sync order
+    std::vector<std::pair<std::string, scene_rdl2::rdl2::Geometry*>> prototypes;
+    size_t count = 0;
+    for (const auto& p : mSharedPrototypes) {
+        prototypes.emplace_back(p.first->getName(), p.first);
+        count += p.second.indices.size();
+    }
+    std::sort(prototypes.begin(), prototypes.end());
+    scene_rdl2::rdl2::SceneObjectVector references;
+    for (const auto& p : prototypes) references.push_back(p.second);
+
+    // instances are ordered by their index in the point instancer. Their instanceId is
+    // their position in the indices of their prototype, as with an instancer per prototype
+    struct Instance { int index; int refIndex; int position; };
+    std::vector<Instance> instances;
+    instances.reserve(count);
+    for (size_t r = 0; r < prototypes.size(); ++r) {
+        const pxr::VtIntArray& protoIndices = mSharedPrototypes[prototypes[r].second].indices;
+        for (size_t i = 0; i < protoIndices.size(); ++i) {
+            instances.push_back(Instance{protoIndices[i], int(r), int(i)});
+        }
+    }
+    tbb::parallel_sort(instances.begin(), instances.end(),
+                       [](const Instance& a, const Instance& b) {
+                           return a.index < b.index || (a.index == b.index && a.refIndex < b.refIndex);
+                       });
+    pxr::VtIntArray indices(count);
+    std::vector<int> ids(count);
+    scene_rdl2::rdl2::IntVector refIndices(count);
+    for (size_t i = 0; i < count; ++i) {
+        indices[i] = instances[i].index;
+        ids[i] = instances[i].position;
+        refIndices[i] = instances[i].refIndex;
+    }
+
+    bool created = false;
+    if (not mShared.instancer) {
+        scene_rdl2::rdl2::SceneObject* object =
+            renderDelegate.createSceneObject("RdlInstancerGeometry", id.GetString() + "/Instancer");
+        if (not object) return; // it already printed an error, give up
+        mShared.instancer = object->asA<scene_rdl2::rdl2::Geometry>();
+        renderDelegate.assign(mShared.instancer, scene_rdl2::rdl2::LayerAssignment());
+        mShared.instanceId = renderDelegate.createSceneObject("UserData", id.GetString() + "/instanceId")->asA<scene_rdl2::rdl2::UserData>();
+        created = true;
+    }
+
+    updateInstances(renderDelegate, mShared, id.GetString(), indices, ids, {}, created, 0, 1);
+
+    scene_rdl2::rdl2::Geometry* instancer = mShared.instancer;
+    UpdateGuard guard(instancer);
+    if (created || instancer->get<scene_rdl2::rdl2::SceneObjectVector>("references") != references) {
+        instancer->set("references", references);
+    }
+    if (created || instancer->get<scene_rdl2::rdl2::IntVector>("refIndices") != refIndices) {
+        instancer->set("refIndices", refIndices);
+    }
+}
+
 }
@@ -14,10 +14,17 @@
 #include "GeometryMixin.h"
 #include "MurmurHash3.h"
 
+#include <atomic>
+#include <map>
 #include <mutex>
+#include <set>
+#include <string>
+#include <vector>
 
 namespace hdMoonray {
 
+class RenderDelegate;
+
 class Instancer: public pxr::HdInstancer
 {
 public:
@@ -37,6 +44,24 @@ public:
                               GeometryMixin* geometry, size_t level,
                               size_t childCount = 1);
 
+    // Transforms of the instances of a prototype that is not geometry (a light), each
+    // composed with the transform of this instancer and of any it is nested in
+    std::vector<pxr::GfMatrix4d> prototypeTransforms(const pxr::SdfPath& prototypeId);
+
+    // number of times the instancer has synced, so that users that are not rprims
+    // (lights) can tell if it changed
+    size_t syncCount() const { return mSyncCount; }
+
+    // Categories (light linking) for the prototype : those of its first instance, or
+    // the instancer's own if there are no per-instance categories. The categories are
+    // fetched once and cached until the instancer syncs or invalidateCategories() is called
+    pxr::VtArray<pxr::TfToken> prototypeCategories(const pxr::SdfPath& prototypeId);
+    void invalidateCategories();
+
+    // Build or update the instance geometry shared by all the prototypes, after they
+    // have synced. Called by the render delegate when the "Shared Instancers" setting is on
+    void commitSharedInstances(RenderDelegate& renderDelegate);
+
 #if PXR_VERSION < 2102
     void sync(pxr::HdSceneDelegate *sceneDelegate,
               pxr::HdDirtyBits     *dirtyBits);
@@ -52,9 +77,89 @@ private:
     std::map<pxr::TfToken, PrimvarInfo> mPrimvars;
     pxr::GfMatrix4d mXform;
 
+    // The objects created for a prototype, and the data last sent to them, so that
+    // makeInstanceGeometry() only resends what changed
+    struct PrototypeState {
+        scene_rdl2::rdl2::Geometry* instancer = nullptr;
+        scene_rdl2::rdl2::UserData* instanceId = nullptr;
+        scene_rdl2::rdl2::UserData* cryptoId = nullptr;
+        pxr::VtIntArray indices;
+        size_t instanceIdCount = 0;
+        size_t level = 0;
+        size_t childCount = 0;
+        pxr::GfMatrix4d xform;
+        // instancer primvar values the attributes and UserData were made from
+        std::map<pxr::TfToken, pxr::VtValue> sent;
+        // UserData made for each primvar, null if the type is not translated
+        std::map<pxr::TfToken, scene_rdl2::rdl2::UserData*> primvars;
+        // true if the instancer holds the instances of all nesting levels
+        bool flattened = false;
+        // instance id UserData of each nesting level, when flattened
+        std::vector<scene_rdl2::rdl2::UserData*> levelIds;
+
+        // true if value is not the one the data for name was made from. Comparing
+        // VtArrays that share data is cheap
+        bool changed(const pxr::TfToken& name, const pxr::VtValue& value) const {
+            auto i = sent.find(name);
+            return i == sent.end() || i->second != value;
+        }
+    };
+
     // map from prototype object to the instancer created for it
-    std::map<scene_rdl2::rdl2::Geometry*, scene_rdl2::rdl2::Geometry*> mInstancers;
+    std::map<scene_rdl2::rdl2::Geometry*, PrototypeState> mPrototypes;
     std::mutex mMapMutex;
+    std::atomic<size_t> mSyncCount{0};
+
+    void syncInstancer();
+    // find or create the state for a prototype. Returns null on error
+    PrototypeState* prototypeState(RenderDelegate& renderDelegate,
+                                   scene_rdl2::rdl2::Geometry* prototype, bool& created);
+    // move instances whose categories differ from the prototype's into instancers
+    // of copies of the prototype, leaving the rest in indices and ids
+    void splitCategoryGroups(RenderDelegate& renderDelegate, scene_rdl2::rdl2::Geometry* prototype,
+                             GeometryMixin* geometry, pxr::VtIntArray& indices, std::vector<int>& ids,
+                             const std::set<pxr::TfToken>& usedPrimvars);
+    void clearCategoryCopies(scene_rdl2::rdl2::Geometry* prototype,
+                             std::vector<scene_rdl2::rdl2::Geometry*>& keep);
+    // per-instance transforms, without the instancer transform
+    std::vector<pxr::GfMatrix4d> instanceMatrices(const pxr::VtIntArray& indices) const;
+    bool cullInstances(RenderDelegate& renderDelegate, const pxr::SdfPath& prototypeId,
+                       pxr::VtIntArray& indices, std::vector<int>& ids) const;
+    void makeCryptoId(RenderDelegate& renderDelegate, PrototypeState& state, const std::string& prefix);
+    void updatePrimvars(RenderDelegate& renderDelegate, PrototypeState& state,
+                        const std::string& prefix, const pxr::VtIntArray& indices,
+                        const std::set<pxr::TfToken>& skipPrimvars, bool indicesChanged,
+                        scene_rdl2::rdl2::SceneObjectVector& primitiveAttributes);
+    void updateInstances(RenderDelegate& renderDelegate, PrototypeState& state,
+                         const std::string& prefix, const pxr::VtIntArray& indices,
+                         const std::vector<int>& ids,
+                         const std::set<pxr::TfToken>& skipPrimvars, bool created,
+                         size_t level, size_t childCount);
+
+    bool flattenInstances(RenderDelegate& renderDelegate, PrototypeState& state, bool created,
+                          scene_rdl2::rdl2::Geometry* prototype, const pxr::VtIntArray& indices,
+                          const std::set<pxr::TfToken>& usedPrimvars);
+
+    // prototypes in the shared instance geometry, with the indices of their instances.
+    // Only prototypes defining none of the instancer primvars are shared
+    struct SharedPrototype {
+        pxr::VtIntArray indices;
+    };
+    std::map<scene_rdl2::rdl2::Geometry*, SharedPrototype> mSharedPrototypes;
+    PrototypeState mShared;
+
+    // cached GetInstanceCategories() and GetCategories() for the instancer
+    std::vector<pxr::VtArray<pxr::TfToken>> mInstanceCategories;
+    pxr::VtArray<pxr::TfToken> mCategories;
+    bool mCategoriesValid = false;
+    std::mutex mCategoriesMutex;
+    // returns copies of the above, fetching them if needed. The cache may be invalidated
+    // by another prototype's sync, so it is not read without the lock
+    void fetchCategories(std::vector<pxr::VtArray<pxr::TfToken>>& instanceCategories,
+                         pxr::VtArray<pxr::TfToken>& categories);
+    bool hasInstanceCategories();
+    // prototype copies used for other categories at the last sync of each prototype
+    std::map<scene_rdl2::rdl2::Geometry*, std::vector<scene_rdl2::rdl2::Geometry*>> mCategoryCopies;
 };
 
 }
@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "Light.h"
+#include "Instancer.h"
 #include "LightFilter.h"
 #include "Mesh.h"
 #include "RenderDelegate.h"
@@ -159,7 +160,7 @@ Light::setOn(bool value, RenderDelegate& renderDelegate) {
             renderDelegate.addLight();
         else
             renderDelegate.removeLight();
-        mLight->set(mLight->sOnKey, value);
+        mLight->set(mLight->sOnKey, value && not mInstanced);
     }
 }
 
@@ -194,10 +195,17 @@ Light::syncParams(const pxr::SdfPath& id,
                   pxr::HdSceneDelegate *sceneDelegate,
                   RenderDelegate& renderDelegate)
 {
-    const SceneClass& sceneClass = mLight->getSceneClass();
+    const AttributePlan& plan = renderDelegate.attributePlan(mLight->getSceneClass());
+
+    // values last set, so that only changed attributes are set. Setting an attribute marks
+    // it as changed even if the value is the same, which makes it part of the update
+    const bool force = mParamValues.size() != plan.entries().size();
+    if (force) mParamValues.assign(plan.entries().size(), pxr::VtValue());
 
-    for (auto it = sceneClass.beginAttributes(); it != sceneClass.endAttributes(); ++it) {
-        const std::string& attrName = (*it)->getName();
+    for (size_t i = 0; i < plan.entries().size(); ++i) {
+        const AttributePlan::Entry& entry = plan.entries()[i];
+        const Attribute* attribute = entry.attribute;
+        const std::string& attrName = entry.name.GetString();
 
         // attributes directly updated by Sync():
         if (attrName == "on" || attrName == "node_xform" || attrName == "intensity") continue;
@@ -221,9 +229,11 @@ Light::syncParams(const pxr::SdfPath& id,
                 Mesh* mesh = dynamic_cast<Mesh*>(prim);
                 if (mesh) {
                     // geometry sync should not be running in parallel with light sync
-                    scene_rdl2::rdl2::SceneObject* geom = mesh->geometryForMeshLight(renderDelegate);
-                    if (geom) {
-                        mLight->set("geometry",geom);
+                    scene_rdl2::rdl2::SceneObject* geom = mesh->geometryForMeshLight(
+                        renderDelegate, sceneDelegate->GetRenderIndex().GetChangeTracker());
+                    const AttributeKey<SceneObject*> key(*attribute);
+                    if (geom && mLight->get(key) != geom) {
+                        mLight->set(key, geom);
                     } 
                 } 
             } 
@@ -231,38 +241,17 @@ Light::syncParams(const pxr::SdfPath& id,
         }
 
         // check if attr is set by a moonray::name property
-        std::string moonrayName = "moonray:"+attrName;
-        pxr::VtValue val = sceneDelegate->GetLightParamValue(id, pxr::TfToken(moonrayName));
-        if (!val.IsEmpty()) {
-            ValueConverter::setAttribute(mLight, *it, val);
-            continue;
-        }
+        pxr::VtValue val = sceneDelegate->GetLightParamValue(id, entry.moonrayName);
 
-        // Find the equivalent Lux attribute
-        static const std::map<std::string,pxr::TfToken> map = {
-            { "color", pxr::HdLightTokens->color },
-            //{ "intensity", pxr::HdLightTokens->intensity }, // handled in sync
-            { "exposure", pxr::HdLightTokens->exposure },
-            { "radius", pxr::HdLightTokens->radius },
-            { "normalized", pxr::HdLightTokens->normalize },
-            { "width", pxr::HdLightTokens->width },
-            { "height", pxr::HdLightTokens->height },
-            { "angular_extent", pxr::HdLightTokens->angle },
-            { "texture", pxr::HdLightTokens->textureFile },
-            { "lens_radius", pxr::HdLightTokens->radius },
-            { "outer_cone_angle", pxr::HdLightTokens->shapingConeAngle },
-            { "inner_cone_angle", pxr::HdLightTokens->shapingConeSoftness }
-        };
-        auto it2 = map.find(attrName);
-        if (it2 != map.end()) {
-            pxr::TfToken luxName = it2->second;
+        // the equivalent Lux attribute
+        if (val.IsEmpty() && not entry.luxName.IsEmpty()) {
+            pxr::TfToken luxName = entry.luxName;
 
             if (luxName == pxr::HdLightTokens->shapingConeAngle) {
                 float coneAngle = 90; // Lux default value
                 val = sceneDelegate->GetLightParamValue(id, pxr::HdLightTokens->shapingConeAngle);
                 if (val.IsHolding<float>()) coneAngle = val.UncheckedGet<float>();
-                mLight->set(AttributeKey<float>(**it), 2 * coneAngle);
-                continue;
+                val = pxr::VtValue(2 * coneAngle);
 
             } else if (luxName == pxr::HdLightTokens->shapingConeSoftness) {
                 float softness = 0; // Lux default value
@@ -275,8 +264,7 @@ Light::syncParams(const pxr::SdfPath& id,
                 if (softness > 0) {
                     innerConeAngle = (softness < 1) ? coneAngle * (1 - softness) : 0.0f;
                 }
-                mLight->set(AttributeKey<float>(**it), 2 * innerConeAngle);
-                continue;
+                val = pxr::VtValue(2 * innerConeAngle);
 
             } else if (luxName == pxr::HdLightTokens->radius && mRectToSpotlight == true) {
                 // Since rect lights with shaping are converted to spotlights, we approximate
@@ -288,8 +276,8 @@ Light::syncParams(const pxr::SdfPath& id,
                 val = sceneDelegate->GetLightParamValue(id, pxr::HdLightTokens->height);
                 if (val.IsHolding<float>()) height = val.UncheckedGet<float>();
                 const float radius = scene_rdl2::math::sqrt((width * height) / scene_rdl2::math::sPi);
-                mLight->set(AttributeKey<float>(**it), radius);
-                continue;
+                val = pxr::VtValue(radius);
+
             } else if (luxName == pxr::HdLightTokens->color) {
                 pxr::GfVec3f color(1.0f);
                 val = sceneDelegate->GetLightParamValue(id, luxName);
@@ -311,8 +299,7 @@ Light::syncParams(const pxr::SdfPath& id,
                         color[2] *= tempRgb[2];
                     }
                 }
-                mLight->set(AttributeKey<scene_rdl2::rdl2::Rgb>(**it), reinterpret_cast<scene_rdl2::rdl2::Rgb&>(color));
-                continue;
+                val = pxr::VtValue(color);
 
             } else {
                 // special case: Lux CylinderLight uses "length" where rdl2 uses "height"
@@ -321,15 +308,17 @@ Light::syncParams(const pxr::SdfPath& id,
                 }
                 // schema will cause correct default to be returned
                 val = sceneDelegate->GetLightParamValue(id, luxName);
-                if (!val.IsEmpty()) {
-                    ValueConverter::setAttribute(mLight, *it, val);
-                    continue;
-                }
             }
         }
 
-        // no setting, so reset to default
-        ValueConverter::setDefault(mLight, *it);
+        if (not force && val == mParamValues[i]) continue;
+        if (val.IsEmpty()) {
+            // no setting, so reset to default
+            ValueConverter::setDefault(mLight, attribute);
+        } else {
+            ValueConverter::setAttribute(mLight, attribute, val);
+        }
+        mParamValues[i] = std::move(val);
     }
 }
 
@@ -350,7 +339,110 @@ Light::syncFilterList(const pxr::SdfPath& id,
             filters.push_back(filter);
         }
     }
-    mLight->set(scene_rdl2::rdl2::Light::sLightFiltersKey,filters);
+    if (mLight->get(scene_rdl2::rdl2::Light::sLightFiltersKey) != filters) {
+        mLight->set(scene_rdl2::rdl2::Light::sLightFiltersKey,filters);
+    }
+}
+
+namespace {
+
+// Total number of syncs of an instancer and the ones it is nested in, which changes
+// when any of them changes. Dirty is set if one has changes it has not synced yet
+size_t
+instancerVersion(pxr::HdRenderIndex& renderIndex, pxr::SdfPath id, bool& dirty)
+{
+    size_t version = 0;
+    dirty = false;
+    while (not id.IsEmpty()) {
+        Instancer* instancer = static_cast<Instancer*>(renderIndex.GetInstancer(id));
+        if (not instancer) break;
+        version += instancer->syncCount();
+        if (pxr::HdChangeTracker::IsDirty(renderIndex.GetChangeTracker().GetInstancerDirtyBits(id))) {
+            dirty = true;
+        }
+        id = instancer->GetParentId();
+    }
+    return version;
+}
+
+}
+
+// Make a copy of the light for each instance, at the instance transform. Parameters
+// are read from Hydra once, into mLight, and only changed attributes are copied
+void
+Light::syncInstances(const pxr::SdfPath& id,
+                     pxr::HdSceneDelegate *sceneDelegate,
+                     RenderDelegate& renderDelegate,
+                     bool& categoriesChanged)
+{
+    std::vector<pxr::GfMatrix4d> transforms;
+    const pxr::SdfPath instancerId = sceneDelegate->GetInstancerId(id);
+    if (not instancerId.IsEmpty()) {
+        Instancer* instancer = static_cast<Instancer*>(
+            sceneDelegate->GetRenderIndex().GetInstancer(instancerId));
+        // this syncs the instancers first
+        if (instancer) transforms = instancer->prototypeTransforms(id);
+        bool dirty;
+        mInstancerVersion = instancerVersion(sceneDelegate->GetRenderIndex(), instancerId, dirty);
+    }
+    if (instancerId != mInstancerId) {
+        if (mInstancerId.IsEmpty()) renderDelegate.addInstancedLight(this);
+        if (instancerId.IsEmpty()) renderDelegate.removeInstancedLight(this);
+        mInstancerId = instancerId;
+    }
+    mSceneDelegate = sceneDelegate;
+    mInstanced = not instancerId.IsEmpty();
+    if (mLight->get(mLight->sOnKey) != (mOn && not mInstanced)) {
+        mLight->set(mLight->sOnKey, mOn && not mInstanced);
+    }
+
+    const SceneClass& sceneClass = mLight->getSceneClass();
+    const AttributePlan& plan = renderDelegate.attributePlan(sceneClass);
+    const Mat4d xform0 = mLight->get(mLight->sNodeXformKey);
+    const Mat4d xform1 = mLight->get(mLight->sNodeXformKey, TIMESTEP_END);
+
+    size_t count = 0;
+    for (; count < transforms.size(); ++count) {
+        if (count == mInstances.size()) {
+            SceneObject* object = renderDelegate.createSceneObject(
+                sceneClass.getName(), id.GetString() + "_instance" + std::to_string(count));
+            scene_rdl2::rdl2::Light* light = object ? object->asA<scene_rdl2::rdl2::Light>() : nullptr;
+            if (not light) break;
+            mInstances.push_back(light);
+        }
+        scene_rdl2::rdl2::Light* light = mInstances[count];
+        UpdateGuard guard(light);
+        for (const AttributePlan::Entry& entry : plan.entries()) {
+            const std::string& attrName = entry.name.GetString();
+            if (attrName == "on" || attrName == "node_xform") continue;
+            ValueConverter::copyAttribute(light, *mLight, entry.attribute);
+        }
+        const pxr::GfMatrix4d& m = transforms[count];
+        const pxr::GfMatrix4d m0 = reinterpret_cast<const pxr::GfMatrix4d&>(xform0) * m;
+        const pxr::GfMatrix4d m1 = reinterpret_cast<const pxr::GfMatrix4d&>(xform1) * m;
+        const Mat4d& x0 = reinterpret_cast<const Mat4d&>(m0);
+        const Mat4d& x1 = reinterpret_cast<const Mat4d&>(m1);
+        if (light->get(light->sNodeXformKey) != x0) light->set(light->sNodeXformKey, x0);
+        if (light->get(light->sNodeXformKey, TIMESTEP_END) != x1) {
+            light->set(light->sNodeXformKey, x1, TIMESTEP_END);
+        }
+        if (light->get(light->sOnKey) != mOn) light->set(light->sOnKey, mOn);
+        if (count >= mNumInstances) {
+            renderDelegate.setCategory(light, RenderDelegate::CategoryType::LightLink, mLightLinkCategory);
+            renderDelegate.setCategory(light, RenderDelegate::CategoryType::ShadowLink, mShadowLinkCategory);
+            categoriesChanged = true;
+        }
+    }
+
+    for (size_t i = count; i < mNumInstances; ++i) {
+        scene_rdl2::rdl2::Light* light = mInstances[i];
+        UpdateGuard guard(light);
+        light->set(light->sOnKey, false);
+        renderDelegate.releaseCategory(light, RenderDelegate::CategoryType::LightLink, mLightLinkCategory);
+        renderDelegate.releaseCategory(light, RenderDelegate::CategoryType::ShadowLink, mShadowLinkCategory);
+        categoriesChanged = true;
+    }
+    mNumInstances = count;
 }
 
 void
@@ -391,9 +483,12 @@ Light::Sync(pxr::HdSceneDelegate *sceneDelegate,
         syncXform(id, sceneDelegate);
     }
 
+    bool categoriesChanged = false;
     if ((*dirtyBits) & pxr::HdLight::DirtyParams) {
         setOn(intensity > 0, renderDelegate);
-        mLight->set(scene_rdl2::rdl2::Light::sIntensityKey, intensity);
+        if (initialize || mLight->get(scene_rdl2::rdl2::Light::sIntensityKey) != intensity) {
+            mLight->set(scene_rdl2::rdl2::Light::sIntensityKey, intensity);
+        }
         syncParams(id, sceneDelegate, renderDelegate);
         syncFilterList(id, sceneDelegate, renderDelegate);
         // querying "lightLink" will return a token used to name the "category" that
@@ -403,7 +498,6 @@ Light::Sync(pxr::HdSceneDelegate *sceneDelegate,
         // us using an internal cache.
         // Value is either "" or "<id>.collection:lightLink" though this will allow others.
         // Currently Finalize() is called when value changes, but this may be a bug.
-        bool categoriesChanged = false;
         pxr::TfToken t =
             sceneDelegate->GetLightParamValue(id, pxr::HdTokens->lightLink).Get<pxr::TfToken>();
         // registering the category id token with RenderDelegate will enable geometry
@@ -413,6 +507,10 @@ Light::Sync(pxr::HdSceneDelegate *sceneDelegate,
                 renderDelegate.releaseCategory(mLight, RenderDelegate::CategoryType::LightLink, mLightLinkCategory);
             }
             renderDelegate.setCategory(mLight, RenderDelegate::CategoryType::LightLink, t);
+            for (size_t i = 0; i < mNumInstances; ++i) {
+                renderDelegate.releaseCategory(mInstances[i], RenderDelegate::CategoryType::LightLink, mLightLinkCategory);
+                renderDelegate.setCategory(mInstances[i], RenderDelegate::CategoryType::LightLink, t);
+            }
             mLightLinkCategory = t;
             categoriesChanged = true;
         }
@@ -423,22 +521,51 @@ Light::Sync(pxr::HdSceneDelegate *sceneDelegate,
                 renderDelegate.releaseCategory(mLight, RenderDelegate::CategoryType::ShadowLink, mShadowLinkCategory);
             }
             renderDelegate.setCategory(mLight, RenderDelegate::CategoryType::ShadowLink, t);
+            for (size_t i = 0; i < mNumInstances; ++i) {
+                renderDelegate.releaseCategory(mInstances[i], RenderDelegate::CategoryType::ShadowLink, mShadowLinkCategory);
+                renderDelegate.setCategory(mInstances[i], RenderDelegate::CategoryType::ShadowLink, t);
+            }
             mShadowLinkCategory = t;
             categoriesChanged = true;
         }
-        // Need to call Sync() on all geometry to get categories copied into LightSets
-        if (categoriesChanged) {
-            // in 0.22.5, DirtyCategories seems to be ignored. We can force a sync using
-            // DirtyMaterialId even though it isn't strict;y right...
-            sceneDelegate->GetRenderIndex().GetChangeTracker().MarkAllRprimsDirty(
-                pxr::HdChangeTracker::DirtyCategories | pxr::HdChangeTracker::DirtyMaterialId);
-        }
+    }
+
+    // instances are made from the synced light, so Hydra only syncs the prototype
+    if (((*dirtyBits) & (pxr::HdLight::DirtyTransform | pxr::HdLight::DirtyParams)) &&
+        (mInstanced || not sceneDelegate->GetInstancerId(id).IsEmpty())) {
+        syncInstances(id, sceneDelegate, renderDelegate, categoriesChanged);
+    }
+
+    // Need to call Sync() on all geometry to get categories copied into LightSets
+    if (categoriesChanged) {
+        // in 0.22.5, DirtyCategories seems to be ignored. We can force a sync using
+        // DirtyMaterialId even though it isn't strict;y right...
+        sceneDelegate->GetRenderIndex().GetChangeTracker().MarkAllRprimsDirty(
+            pxr::HdChangeTracker::DirtyCategories | pxr::HdChangeTracker::DirtyMaterialId);
     }
 
     *dirtyBits = DirtyBits::Clean;
     hdmLogSyncEnd(id);
 }
 
+void
+Light::updateInstances(RenderDelegate& renderDelegate)
+{
+    if (not mLight || mInstancerId.IsEmpty() || not mSceneDelegate) return;
+    bool dirty;
+    const size_t version = instancerVersion(mSceneDelegate->GetRenderIndex(), mInstancerId, dirty);
+    if (not dirty && version == mInstancerVersion) return;
+
+    UpdateGuard guard(renderDelegate, mLight);
+    bool categoriesChanged = false;
+    syncInstances(GetId(), mSceneDelegate, renderDelegate, categoriesChanged);
+    if (categoriesChanged) {
+        // the rprims have not synced yet, they add the new copies to their LightSets
+        mSceneDelegate->GetRenderIndex().GetChangeTracker().MarkAllRprimsDirty(
+            pxr::HdChangeTracker::DirtyCategories | pxr::HdChangeTracker::DirtyMaterialId);
+    }
+}
+
 void
 Light::Finalize(pxr::HdRenderParam *renderParam)
 {
@@ -448,7 +575,20 @@ Light::Finalize(pxr::HdRenderParam *renderParam)
         setOn(false, renderDelegate);
         renderDelegate.releaseCategory(mLight, RenderDelegate::CategoryType::LightLink, mLightLinkCategory);
         renderDelegate.releaseCategory(mLight, RenderDelegate::CategoryType::ShadowLink, mShadowLinkCategory);
+        for (size_t i = 0; i < mNumInstances; ++i) {
+            UpdateGuard instanceGuard(mInstances[i]);
+            mInstances[i]->set(mInstances[i]->sOnKey, false);
+            renderDelegate.releaseCategory(mInstances[i], RenderDelegate::CategoryType::LightLink, mLightLinkCategory);
+            renderDelegate.releaseCategory(mInstances[i], RenderDelegate::CategoryType::ShadowLink, mShadowLinkCategory);
+        }
+        mInstances.clear();
+        mNumInstances = 0;
+        mInstanced = false;
+        if (not mInstancerId.IsEmpty()) renderDelegate.removeInstancedLight(this);
+        mInstancerId = pxr::SdfPath();
+        mSceneDelegate = nullptr;
         mLight = nullptr;
+        mParamValues.clear();
     }
 }
 
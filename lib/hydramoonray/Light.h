@@ -5,9 +5,12 @@
 
 #include <tbb/tbb_machine.h> // fix for icc-19/tbb bug
 #include <pxr/imaging/hd/light.h>
+#include <pxr/base/vt/value.h>
 
 #include <scene_rdl2/scene/rdl2/Types.h>
 
+#include <vector>
+
 namespace scene_rdl2 {namespace rdl2 {
 class Light;
 } }
@@ -36,6 +39,11 @@ public:
 
     void Finalize(pxr::HdRenderParam *renderParam) override;
 
+    // Remake the instances of a light that is a prototype of an instancer, if the
+    // instancer changed since they were made. Hydra does not sync the light then, so
+    // RenderDelegate::updateInstancedLights() calls this
+    void updateInstances(RenderDelegate& renderDelegate);
+
 private:
     const std::string& rdlClassName(const pxr::SdfPath& id,
                                     pxr::HdSceneDelegate *sceneDelegate);
@@ -48,6 +56,10 @@ private:
     void syncFilterList(const pxr::SdfPath& id,
                         pxr::HdSceneDelegate *sceneDelegate,
                         RenderDelegate& renderDelegate);
+    void syncInstances(const pxr::SdfPath& id,
+                       pxr::HdSceneDelegate *sceneDelegate,
+                       RenderDelegate& renderDelegate,
+                       bool& categoriesChanged);
 
     void fixCylinderLight(scene_rdl2::rdl2::Mat4d& mat);
 
@@ -57,7 +69,20 @@ private:
     bool mRectToSpotlight;
 
     scene_rdl2::rdl2::Light* mLight = nullptr;
+    // the Hydra value each attribute was last set from, in AttributePlan order. Empty
+    // for the default
+    std::vector<pxr::VtValue> mParamValues;
     bool mOn = false;
+
+    // When the light is a prototype of an Instancer, mLight is a template that is kept
+    // off, and a copy of it is made for each instance. Copies of removed instances are
+    // turned off, as RDL objects cannot be deleted, and reused if instances are added
+    bool mInstanced = false;
+    std::vector<scene_rdl2::rdl2::Light*> mInstances;
+    size_t mNumInstances = 0; // copies in use
+    pxr::SdfPath mInstancerId;
+    size_t mInstancerVersion = 0; // see instancerVersion() in Light.cc
+    pxr::HdSceneDelegate* mSceneDelegate = nullptr;
     void setOn(bool, RenderDelegate& renderDelegate);
 
     // the name of a category holding all geometry lit by this light
@@ -51,12 +51,11 @@ LightFilter::syncParams(const pxr::SdfPath& id,
                   pxr::HdSceneDelegate *sceneDelegate,
                   RenderDelegate& renderDelegate)
 {
-    const SceneClass& sceneClass = mLightFilter->getSceneClass();
+    const AttributePlan& plan = renderDelegate.attributePlan(mLightFilter->getSceneClass());
 
-    for (auto it = sceneClass.beginAttributes();
-         it != sceneClass.endAttributes(); ++it) {
+    for (const AttributePlan::Entry& entry : plan.entries()) {
 
-        const std::string& attrName = (*it)->getName();
+        const std::string& attrName = entry.name.GetString();
         if (attrName == "node_xform") {
             syncXform(id, sceneDelegate);
         } else if (attrName == "projector") {
@@ -66,12 +65,11 @@ LightFilter::syncParams(const pxr::SdfPath& id,
         } else  if (attrName == "light_filters") {
             syncCombineFilters(id, sceneDelegate, renderDelegate);
         } else {
-            pxr::TfToken moonrayName("moonray:" + attrName);
-            pxr::VtValue val = sceneDelegate->GetLightParamValue(id, moonrayName);
+            pxr::VtValue val = sceneDelegate->GetLightParamValue(id, entry.moonrayName);
             if (val.IsEmpty()) {
-                ValueConverter::setDefault(mLightFilter, *it);
+                ValueConverter::setDefault(mLightFilter, entry.attribute);
             } else {
-                ValueConverter::setAttribute(mLightFilter, *it, val);
+                ValueConverter::setAttribute(mLightFilter, entry.attribute, val);
             }
         }
     }
@@ -5,6 +5,7 @@
 #include "RenderDelegate.h"
 #include "ValueConverter.h"
 #include "CoordSys.h"
+#include "MaterialCache.h"
 #include "HdmLog.h"
 
 #include <pxr/base/gf/vec2f.h>
@@ -25,6 +26,9 @@
 
 #include <scene_rdl2/render/logging/logging.h>
 #include <iostream>
+#include <set>
+#include <unordered_map>
+#include <vector>
 
 using namespace scene_rdl2::rdl2;
 using namespace scene_rdl2::math;
@@ -134,43 +138,53 @@ getCoordSysBinding(
     return nullptr;
 }
 
-SceneObject*
-makeMoonrayShader(
+bool
+setupMoonrayShader(
     hdMoonray::RenderDelegate& renderDelegate,
     pxr::HdSceneDelegate *sceneDelegate,
     const pxr::HdMaterialNode& node,
-    const std::string& nodeName,
+    SceneObject* shaderObj,
     const pxr::HdRprim* geom
 ) {
-    SceneObject* shaderObj = renderDelegate.createSceneObject(node.identifier.GetString(), nodeName);
-    if (shaderObj) {
-        try {
-            SceneObject::UpdateGuard guard(shaderObj);
-            const SceneClass& sceneClass = shaderObj->getSceneClass();
-            for (auto it = sceneClass.beginAttributes(); it != sceneClass.endAttributes(); ++it) {
-                const Attribute* attribute = *it;
-                const std::string& attrName = attribute->getName();
-                if (geom!=nullptr && attribute->getType() == scene_rdl2::rdl2::TYPE_SCENE_OBJECT) {
-                    SceneObject* binding = getCoordSysBinding(
-                        renderDelegate, sceneDelegate, node, pxr::TfToken(attrName), geom);
-                    shaderObj->set(AttributeKey<SceneObject*>(*attribute), binding);
+    try {
+        SceneObject::UpdateGuard guard(shaderObj);
+        const hdMoonray::AttributePlan& plan = renderDelegate.attributePlan(shaderObj->getSceneClass());
+        for (const hdMoonray::AttributePlan::Entry& entry : plan.entries()) {
+            const Attribute* attribute = entry.attribute;
+            if (geom!=nullptr && attribute->getType() == scene_rdl2::rdl2::TYPE_SCENE_OBJECT) {
+                SceneObject* binding = getCoordSysBinding(
+                    renderDelegate, sceneDelegate, node, entry.name, geom);
+                shaderObj->set(AttributeKey<SceneObject*>(*attribute), binding);
+            } else {
+                auto valIt = node.parameters.find(entry.name);
+                if (valIt != node.parameters.end()) {
+                    hdMoonray::ValueConverter::setAttribute(shaderObj, attribute, valIt->second);
                 } else {
-                    auto valIt = node.parameters.find(pxr::TfToken(attrName));
-                    if (valIt != node.parameters.end()) {
-                        hdMoonray::ValueConverter::setAttribute(shaderObj, attribute, valIt->second);
-                    } else {
-                        hdMoonray::ValueConverter::setDefault(shaderObj, attribute);
-                    }
+                    hdMoonray::ValueConverter::setDefault(shaderObj, attribute);
                 }
             }
-        } catch (const std::exception& e) {
-            Logger::error(node.path, ": ", e.what());
-            return nullptr;
         }
+    } catch (const std::exception& e) {
+        Logger::error(node.path, ": ", e.what());
+        return false;
     }
-    return shaderObj;
+    return true;
 }
 
+SceneObject*
+makeMoonrayShader(
+    hdMoonray::RenderDelegate& renderDelegate,
+    pxr::HdSceneDelegate *sceneDelegate,
+    const pxr::HdMaterialNode& node,
+    const std::string& nodeName,
+    const pxr::HdRprim* geom
+) {
+    SceneObject* shaderObj = renderDelegate.createSceneObject(node.identifier.GetString(), nodeName);
+    if (shaderObj && not setupMoonrayShader(renderDelegate, sceneDelegate, node, shaderObj, geom)) {
+        return nullptr;
+    }
+    return shaderObj;
+}
 
 std::string
 getNodeWithChannelName(const std::string& nodePath,
@@ -181,6 +195,108 @@ getNodeWithChannelName(const std::string& nodePath,
 
 //} // namespace {
 
+namespace {
+
+size_t
+hashCombine(size_t seed, size_t h)
+{
+    return seed ^ (h + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
+// start reading the textures of a shader in the background, and watch them for changes
+void
+addTextures(hdMoonray::RenderDelegate& renderDelegate, const SceneObject* shader)
+{
+    const hdMoonray::AttributePlan& plan = renderDelegate.attributePlan(shader->getSceneClass());
+    for (const Attribute* attribute : plan.filenames()) {
+        const std::string& path = shader->get(AttributeKey<String>(*attribute));
+        renderDelegate.texturePrefetch().add(path);
+        renderDelegate.textureWatcher().add(path);
+    }
+}
+
+// Index of a material network, so that nodes and their relationships are found
+// without searching. In an HdMaterialRelationship the "input" is the upstream node
+// and the "output" is the node whose parameter is connected
+struct NetworkIndex
+{
+    explicit NetworkIndex(const pxr::HdMaterialNetwork& network):
+        channels(network.nodes.size()),
+        connections(network.nodes.size())
+    {
+        for (size_t i = 0; i < network.nodes.size(); ++i) {
+            nodes.emplace(network.nodes[i].path, i);
+        }
+        for (size_t r = 0; r < network.relationships.size(); ++r) {
+            const pxr::HdMaterialRelationship& rel = network.relationships[r];
+            size_t i = find(rel.inputId);
+            if (i != npos) {
+                channels[i].insert(rel.inputName.GetString());
+                connections[i].push_back(r);
+            }
+            size_t o = find(rel.outputId);
+            if (o != npos && o != i) connections[o].push_back(r);
+        }
+
+        // upstream nodes first, so that a node's inputs are made before it
+        std::vector<char> visited(network.nodes.size(), 0);
+        for (size_t i = 0; i < network.nodes.size(); ++i) {
+            visit(network, i, visited);
+        }
+    }
+
+    static constexpr size_t npos = size_t(-1);
+
+    size_t find(const pxr::SdfPath& path) const
+    {
+        auto it = nodes.find(path);
+        return it == nodes.end() ? npos : it->second;
+    }
+
+    std::unordered_map<pxr::SdfPath, size_t, pxr::SdfPath::Hash> nodes;
+    // output channels used from each node. A shader is made for each one
+    std::vector<std::set<std::string>> channels;
+    // relationships that each node is at either end of
+    std::vector<std::vector<size_t>> connections;
+    // all nodes, upstream ones first
+    std::vector<size_t> order;
+
+private:
+    void visit(const pxr::HdMaterialNetwork& network, size_t i, std::vector<char>& visited)
+    {
+        if (visited[i]) return; // done, or a cycle
+        visited[i] = 1;
+        for (size_t r : connections[i]) {
+            const pxr::HdMaterialRelationship& rel = network.relationships[r];
+            if (rel.outputId == network.nodes[i].path) {
+                size_t input = find(rel.inputId);
+                if (input != npos) visit(network, input, visited);
+            }
+        }
+        order.push_back(i);
+    }
+};
+
+// Hash of the type and parameters of a node
+size_t
+nodeHash(const pxr::HdMaterialNode& node)
+{
+    size_t hash = node.identifier.Hash();
+    for (const auto& param : node.parameters) {
+        hash = hashCombine(hash, param.first.Hash());
+        hash = hashCombine(hash, param.second.GetHash());
+    }
+    return hash;
+}
+
+bool
+isIorMap(const pxr::HdMaterialRelationship& rel)
+{
+    return rel.outputName.GetString().find("ior") != std::string::npos;
+}
+
+}
+
 namespace hdMoonray {
 
 pxr::HdDirtyBits
@@ -201,16 +317,52 @@ Material::Sync(pxr::HdSceneDelegate *sceneDelegate,
     
     if (*dirtyBits & AllDirty) {
         mResource = sceneDelegate->GetMaterialResource(id);
+        mSceneDelegate = sceneDelegate;
         mMaterialDirty = mDisplacementDirty = mVolumeShaderDirty = true;
-        // update any material that has been created
-        if (mMaterial) getMaterial(renderDelegate, sceneDelegate, mGeom);
-        if (mDisplacement) getDisplacement(renderDelegate, sceneDelegate, mGeom);
-        if (mVolumeShader) getVolumeShader(renderDelegate, sceneDelegate, mGeom);
+        // Terminals that have been created are updated in CommitResources(), in parallel
+        // with other materials. Ones an rprim asks for before then are made by getMaterial()
+        if (mMaterial || mDisplacement || mVolumeShader) renderDelegate.scheduleMaterialUpdate(this);
     }
     *dirtyBits &= ~AllDirty;
     hdmLogSyncEnd(id);
 }
 
+void
+Material::Finalize(pxr::HdRenderParam* renderParam)
+{
+    RenderDelegate& renderDelegate(RenderDelegate::get(renderParam));
+    renderDelegate.cancelMaterialUpdate(this);
+    for (const auto& terminal : mTranslated) {
+        // the objects of the material cannot be deleted : stop them from binding
+        // shared shaders, which may be reused for other nodes once released
+        for (const auto& shader : terminal.second) {
+            if (shader.second.shared) continue;
+            UpdateGuard guard(renderDelegate, shader.second.object);
+            shader.second.object->resetAllToDefault();
+        }
+        release(renderDelegate, terminal.second);
+    }
+    mTranslated.clear();
+    mBindings.clear();
+}
+
+void
+Material::update(RenderDelegate& renderDelegate)
+{
+    // update any terminal that has been created
+    if (mMaterial) getMaterial(renderDelegate, mSceneDelegate, mGeom);
+    if (mDisplacement) getDisplacement(renderDelegate, mSceneDelegate, mGeom);
+    if (mVolumeShader) getVolumeShader(renderDelegate, mSceneDelegate, mGeom);
+}
+
+void
+Material::release(RenderDelegate& renderDelegate, const TranslatedTerminal& terminal)
+{
+    for (const auto& shader : terminal) {
+        if (shader.second.shared) renderDelegate.resourceRegistry().releaseShader(shader.second.object);
+    }
+}
+
 bool Material::isEnabled() const
 {
     return mResource.IsHolding<pxr::HdMaterialNetworkMap>();
@@ -219,57 +371,67 @@ bool Material::isEnabled() const
 // Build the tree of shaders, return the final output
 // Returns null if the terninal does not exist, returns error shader on other errors
 // The geom is for finding coordSys bindings
+//
+// Each shader has a key hashing it and everything upstream of it. Shaders feeding other
+// shaders are shared by key with all other materials, and the terminal shader is named
+// with the USD path. A shader is only set up again if what would be set on it changed,
+// so editing one parameter of a large network updates one shader, or forks it if it
+// was shared
 scene_rdl2::rdl2::SceneObject*
 Material::updateTerminal(pxr::TfToken terminalName,
                          RenderDelegate& renderDelegate,
                          pxr::HdSceneDelegate *sceneDelegate,
                          const pxr::HdRprim* geom)
 {
-    if (not isEnabled()) {
-        return nullptr;
+    const pxr::HdMaterialNetwork* networkPtr = nullptr;
+    if (isEnabled()) {
+        const pxr::HdMaterialNetworkMap& networkmap = mResource.UncheckedGet<pxr::HdMaterialNetworkMap>();
+        auto i = networkmap.map.find(terminalName);
+        if (i != networkmap.map.end()) networkPtr = &i->second;
     }
-
-    const pxr::HdMaterialNetworkMap& networkmap = mResource.UncheckedGet<pxr::HdMaterialNetworkMap>();
-    auto i = networkmap.map.find(terminalName);
-    if (i == networkmap.map.end()) {
+    if (not networkPtr) {
+        auto translated = mTranslated.find(terminalName);
+        if (translated != mTranslated.end()) {
+            release(renderDelegate, translated->second);
+            mTranslated.erase(translated);
+        }
         return nullptr;
     }
 
-    // dumpMaterialNetworkMap(networkmap);
-
-    const pxr::HdMaterialNetwork& network = i->second;
-
-    // Get a mapping of nodes to their output channels.
-    // When creating the nodes below, create one node
-    // per channel.   The map only stores nodes with output
-    // connections so won't contain the material at the end
-    // which has no output connections.
-    std::unordered_map< std::string, std::set<std::string> > nodeChannelMap;
-    for (const pxr::HdMaterialRelationship& rel : network.relationships) {
-        const std::string inputChannel = rel.inputName.GetString();
-
-        // Find the input node
-        for (const pxr::HdMaterialNode& node : network.nodes) {
-            if (node.path == rel.inputId) {
-                // Search for node.path string in map
-                auto it = nodeChannelMap.find(node.path.GetString());
-                if (it == nodeChannelMap.end()) {
-                    // Not found. Create channel set with input name as channel
-                    std::set<std::string> channelSet = { inputChannel };
-                    std::pair<std::string, std::set<std::string>> entry = { node.path.GetString(), channelSet };
-                    nodeChannelMap.insert(entry);
-                } else {
-                    // Found.  Insert channel name into channelSet
-                    it->second.insert(inputChannel);
-                }
-            }
-        }
+    // dumpMaterialNetworkMap(mResource.UncheckedGet<pxr::HdMaterialNetworkMap>());
+
+    const pxr::HdMaterialNetwork& network = *networkPtr;
+    const NetworkIndex index(network);
+    const bool decodeNormals = renderDelegate.getDecodeNormals();
+    ResourceRegistry& registry = renderDelegate.resourceRegistry();
+
+    // shaders translated in an earlier session, if cached. Only the first translation
+    // is loaded or stored, so edits do not serialize the network or write fragments
+    MaterialCache& cache = renderDelegate.materialCache();
+    std::string cacheKey;
+    bool cached = false;
+    if (cache.enabled() && not mTranslated.count(terminalName)) {
+        cacheKey = cache.networkKey(network, terminalName, decodeNormals);
+        cached = cache.load(cacheKey);
     }
+    // the cache is not used for nodes with coordSys bindings, which depend on the geom
+    bool cacheable = true;
+
+    // shaders from the last update that have not been carried over yet
+    TranslatedTerminal& previous = mTranslated[terminalName];
+    TranslatedTerminal current;
+    std::vector<scene_rdl2::rdl2::SceneObject*> nodeShaders(network.nodes.size(), nullptr);
+    bool bindingFailed = false;
+    // objects in cached shaders are the shaders of the same name
+    auto fromCache = [&](const SceneObject* object) -> SceneObject* {
+        auto it = current.find(MaterialCache::shaderName(cacheKey, object));
+        return it == current.end() ? nullptr : it->second.object;
+    };
+
+    for (size_t n : index.order) {
+        const pxr::HdMaterialNode& node = network.nodes[n];
+        const std::string& className = node.identifier.GetString();
 
-    // Create the nodes
-    scene_rdl2::rdl2::SceneObject* last = nullptr;
-    for (const pxr::HdMaterialNode& node : network.nodes) {
-        scene_rdl2::rdl2::SceneObject* next = nullptr;
         // Don't create UsdUVTexture nodes if their file name parameter is empty
         if (node.identifier == "UsdUVTexture") {
             auto valIt = node.parameters.find(pxr::TfToken("file"));
@@ -280,156 +442,203 @@ Material::updateTerminal(pxr::TfToken terminalName,
             }
         }
 
-        // Create a node for each channel entry
-        auto it = nodeChannelMap.find(node.path.GetString());
-        if (it != nodeChannelMap.end()) {
-            std::set<std::string>& channelSet = it->second;
-            for (const std::string& channel : channelSet) {
-
-                const std::string nodeName =
-                    getNodeWithChannelName(node.path.GetString(),
-                                           channel);
-
-                next = makeMoonrayShader(renderDelegate,
-                                         sceneDelegate,
-                                         node,
-                                         nodeName,
-                                         geom);
+        // the coordSys bindings depend on the geom, so they are part of the key. They
+        // are only looked up again if the node or the geom changed
+        size_t hash = nodeHash(node);
+        bool hasCoordSys = false;
+        if (geom) {
+            NodeBindings& bindings = mBindings[node.path];
+            if (bindings.nodeHash != hash || bindings.geomId != geom->GetId()) {
+                bindings = NodeBindings{hash, geom->GetId(), 0, false};
+                if (const SceneClass* sceneClass = renderDelegate.getSceneClass(className)) {
+                    const AttributePlan& plan = renderDelegate.attributePlan(*sceneClass);
+                    for (const AttributePlan::Entry& entry : plan.entries()) {
+                        if (entry.attribute->getType() != scene_rdl2::rdl2::TYPE_SCENE_OBJECT) continue;
+                        SceneObject* binding = getCoordSysBinding(
+                            renderDelegate, sceneDelegate, node, entry.name, geom);
+                        bindings.hash = hashCombine(bindings.hash, size_t(binding));
+                        if (binding) bindings.hasCoordSys = true;
+                    }
+                }
             }
-        } else {
-            // If the node isn't in the nodeChannelMap (i.e. materials)
-            // then only one node is created using the USD path as the name.
-            next = makeMoonrayShader(renderDelegate,
-                                     sceneDelegate,
-                                     node,
-                                     node.path.GetString(),
-                                     geom);
+            hash = hashCombine(hash, bindings.hash);
+            hasCoordSys = bindings.hasCoordSys;
         }
-
-        if (next) last = next; // HDM-368 : don't give up on error
-    }
-
-    // set bindings (fixme: only works for Moonray shaders)
-    for (const pxr::HdMaterialRelationship& rel : network.relationships) {
-        // Input connection
-        SceneObject* input;
-
-        bool foundNodeWithChannel = false;
-        for (const pxr::HdMaterialNode& node : network.nodes) {
-            if (node.path == rel.inputId) {
-
-                const std::string nodeWithChannel =
-                    getNodeWithChannelName(rel.inputId.GetString(),
-                                           rel.inputName.GetString());
-
-                input = renderDelegate.getSceneObject(nodeWithChannel);
-
-                if (input) {
-                    foundNodeWithChannel = true;
+        if (hasCoordSys) cacheable = false;
+
+        // Create a shader for each output channel. If the node has
+        // no output channels (i.e. materials) then only one shader is
+        // created using the USD path as the name
+        std::vector<std::string> channels(index.channels[n].begin(), index.channels[n].end());
+        const bool hasChannels = not channels.empty();
+        const bool shareable = hasChannels && renderDelegate.getShareShaders();
+        if (not hasChannels) channels.emplace_back();
+        for (const std::string& channel : channels) {
+            const std::string name = hasChannels ?
+                getNodeWithChannelName(node.path.GetString(), channel) : node.path.GetString();
+
+            // find the inputs, made earlier. The key includes their keys, while what is
+            // set on the shader only depends on the input objects, which do not change
+            // when an unshared input is updated in place
+            std::vector<std::pair<const pxr::HdMaterialRelationship*, SceneObject*>> inputs;
+            size_t key = hashCombine(hash, std::hash<std::string>()(channel));
+            size_t setup = key;
+            bool decodeNormal = false;
+            for (size_t r : index.connections[n]) {
+                const pxr::HdMaterialRelationship& rel = network.relationships[r];
+                // Skip IOR maps
+                if (isIorMap(rel)) continue;
+                if (rel.inputId == node.path) {
+                    // Decode normal maps
+                    if (rel.inputName.GetString() == channel && decodeNormals &&
+                        rel.outputName.GetString().find("normal") != std::string::npos) {
+                        decodeNormal = true;
+                    }
+                    continue;
+                }
+                SceneObject* input = nullptr;
+                size_t inputKey = 0;
+                auto found = current.find(getNodeWithChannelName(rel.inputId.GetString(),
+                                                                 rel.inputName.GetString()));
+                if (found != current.end()) {
+                    input = found->second.object;
+                    inputKey = found->second.key;
+                } else if (index.find(rel.inputId) == NetworkIndex::npos) {
+                    // not a node in this network
+                    input = renderDelegate.getSceneObject(rel.inputId);
+                    inputKey = size_t(input);
                 }
+                if (not input) continue;
+                inputs.emplace_back(&rel, input);
+                key = hashCombine(hashCombine(key, rel.outputName.Hash()), inputKey);
+                setup = hashCombine(hashCombine(setup, rel.outputName.Hash()), size_t(input));
+            }
+            if (node.identifier == "UsdUVTexture") {
+                key = hashCombine(key, decodeNormal);
+                setup = hashCombine(setup, decodeNormal);
             }
-        }
-
-        // If we didn't find the node with the channel name
-        // extension then it must be a node with no outputs
-        // (i.e. material) so just use the node name without
-        // a channel extension to get it from the render delegate.
-        if (!foundNodeWithChannel) {
-            input = renderDelegate.getSceneObject(rel.inputId);
-        }
-
-        if (!input) {
-            continue;
-        }
-
-        // Special handling for specific nodes
-
-        // Skip IOR maps
-        if (rel.outputName.GetString().find("ior") != std::string::npos) {
-            continue;
-        }
-
-        // UsdUVTexture map special handling
-        if (std::string::npos && input->getSceneClass().getName() == "UsdUVTexture") {
-            try {
-                UpdateGuard guard(input);
-
-                // Decode normal maps
-                if (renderDelegate.getDecodeNormals() &&
-                    rel.outputName.GetString().find("normal") != std::string::npos) {
 
-                    input->set(input->getSceneClass().getAttributeKey<Rgb>("scale"), Rgb(2.0f));
-                    input->set(input->getSceneClass().getAttributeKey<Rgb>("bias"), Rgb(-1.0f));
-                    input->set(input->getSceneClass().getAttributeKey<Int>("sourceColorSpace"), 0);
+            // get the shader, and find out if it has to be set up
+            const TranslatedShader* old = nullptr;
+            auto oldIt = previous.find(name);
+            if (oldIt != previous.end()) old = &oldIt->second;
+            SceneObject* shader = nullptr;
+            bool needSetup;
+            // a new shared shader must be reported as ready or failed
+            bool isNew = false;
+            if (shareable) {
+                if (old && old->shared && old->key == key) {
+                    shader = old->object;
+                } else {
+                    shader = registry.acquireShader(className, key,
+                                                    old && old->shared ? old->object : nullptr, isNew);
                 }
-
-                // Channel binding
-                const std::string channel = rel.inputName.GetString();
-                const auto outputModeKey = input->getSceneClass().getAttributeKey<Int>("output_mode");
-                int enumValue = input->getSceneClass().getEnumValue(outputModeKey, channel);
-                input->set(outputModeKey, enumValue);
-            } catch (const std::exception& e) {
-                Logger::error(rel.outputId, ": ", e.what());
-                last = nullptr;
+                needSetup = (old && shader == old->object) ? old->setup != setup : isNew;
+            } else {
+                if (old && old->shared) registry.releaseShader(old->object);
+                needSetup = not old || old->shared || old->setup != setup;
+                shader = needSetup ? renderDelegate.createSceneObject(className, name) : old->object;
             }
-        }
-
-        // Output
-        SceneObject* output;
-        // Check if output is in nodeChannelMap
-        auto it = nodeChannelMap.find(rel.outputId.GetString());
-        if (it != nodeChannelMap.end()) {
-            // Create a binding for each channel's node
-            for (const std::string& channel : it->second) {
-                const std::string outputNodeName =
-                    getNodeWithChannelName(rel.outputId.GetString(),
-                                           channel);
-
-                output = renderDelegate.getSceneObject(outputNodeName);
-                if (!output) {
-                    continue;
+            // the old shader is released or carried over
+            if (old) previous.erase(oldIt);
+            if (not shader) continue; // already printed an error
+
+            const SceneObject* cachedShader = (needSetup && cached && not hasCoordSys) ?
+                cache.find(cacheKey, name) : nullptr;
+            if (cachedShader && cachedShader->getSceneClass().getName() != shader->getSceneClass().getName()) {
+                cachedShader = nullptr;
+            }
+            if (cachedShader) {
+                UpdateGuard guard(shader);
+                if (not MaterialCache::copyShader(shader, *cachedShader, fromCache)) {
+                    cachedShader = nullptr;
                 }
+            }
 
-                try {
-                    UpdateGuard guard(output);
+            if (needSetup && not cachedShader) {
+                if (not setupMoonrayShader(renderDelegate, sceneDelegate, node, shader, geom)) {
+                    setup = 0;
+                }
 
-                    const scene_rdl2::rdl2::Attribute* attribute(
-                        output->getSceneClass().getAttribute(rel.outputName.GetString()));
+                // set bindings (fixme: only works for Moonray shaders)
+                for (const auto& input : inputs) {
+                    const pxr::HdMaterialRelationship& rel = *input.first;
+                    try {
+                        UpdateGuard guard(shader);
+
+                        const scene_rdl2::rdl2::Attribute* attribute(
+                            shader->getSceneClass().getAttribute(rel.outputName.GetString()));
+
+                        if (attribute->getType() == scene_rdl2::rdl2::TYPE_SCENE_OBJECT) {
+                            shader->set(AttributeKey<SceneObject*>(*attribute), input.second);
+                        } else {
+                            ValueConverter::setBinding(shader, attribute, input.second);
+                        }
+                    } catch (const std::exception& e) {
+                        Logger::error(rel.outputId, ": ", e.what());
+                        bindingFailed = true;
+                        setup = 0;
+                    }
+                }
 
-                    if (attribute->getType() == scene_rdl2::rdl2::TYPE_SCENE_OBJECT) {
-                        output->set(AttributeKey<SceneObject*>(*attribute), input);
-                    } else {
-                        ValueConverter::setBinding(output, attribute, input);
+                // UsdUVTexture map special handling
+                if (hasChannels && shader->getSceneClass().getName() == "UsdUVTexture") {
+                    try {
+                        UpdateGuard guard(shader);
+
+                        if (decodeNormal) {
+                            shader->set(shader->getSceneClass().getAttributeKey<Rgb>("scale"), Rgb(2.0f));
+                            shader->set(shader->getSceneClass().getAttributeKey<Rgb>("bias"), Rgb(-1.0f));
+                            shader->set(shader->getSceneClass().getAttributeKey<Int>("sourceColorSpace"), 0);
+                        }
+
+                        // Channel binding
+                        const auto outputModeKey = shader->getSceneClass().getAttributeKey<Int>("output_mode");
+                        int enumValue = shader->getSceneClass().getEnumValue(outputModeKey, channel);
+                        shader->set(outputModeKey, enumValue);
+                    } catch (const std::exception& e) {
+                        Logger::error(node.path, ": ", e.what());
+                        bindingFailed = true;
+                        setup = 0;
                     }
-                } catch (const std::exception& e) {
-                    Logger::error(rel.outputId, ": ", e.what());
-                    last = nullptr;
                 }
             }
-        } else {
-            output = renderDelegate.getSceneObject(rel.outputId);
-            if (!output) {
-                continue;
-            }
 
-            try {
-                UpdateGuard guard(output);
+            if (needSetup) addTextures(renderDelegate, shader);
+            if (isNew) registry.setShaderReady(shader, setup != 0);
+
+            current[name] = TranslatedShader{key, setup, shader, shareable};
+            nodeShaders[n] = shader;
+        }
+    }
 
-                const scene_rdl2::rdl2::Attribute* attribute(
-                    output->getSceneClass().getAttribute(rel.outputName.GetString()));
+    // the loaded fragment has been copied
+    if (cached) cache.release();
 
-                if (attribute->getType() == scene_rdl2::rdl2::TYPE_SCENE_OBJECT) {
-                    output->set(AttributeKey<SceneObject*>(*attribute), input);
-                } else {
-                    ValueConverter::setBinding(output, attribute, input);
-                }
-            } catch (const std::exception& e) {
-                Logger::error(rel.outputId, ": ", e.what());
-                last = nullptr;
+    // save the translation for the next session
+    if (not cacheKey.empty() && not cached && cacheable && not bindingFailed) {
+        std::unordered_map<std::string, SceneObject*> shaders;
+        for (const auto& shader : current) {
+            if (shader.second.setup == 0) {
+                shaders.clear();
+                break;
             }
+            shaders.emplace(shader.first, shader.second.object);
         }
+        if (not shaders.empty()) cache.store(cacheKey, shaders);
     }
 
+    // shaders of nodes that are gone
+    release(renderDelegate, previous);
+    previous = std::move(current);
+
+    // the last node is normally the terminal. HDM-368 : don't give up on error
+    scene_rdl2::rdl2::SceneObject* last = nullptr;
+    for (SceneObject* shader : nodeShaders) {
+        if (shader) last = shader;
+    }
+    if (bindingFailed) last = nullptr;
+
     if (not last && terminalName == pxr::HdMaterialTerminalTokens->surface) last = renderDelegate.errorMaterial();
     return last;
 }
@@ -442,11 +651,13 @@ Material::getMaterial(
 {
     if (mMaterialDirty || renderDelegate.getDecodeNormalsChanged()) {
         std::lock_guard<std::mutex> lock(mCreateMutex);
-        mGeom = geom;
-        scene_rdl2::rdl2::SceneObject* s = updateTerminal(
-            pxr::HdMaterialTerminalTokens->surface, renderDelegate, sceneDelegate, geom);
-        mMaterial = s ? s->asA<scene_rdl2::rdl2::Material>() : nullptr;
-        mMaterialDirty = false;
+        if (mMaterialDirty || renderDelegate.getDecodeNormalsChanged()) {
+            mGeom = geom;
+            scene_rdl2::rdl2::SceneObject* s = updateTerminal(
+                pxr::HdMaterialTerminalTokens->surface, renderDelegate, sceneDelegate, geom);
+            mMaterial = s ? s->asA<scene_rdl2::rdl2::Material>() : nullptr;
+            mMaterialDirty = false;
+        }
     }
     return mMaterial;
 }
@@ -7,6 +7,11 @@
 #include <pxr/imaging/hd/material.h>
 #include <pxr/imaging/hd/rprim.h>
 
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
 namespace scene_rdl2 { namespace rdl2 {
 class SceneObject;
 class Material;
@@ -39,6 +44,13 @@ public:
     void Reload() override {}
 #endif
 
+    /// Release the shaders shared with other materials
+    void Finalize(pxr::HdRenderParam* renderParam) override;
+
+    // Update the terminals that have been created after Sync() changed the network.
+    // Called by RenderDelegate::CommitResources(), for several materials at once
+    void update(RenderDelegate&);
+
     // True if usdview has enabled scene material
     bool isEnabled() const;
 
@@ -54,13 +66,39 @@ public:
 
 private:
     scene_rdl2::rdl2::SceneObject* updateTerminal(pxr::TfToken terminal, RenderDelegate&, pxr::HdSceneDelegate*, const pxr::HdRprim*);
+
+    // A shader made for a terminal (one per node and output channel), so that an update
+    // only remakes the shaders that changed. Shaders with output channels are shared
+    // with other materials through the ResourceRegistry
+    struct TranslatedShader {
+        size_t key;   // hash of the shader and everything upstream of it
+        size_t setup; // hash of what was set on the object, 0 if it must be set again
+        scene_rdl2::rdl2::SceneObject* object;
+        bool shared;
+    };
+    // by node path plus channel
+    using TranslatedTerminal = std::unordered_map<std::string, TranslatedShader>;
+    std::map<pxr::TfToken, TranslatedTerminal> mTranslated;
+    static void release(RenderDelegate&, const TranslatedTerminal&);
+
+    // coordSys bindings found for a node, by node path
+    struct NodeBindings {
+        size_t nodeHash; // of the node they were found for
+        pxr::SdfPath geomId; // of the geom they were found for
+        size_t hash;
+        bool hasCoordSys;
+    };
+    std::unordered_map<pxr::SdfPath, NodeBindings, pxr::SdfPath::Hash> mBindings;
+
     pxr::VtValue mResource;
-    bool mMaterialDirty;
-    bool mDisplacementDirty;
-    bool mVolumeShaderDirty;
-    scene_rdl2::rdl2::Material* mMaterial = nullptr;
-    scene_rdl2::rdl2::Displacement* mDisplacement = nullptr;
-    scene_rdl2::rdl2::VolumeShader* mVolumeShader = nullptr;
+    pxr::HdSceneDelegate* mSceneDelegate = nullptr;
+    // set by Sync(), checked without the lock by rprims syncing in parallel
+    std::atomic<bool> mMaterialDirty{true};
+    std::atomic<bool> mDisplacementDirty{true};
+    std::atomic<bool> mVolumeShaderDirty{true};
+    std::atomic<scene_rdl2::rdl2::Material*> mMaterial{nullptr};
+    std::atomic<scene_rdl2::rdl2::Displacement*> mDisplacement{nullptr};
+    std::atomic<scene_rdl2::rdl2::VolumeShader*> mVolumeShader{nullptr};
     const pxr::HdRprim* mGeom = nullptr;
     std::mutex mCreateMutex;
 };
@@ -77,6 +115,15 @@ getCoordSysBinding(
     const pxr::HdMaterialNode& , pxr::TfToken ,
     const pxr::HdRprim*
 );
+// Set every attribute of an existing shader from the node. Returns false on error
+bool
+setupMoonrayShader(
+    hdMoonray::RenderDelegate& ,
+    pxr::HdSceneDelegate*,
+    const pxr::HdMaterialNode&,
+    scene_rdl2::rdl2::SceneObject*,
+    const pxr::HdRprim*
+);
 scene_rdl2::rdl2::SceneObject*
 makeMoonrayShader(
     hdMoonray::RenderDelegate& ,
@@ -0,0 +1,330 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "MaterialCache.h"
+#include "MurmurHash3.h"
+#include "RenderDelegate.h"
+#include "ValueConverter.h"
+
+#include <pxr/base/tf/fileUtils.h>
+#include <pxr/usd/sdf/assetPath.h>
+
+#include <scene_rdl2/render/logging/logging.h>
+#include <scene_rdl2/scene/rdl2/BinaryReader.h>
+#include <scene_rdl2/scene/rdl2/BinaryWriter.h>
+#include <scene_rdl2/scene/rdl2/SceneContext.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+
+#include <sys/stat.h>
+
+using scene_rdl2::logging::Logger;
+
+namespace {
+
+// change this if the translation changes, to ignore old fragments
+const char* const cacheVersion = "hdMoonray material cache 1";
+
+}
+
+namespace hdMoonray {
+
+MaterialCache::MaterialCache(RenderDelegate& renderDelegate): mRenderDelegate(renderDelegate) {}
+
+MaterialCache::~MaterialCache()
+{
+    // compare with the render start time to see what the cache saved
+    if (mLoadCount || mStoreCount) {
+        Logger::info("Material Cache: ", mLoadCount, " fragments loaded, ", mStoreCount, " stored");
+    }
+}
+
+void
+MaterialCache::setDirectory(const std::string& directory)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (directory == mDirectory) return;
+    mDirectory = directory;
+    mMissing.clear();
+    if (not mDirectory.empty() && not pxr::TfIsDir(mDirectory) &&
+        not pxr::TfMakeDirs(mDirectory, -1, true)) {
+        Logger::warn("Material Cache: cannot create ", mDirectory);
+        mDirectory.clear();
+    }
+}
+
+std::string
+MaterialCache::dsoVersion(const std::string& className)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto found = mDsoVersions.find(className);
+    if (found != mDsoVersions.end()) return found->second;
+
+    // the first one in the path is the one that is loaded
+    std::string version;
+    std::istringstream dsoPath(mRenderDelegate.sceneContext().getDsoPath());
+    std::string directory;
+    while (std::getline(dsoPath, directory, ':')) {
+        if (directory.empty()) continue;
+        const std::string filename = directory + "/" + className + ".so";
+        struct stat info;
+        if (stat(filename.c_str(), &info) == 0) {
+            version = filename + ' ' + std::to_string(info.st_size) + ' ' + std::to_string(info.st_mtime);
+            break;
+        }
+    }
+    mDsoVersions.emplace(className, version);
+    return version;
+}
+
+std::string
+MaterialCache::networkKey(const pxr::HdMaterialNetwork& network,
+                          const pxr::TfToken& terminal,
+                          bool decodeNormals)
+{
+    // a text description of the network : token hashes differ between sessions. A
+    // rebuilt shader DSO may have different attributes or defaults
+    std::ostringstream text;
+    text << cacheVersion << '\n' << mRenderDelegate.sceneContext().getDsoPath() << '\n'
+         << terminal << ' ' << decodeNormals << '\n';
+    for (const pxr::HdMaterialNode& node : network.nodes) {
+        text << node.path << ' ' << node.identifier << ' ' << dsoVersion(node.identifier) << '\n';
+        for (const auto& param : node.parameters) {
+            text << ' ' << param.first << '=';
+            if (param.second.IsHolding<pxr::SdfAssetPath>()) {
+                text << param.second.UncheckedGet<pxr::SdfAssetPath>().GetResolvedPath();
+            } else {
+                text << param.second;
+            }
+            text << '\n';
+        }
+    }
+    for (const pxr::HdMaterialRelationship& rel : network.relationships) {
+        text << rel.inputId << '.' << rel.inputName << ' '
+             << rel.outputId << '.' << rel.outputName << '\n';
+    }
+
+    // 128 bit hash
+    const std::string s = text.str();
+    std::ostringstream key;
+    key << std::hex << std::setfill('0');
+    for (uint32_t seed = 0; seed < 4; ++seed) {
+        uint32_t h;
+        MurmurHash3_x86_32(s.data(), int(s.size()), seed, &h);
+        key << std::setw(8) << h;
+    }
+    return key.str();
+}
+
+std::string
+MaterialCache::path(const std::string& key) const
+{
+    return mDirectory + "/" + key + ".rdlb";
+}
+
+scene_rdl2::rdl2::SceneContext&
+MaterialCache::context()
+{
+    if (not mContext) {
+        mContext.reset(new scene_rdl2::rdl2::SceneContext);
+        mContext->setDsoPath(mRenderDelegate.sceneContext().getDsoPath());
+    }
+    return *mContext;
+}
+
+void
+MaterialCache::releaseContext()
+{
+    if (mInUse) return;
+    mContext.reset();
+    mInContext.clear();
+}
+
+bool
+MaterialCache::load(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mInContext.count(key)) {
+        ++mInUse;
+        return true;
+    }
+    if (mDirectory.empty() || mMissing.count(key)) return false;
+
+    // file is the manifest size, manifest and payload written by store()
+    std::ifstream in(path(key), std::ios::binary);
+    if (not in) {
+        mMissing.insert(key);
+        return false;
+    }
+    try {
+        uint64_t manifestSize = 0;
+        in.read(reinterpret_cast<char*>(&manifestSize), sizeof(manifestSize));
+        std::string manifest(manifestSize, '\0');
+        in.read(&manifest[0], manifestSize);
+        if (not in) throw std::runtime_error("truncated file");
+        std::string payload((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        scene_rdl2::rdl2::BinaryReader reader(context());
+        reader.fromBytes(manifest, payload);
+        context().commitAllChanges();
+    } catch (const std::exception& e) {
+        Logger::warn(path(key), ": ", e.what());
+        mMissing.insert(key);
+        releaseContext();
+        return false;
+    }
+    mInContext.insert(key);
+    ++mInUse;
+    // a fragment may be read again once the context is dropped
+    if (mLoaded.insert(key).second) ++mLoadCount;
+    return true;
+}
+
+void
+MaterialCache::release()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mInUse) --mInUse;
+    releaseContext();
+}
+
+const scene_rdl2::rdl2::SceneObject*
+MaterialCache::find(const std::string& key, const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (not mContext) return nullptr;
+    try {
+        return mContext->getSceneObject(key + "/" + name);
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+}
+
+std::string
+MaterialCache::shaderName(const std::string& key, const scene_rdl2::rdl2::SceneObject* object)
+{
+    const std::string& name = object->getName();
+    if (name.size() <= key.size() + 1 || name.compare(0, key.size(), key) || name[key.size()] != '/') {
+        return std::string();
+    }
+    return name.substr(key.size() + 1);
+}
+
+void
+MaterialCache::store(const std::string& key,
+                     const std::unordered_map<std::string, scene_rdl2::rdl2::SceneObject*>& shaders)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mDirectory.empty() || mLoaded.count(key)) return;
+
+    // copy the shaders into the cache's context, where they are named by key
+    std::string manifest, payload;
+    try {
+        scene_rdl2::rdl2::SceneContext& ctx = context();
+        std::unordered_map<const scene_rdl2::rdl2::SceneObject*, scene_rdl2::rdl2::SceneObject*> copies;
+        for (const auto& shader : shaders) {
+            copies[shader.second] = ctx.createSceneObject(shader.second->getSceneClass().getName(),
+                                                          key + "/" + shader.first);
+        }
+        auto map = [&](const scene_rdl2::rdl2::SceneObject* object) -> scene_rdl2::rdl2::SceneObject* {
+            auto it = copies.find(object);
+            return it == copies.end() ? nullptr : it->second;
+        };
+        bool complete = true;
+        for (const auto& copy : copies) {
+            scene_rdl2::rdl2::SceneObject::UpdateGuard guard(copy.second);
+            if (not copyShader(copy.second, *copy.first, map)) {
+                complete = false;
+                break;
+            }
+        }
+        if (complete) {
+            // only the objects created above have changed
+            scene_rdl2::rdl2::BinaryWriter writer(ctx);
+            writer.setDeltaEncoding(true);
+            writer.toBytes(manifest, payload);
+        }
+        ctx.commitAllChanges();
+    } catch (const std::exception& e) {
+        Logger::warn("Material Cache: ", e.what());
+        manifest.clear();
+    }
+    // the copies are not needed once written
+    releaseContext();
+    if (manifest.empty()) return;
+
+    // write to a temporary file and rename it, so that readers never see part of a file
+    const std::string filename = path(key);
+    const std::string tmp = filename + ".tmp" + std::to_string(reinterpret_cast<uintptr_t>(this));
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        const uint64_t manifestSize = manifest.size();
+        out.write(reinterpret_cast<const char*>(&manifestSize), sizeof(manifestSize));
+        out << manifest << payload;
+        if (not out) {
+            Logger::warn(tmp, ": write failed");
+            std::remove(tmp.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmp.c_str(), filename.c_str())) {
+        std::remove(tmp.c_str());
+        return;
+    }
+    mLoaded.insert(key);
+    mMissing.erase(key);
+    ++mStoreCount;
+}
+
+bool
+MaterialCache::copyShader(scene_rdl2::rdl2::SceneObject* dst,
+                          const scene_rdl2::rdl2::SceneObject& src,
+                          const ObjectMap& map)
+{
+    using namespace scene_rdl2::rdl2;
+    auto mapObject = [&](const SceneObject* object, SceneObject*& result) {
+        result = object ? map(object) : nullptr;
+        return result || not object;
+    };
+
+    const SceneClass& sceneClass = dst->getSceneClass();
+    for (auto it = sceneClass.beginAttributes(); it != sceneClass.endAttributes(); ++it) {
+        const Attribute* attribute = *it;
+        switch (attribute->getType()) {
+        case TYPE_SCENE_OBJECT: {
+            const AttributeKey<SceneObject*> key(*attribute);
+            SceneObject* value;
+            if (not mapObject(src.get(key), value)) return false;
+            if (dst->get(key) != value) dst->set(key, value);
+            break;
+        }
+        case TYPE_SCENE_OBJECT_VECTOR: {
+            const AttributeKey<SceneObjectVector> key(*attribute);
+            SceneObjectVector values;
+            for (const SceneObject* object : src.get(key)) {
+                values.emplace_back();
+                if (not mapObject(object, values.back())) return false;
+            }
+            if (dst->get(key) != values) dst->set(key, values);
+            break;
+        }
+        case TYPE_SCENE_OBJECT_INDEXABLE:
+            return false;
+        default:
+            ValueConverter::copyAttribute(dst, src, attribute);
+            break;
+        }
+        if (attribute->isBindable()) {
+            SceneObject* binding;
+            if (not mapObject(src.getBinding(*attribute), binding)) return false;
+            if (dst->getBinding(*attribute) != binding) dst->setBinding(*attribute, binding);
+        }
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,110 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <tbb/tbb_machine.h> // fix for icc-19/tbb bug
+#include <pxr/imaging/hd/material.h>
+#include <pxr/base/tf/token.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+namespace scene_rdl2 { namespace rdl2 {
+class SceneContext;
+class SceneObject;
+}}
+
+namespace hdMoonray {
+
+class RenderDelegate;
+
+// Optional on-disk cache of material translations
+//
+// When the "Material Cache" render setting names a directory, the shaders made for each
+// material terminal are written there as an rdlb fragment, in a file named with a hash of
+// the network's content. A later session translating the same network loads the fragment
+// and copies the RDL values from it, instead of converting every parameter of every node.
+// Only the first translation of each material is loaded or stored : edits made during a
+// session are translated as usual.
+//
+// Fragments are read and written through a private SceneContext, holding the objects
+// of each fragment with the network hash as a prefix of their names. RDL objects cannot
+// be deleted, so the context is dropped whenever no loaded fragment is in use. Networks
+// whose shaders refer to objects outside the network (coordSys bindings) are not cached.
+
+class MaterialCache
+{
+public:
+    explicit MaterialCache(RenderDelegate& renderDelegate);
+    ~MaterialCache();
+
+    // empty disables the cache
+    void setDirectory(const std::string& directory);
+    bool enabled() const { return not mDirectory.empty(); }
+
+    // Hash of everything that the translation of a network depends on, including the
+    // shader DSOs of its nodes, the same in every session
+    std::string networkKey(const pxr::HdMaterialNetwork& network,
+                           const pxr::TfToken& terminal,
+                           bool decodeNormals);
+
+    // Loads the fragment for key if there is one. Returns false if it is not cached.
+    // If it returns true, call release() once the shaders are copied
+    bool load(const std::string& key);
+    void release();
+
+    // Returns the cached shader for a shader name (node path plus channel) from a
+    // loaded fragment, or null. Valid until release()
+    const scene_rdl2::rdl2::SceneObject* find(const std::string& key, const std::string& name);
+
+    // Returns the shader name of an object from a fragment, or empty
+    static std::string shaderName(const std::string& key, const scene_rdl2::rdl2::SceneObject* object);
+
+    // Writes the fragment for key, made of shaders by name. Does nothing if the shaders
+    // refer to other objects
+    void store(const std::string& key,
+               const std::unordered_map<std::string, scene_rdl2::rdl2::SceneObject*>& shaders);
+
+    // number of different fragments loaded and stored by this session
+    size_t loadCount() const { return mLoadCount; }
+    size_t storeCount() const { return mStoreCount; }
+
+    // Copy all values and bindings from src to dst, which are of the same class.
+    // Object values and bindings are passed through map. Returns false if map returned
+    // null for an object
+    using ObjectMap = std::function<scene_rdl2::rdl2::SceneObject*(const scene_rdl2::rdl2::SceneObject*)>;
+    static bool copyShader(scene_rdl2::rdl2::SceneObject* dst,
+                           const scene_rdl2::rdl2::SceneObject& src,
+                           const ObjectMap& map);
+
+private:
+    std::string path(const std::string& key) const;
+    // path, size and time of the DSO defining className, or empty if there is none
+    std::string dsoVersion(const std::string& className);
+    scene_rdl2::rdl2::SceneContext& context();
+    // drops the context if no fragment is in use
+    void releaseContext();
+
+    RenderDelegate& mRenderDelegate;
+    std::string mDirectory;
+    // the SceneContext is not thread safe
+    std::mutex mMutex;
+    std::unique_ptr<scene_rdl2::rdl2::SceneContext> mContext;
+    // fragments in mContext, and the number of load() calls not released yet
+    std::set<std::string> mInContext;
+    size_t mInUse = 0;
+    // fragments already loaded or written, and ones known to be missing
+    std::set<std::string> mLoaded;
+    std::set<std::string> mMissing;
+    // dsoVersion() by class name
+    std::unordered_map<std::string, std::string> mDsoVersions;
+    size_t mLoadCount = 0;
+    size_t mStoreCount = 0;
+};
+
+}
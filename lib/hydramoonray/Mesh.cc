@@ -5,7 +5,8 @@
 // RDL attributes that don't have an equivalent in Mesh are set to
 // an automatic default, but may be overridden by primvars of the form
 // "moonray:xyz":
-//  - mesh_resolution def: 1 << refineLevel
+//  - mesh_resolution def: 1 << refineLevel, or a lower power of two chosen from the
+//    mesh's size in the render camera if the "Adaptive Tessellation" setting is on
 //  - adaptive_error def: 0.0 or 1.0
 //  - smooth_normal def: false
 // Supports "uv" or "st" for texture coords, and 
@@ -23,6 +24,7 @@
 #include <scene_rdl2/scene/rdl2/Geometry.h>
 #include <scene_rdl2/scene/rdl2/UserData.h>
 
+#include <cmath>
 #include <iostream>
 
 using namespace pxr;
@@ -42,6 +44,7 @@ const std::string rdlAttrPartList("part_list");
 const std::string rdlAttrSmoothNormal("smooth_normal");
 const std::string rdlAttrIsSubd("is_subd");
 const std::string rdlAttrMeshResolution("mesh_resolution");
+const TfToken primvarMeshResolution("moonray:mesh_resolution");
 const std::string rdlAttrAdaptiveError("adaptive_error");
 const std::string rdlAttrSubdScheme("subd_scheme");
 constexpr int rdlSubdSchemeBilinear = 0;
@@ -126,12 +129,17 @@ Mesh::_InitRepr(TfToken const &reprToken, HdDirtyBits *dirtyBits)
 
 
 scene_rdl2::rdl2::Geometry* 
-Mesh::geometryForMeshLight(RenderDelegate& renderDelegate)
+Mesh::geometryForMeshLight(RenderDelegate& renderDelegate, HdChangeTracker& changeTracker)
 {
     // MeshLight(GeometryLight) may require the RDL2 geometry
     // object before the Mesh has synced. Since light syncs
     // are not run in parallel, this does not need to be
     // threadsafe
+    if (not mMeshLight) {
+        mMeshLight = true;
+        // a bounding box proxy was synced in its place : translate the full mesh
+        if (mProxyActive) changeTracker.MarkRprimDirty(rprim.GetId(), HdChangeTracker::AllDirty);
+    }
     if (mGeometry) return mGeometry;
     scene_rdl2::rdl2::SceneObject* object = renderDelegate.createSceneObject(rdlClassMesh, rprim.GetId());
     if (object) mGeometry = object->asA<scene_rdl2::rdl2::Geometry>();
@@ -219,15 +227,12 @@ Mesh::syncSubdivScheme(const HdMeshTopology& topology,
 
     // mesh resolution, adaptive error and smooth_normals can be overridden
     // by primvars, so check before overwriting
-    static TfToken meshResolutionToken("moonray:mesh_resolution");
     static TfToken adaptiveErrorToken("moonray:adaptive_error");
     static TfToken smoothNormalToken("moonray:smooth_normal");
 
-    if (not isPrimvarUsed(meshResolutionToken)) {
-        // to match Storm, use 1 << refineLevel for resolution
-        float rdlResolution = 1 << refineLevel;
-        geometry()->set(rdlAttrMeshResolution, rdlResolution);
-    }
+    mRefineLevel = refineLevel;
+    mFaceCount = topology.GetNumFaces();
+    syncMeshResolution(sceneDelegate, renderDelegate);
 
     if (not isPrimvarUsed(adaptiveErrorToken)) {
         float adaptive_error = topology.IsEnabledAdaptive() ? 1.0f : 0.0f;
@@ -386,6 +391,34 @@ Mesh::syncCryptomatteUserData(RenderDelegate& renderDelegate)
     addUserData(pxr::TfToken("primvars:"+idName),cryptoId);
 }
 
+void
+Mesh::syncMeshResolution(HdSceneDelegate *sceneDelegate,
+                         RenderDelegate& renderDelegate)
+{
+    // to match Storm, use 1 << refineLevel for resolution. With adaptive
+    // tessellation this is the maximum, and the render delegate picks a lower
+    // resolution for meshes that are small on screen. Each level quadruples the
+    // number of faces, and the faces are assumed to be spread evenly
+    if (isPrimvarUsed(primvarMeshResolution)) {
+        unregisterTessellation(renderDelegate);
+    } else if (renderDelegate.getAdaptiveTessellation()) {
+        registerTessellation(sceneDelegate, renderDelegate, mRefineLevel, mFaceCount,
+                             std::sqrt(float(std::max(mFaceCount, size_t(1)))), 2);
+    } else {
+        unregisterTessellation(renderDelegate);
+        setTessellationLevel(geometry(), mRefineLevel);
+    }
+}
+
+void
+Mesh::setTessellationLevel(scene_rdl2::rdl2::Geometry* geometry, int level)
+{
+    const float rdlResolution = float(1 << level);
+    if (geometry->get<float>(rdlAttrMeshResolution) != rdlResolution) {
+        geometry->set(rdlAttrMeshResolution, rdlResolution);
+    }
+}
+
 void
 Mesh::syncAttributes(HdSceneDelegate* sceneDelegate, 
                             RenderDelegate& renderDelegate,
@@ -416,6 +449,11 @@ Mesh::syncAttributes(HdSceneDelegate* sceneDelegate,
             // tags specify interpolation, creases and corners
             syncSubdivTags(sceneDelegate->GetSubdivTags(id));
         }
+    } else if (renderDelegate.getAdaptiveTessellation() &&
+               (HdChangeTracker::IsTransformDirty(*dirtyBits, id) ||
+                HdChangeTracker::IsExtentDirty(*dirtyBits, id))) {
+        // the mesh moved : update its bounds
+        syncMeshResolution(sceneDelegate, renderDelegate);
     }
 
     // base class handles transform and double-sided
@@ -433,6 +471,11 @@ Mesh::Sync(HdSceneDelegate *sceneDelegate,
     
     _UpdateVisibility(sceneDelegate, dirtyBits);
     _UpdateInstancer(sceneDelegate, dirtyBits);
+
+    if (syncAsProxy(sceneDelegate, renderDelegate, dirtyBits)) {
+        hdmLogSyncEnd(GetId());
+        return;
+    }
     
     syncAll(rdlClassMesh, sceneDelegate, renderDelegate, dirtyBits, reprToken);
 
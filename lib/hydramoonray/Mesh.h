@@ -27,8 +27,13 @@ public:
     void Finalize(pxr::HdRenderParam* renderParam) override;
 
     // used to get the geometry associated with a MeshLight
-    // not threadsafe, use with caution
-    scene_rdl2::rdl2::Geometry* geometryForMeshLight(RenderDelegate& renderDelegate);
+    // not threadsafe, use with caution. If the mesh was synced as a proxy it
+    // is marked dirty in changeTracker, so the full mesh is translated
+    scene_rdl2::rdl2::Geometry* geometryForMeshLight(RenderDelegate& renderDelegate,
+                                                     pxr::HdChangeTracker& changeTracker);
+
+    // meshes used by a MeshLight are always translated in full
+    bool supportsProxy() const override { return not mMeshLight; }
 
 protected:
     // Hydra overrides
@@ -45,11 +50,20 @@ private:
     Mesh(const Mesh&)             = delete;
     Mesh &operator =(const Mesh&) = delete;
 
+    // refine level from the display style, and face count, at last syncSubdivScheme
+    int mRefineLevel = 0;
+    size_t mFaceCount = 0;
+    // set by geometryForMeshLight
+    bool mMeshLight = false;
+
     void syncTopology(const pxr::HdMeshTopology& topology);
     void syncSubdivScheme(const pxr::HdMeshTopology& topology,
                         pxr::HdSceneDelegate *sceneDelegate,
                         RenderDelegate& renderDelegate,
                         const pxr::TfToken& reprToken);
+    void syncMeshResolution(pxr::HdSceneDelegate *sceneDelegate,
+                            RenderDelegate& renderDelegate);
+    void setTessellationLevel(scene_rdl2::rdl2::Geometry* geometry, int level) override;
     void syncSubdivTags(const pxr::PxOsdSubdivTags& tags);
     void syncCryptomatteUserData(RenderDelegate& renderDelegate);
 };
@@ -32,6 +32,7 @@ public:
     void applySettings(const RenderSettings&) override {}
 
     void invalidateAllTextureResources() override {}
+    void invalidateTextureResources(const std::vector<std::string>&) override {}
     void restartRenderer() override {}
     
 private:
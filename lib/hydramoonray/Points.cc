@@ -66,13 +66,13 @@ Points::primvarChanged(HdSceneDelegate *sceneDelegate, RenderDelegate& renderDel
     // object attribute "radius_list"
     if (name ==  HdTokens->widths) {
         if (value.IsEmpty()) {
-            geometry()->resetToDefault(rdlAttrRadiusList);
+            resetChunkedAttribute(rdlAttrRadiusList);
         } else if (value.IsHolding<VtFloatArray>()) {
             const VtFloatArray& v = value.UncheckedGet<VtFloatArray>();
                 FloatVector w(v.begin(), v.end());
                 // width is diameter : convert to radius
                 for (float& r : w) r /= 2;
-                geometry()->set(rdlAttrRadiusList, std::move(w));
+                setChunkedAttribute(rdlAttrRadiusList, std::move(w));
         }
     } else {
         // allow GeometryMixin to handle all other cases
@@ -92,6 +92,14 @@ Points::Sync(HdSceneDelegate *sceneDelegate,
 
     _UpdateVisibility(sceneDelegate, dirtyBits);
     _UpdateInstancer(sceneDelegate, dirtyBits);
+
+    if (syncAsProxy(sceneDelegate, renderDelegate, dirtyBits)) {
+        hdmLogSyncEnd(GetId());
+        return;
+    }
+
+    // large point clouds may be split into several geometry objects
+    updateChunkLayout(sceneDelegate, renderDelegate, rdlClassPoints, nullptr, dirtyBits);
     
     syncAll(rdlClassPoints, sceneDelegate, renderDelegate, dirtyBits, reprToken);
     
@@ -24,6 +24,8 @@ public:
 
     void Finalize(pxr::HdRenderParam* renderParam) override;
 
+    bool supportsProxy() const override { return true; }
+
 protected:
 
     // Hydra overrides
@@ -7,6 +7,7 @@
 #include "GeometryMixin.h"
 #include "Instancer.h"
 #include "RenderDelegate.h"
+#include "Gather.h"
 #include "Material.h"
 #include "ValueConverter.h"
 #include <pxr/imaging/hd/extComputationUtils.h>
@@ -14,6 +15,7 @@
 #include <scene_rdl2/scene/rdl2/Layer.h>
 #include <scene_rdl2/scene/rdl2/UserData.h>
 #include <pxr/base/gf/vec2f.h>
+#include <algorithm>
 #include <iostream>
 
 using namespace pxr;
@@ -22,6 +24,8 @@ using scene_rdl2::logging::Logger;
 
 namespace {
 
+    const TfToken motionBlurTypeToken("moonray:motion_blur_type");
+
     // filter primvars by name, to remove excessive "junk" primvars
     // return true if primvar should be ignored
     bool primvarFilter(const TfToken& name)
@@ -38,20 +42,6 @@ namespace {
         if (names.count(name)) return true;
         return false;
     }
-
-    // utility to set a Vec3f attribute
-    inline void setVec3fPrimvar(Geometry* geometry,
-                                const std::string& rdlName,
-                                const VtValue& values)
-    {
-        if (values.IsHolding<VtVec3fArray>()) {
-            const VtVec3fArray& va = values.UncheckedGet<VtVec3fArray>();
-            const Vec3f* p = reinterpret_cast<const Vec3f*>(&va[0]);
-            geometry->set(rdlName, Vec3fVector(p, p + va.size()));
-        } else {
-            Logger::warn(rdlName, " requires a Vec3f array");
-        }
-    }
 }
 
 namespace hdMoonray {
@@ -79,6 +69,27 @@ GeometryMixin::syncPrimvars(HdSceneDelegate *sceneDelegate,
                        TfToken());
     }
     
+    // With velocity motion blur, points are sent as a single sample and moonray
+    // extrapolates them using the velocities (and accelerations, if present). This
+    // has to be known before the points are synced, so check for the primvars first.
+    bool velocityBlur = false;
+    bool accelerationBlur = false;
+    if (renderDelegate.getVelocityMotionBlur() && hasPrimvar(sceneDelegate, HdTokens->velocities)) {
+        velocityBlur = true;
+        accelerationBlur = hasPrimvar(sceneDelegate, HdTokens->accelerations);
+    }
+    const bool blurModeChanged = (velocityBlur != mVelocityBlur ||
+                                  accelerationBlur != mAccelerationBlur);
+    mVelocityBlur = velocityBlur;
+    mAccelerationBlur = accelerationBlur;
+
+    // a change of blur mode requires points and velocities to be resent
+    // even if they are not dirty
+    auto isDirty = [&](const TfToken& name) {
+        return HdChangeTracker::IsPrimvarDirty(*dirtyBits, id, name) ||
+               (blurModeChanged && (name == HdTokens->points || name == HdTokens->velocities));
+    };
+
     // We will iterate through every primvar, calling primvarChanged if the primvar
     // is dirty. To detect removed primvars, we maintain the list mAppliedPrimvars of
     // all currently applied primvars, and build a list 'removedPrimvars' by comparing
@@ -100,7 +111,15 @@ GeometryMixin::syncPrimvars(HdSceneDelegate *sceneDelegate,
             if (primvarFilter(pv.name)) continue;
             mAppliedPrimvars.insert(pv.name);
             removedPrimvars.erase(pv.name);
-            if (HdChangeTracker::IsPrimvarDirty(*dirtyBits, id, pv.name)) {
+            if (isDirty(pv.name)) {
+                // skinned points may be computed from cached rest data, and skipped if the joints did not move
+                if (pv.name == HdTokens->points) {
+                    if (renderDelegate.getCachedSkinning() &&
+                        syncSkinnedPoints(sceneDelegate, renderDelegate, pv, *dirtyBits, blurModeChanged)) {
+                        continue;
+                    }
+                    mSkinning = SkinningCache();
+                }
                 dirtyCompPrimvars.emplace_back(pv);
             }
         }
@@ -111,10 +130,12 @@ GeometryMixin::syncPrimvars(HdSceneDelegate *sceneDelegate,
             HdExtComputationUtils::GetComputedPrimvarValues(dirtyCompPrimvars, sceneDelegate);
         for (auto const& compPrimvar : dirtyCompPrimvars) {
             auto const computedValue = valueStore.find(compPrimvar.name);
+            const bool isVertex = compPrimvar.interpolation == HdInterpolationVertex;
             primvarChanged(sceneDelegate,
                            renderDelegate,
                            compPrimvar.name,
-                           computedValue->second,
+                           isVertex ? expandVertexPrimvar(computedValue->second) :
+                                      computedValue->second,
                            compPrimvar.interpolation,
                            compPrimvar.role);
         }
@@ -127,11 +148,15 @@ GeometryMixin::syncPrimvars(HdSceneDelegate *sceneDelegate,
             if (not isPrimvarUsed(pv.name) && not primvarFilter(pv.name)) {
                 mAppliedPrimvars.insert(pv.name);
                 removedPrimvars.erase(pv.name);
-                if (HdChangeTracker::IsPrimvarDirty(*dirtyBits, id, pv.name)) {
+                if (isDirty(pv.name)) {
+                    VtValue value = rprim.GetPrimvar(sceneDelegate, pv.name);
+                    if (interp == HdInterpolationVertex) {
+                        value = expandVertexPrimvar(value);
+                    }
                     primvarChanged(sceneDelegate,
                                    renderDelegate,
                                    pv.name, 
-                                   rprim.GetPrimvar(sceneDelegate, pv.name),
+                                   value,
                                    interp, pv.role);
                 }
             }
@@ -144,6 +169,50 @@ GeometryMixin::syncPrimvars(HdSceneDelegate *sceneDelegate,
         primvarChanged(sceneDelegate, renderDelegate, name, VtValue(),
                        HdInterpolation::HdInterpolationConstant, TfToken());
     }
+
+    // done last, so that a "moonray:motion_blur_type" override can be detected. Adding or
+    // removing the override also needs this, to restore the velocity blur type
+    const bool overrideChanged = removedPrimvars.count(motionBlurTypeToken) ||
+                                 (isPrimvarUsed(motionBlurTypeToken) && isDirty(motionBlurTypeToken));
+    if (blurModeChanged || overrideChanged) {
+        syncMotionBlurType();
+    }
+}
+
+bool
+GeometryMixin::hasPrimvar(HdSceneDelegate* sceneDelegate, const TfToken& name)
+{
+    const SdfPath& id = rprim.GetId();
+    for (size_t i = 0; i < HdInterpolationCount; ++i) {
+        HdInterpolation interp = static_cast<HdInterpolation>(i);
+        for (HdPrimvarDescriptor const& pv : rprim.GetPrimvarDescriptors(sceneDelegate, interp)) {
+            if (pv.name == name) return true;
+        }
+        for (auto const& pv : sceneDelegate->GetExtComputationPrimvarDescriptors(id, interp)) {
+            if (pv.name == name) return true;
+        }
+    }
+    return false;
+}
+
+void
+GeometryMixin::syncMotionBlurType()
+{
+    // "best" (the default) would pick hermite or frame delta blur if it was given
+    // two position samples, so set the type explicitly for velocity blur
+    if (isPrimvarUsed(motionBlurTypeToken)) return;
+    try {
+        if (mVelocityBlur) {
+            const SceneClass& sceneClass = mGeometry->getSceneClass();
+            const AttributeKey<Int> key = sceneClass.getAttributeKey<Int>("motion_blur_type");
+            const std::string type(mAccelerationBlur ? "acceleration" : "velocity");
+            mGeometry->set(key, sceneClass.getEnumValue(key, type));
+        } else {
+            mGeometry->resetToDefault("motion_blur_type");
+        }
+    } catch (std::exception& e) {
+        // geometry isn't guaranteed to have "motion_blur_type"
+    }
 }
 
 void 
@@ -158,21 +227,22 @@ GeometryMixin::primvarChanged(HdSceneDelegate *sceneDelegate,
     // should be overridden by subclasses to handle their own specific primvars.
     
     // point primvars are supported by all geometry, so handle them here.
+    // With velocity blur only the first sample of points and velocities is used
     if (name == HdTokens->points) {
         setVec3fPrimvarMb(sceneDelegate, HdTokens->points, value,
-                        "vertex_list_0", "vertex_list_1");
+                        "vertex_list_0", "vertex_list_1", mVelocityBlur);
         return;
     } else if (name == HdTokens->velocities) {
         setVec3fPrimvarMb(sceneDelegate, HdTokens->velocities, value,
-                         "velocity_list_0", "velocity_list_1");
+                         "velocity_list_0", "velocity_list_1", mVelocityBlur);
         return;
     } else if (name == HdTokens->accelerations) {
         // only 1 sample for acceleration
         try {
             if (value.IsEmpty()) {
-                mGeometry->resetToDefault("accleration_list"); // sic
+                resetChunkedAttribute("accleration_list"); // sic
             } else {
-                setVec3fPrimvar(mGeometry, "accleration_list", value);
+                setVec3fAttribute("accleration_list", value);
             }
         } catch (std::exception& e) {
             // geometry isn't guarantred to have "accleration_list"
@@ -199,6 +269,7 @@ GeometryMixin::primvarAttributeOverride(const std::string& name, const VtValue&
     // value is empty. Sync may not be perfect here, because we would need to force
     // a sync with the appropriate dirty flags to make sure that the unoverridden value
     // is correct, but we don't know what those flags are.
+    if (visibilityOverride(name, value)) return;
     try { 
         const Attribute* attribute(mGeometry->getSceneClass().getAttribute(name));
         if (value.IsEmpty()) {
@@ -319,6 +390,77 @@ void setUserDataValues(UserData* userData,
     }
 }
 
+template <typename Vector, typename T>
+bool sameValues(const Vector& data, const T* p, size_t n)
+{
+    return data.size() == n && std::equal(data.begin(), data.end(), p);
+}
+
+// true if userData holds what setUserDataValues() would set from values. Used to
+// share UserData without keeping a copy of the Hydra values
+bool userDataMatches(const UserData& userData,
+                     const VtValue& values,
+                     const TfToken& role)
+{
+    if (values.IsHolding<VtFloatArray>()) {
+        const VtFloatArray& v = values.UncheckedGet<VtFloatArray>();
+        return userData.hasFloatData() && sameValues(userData.getFloatValues(), v.cdata(), v.size());
+    } else if (values.IsHolding<float>()) {
+        float v = values.UncheckedGet<float>();
+        return userData.hasFloatData() && sameValues(userData.getFloatValues(), &v, 1);
+    } else if (values.IsHolding<double>()) {
+        float v = float(values.UncheckedGet<double>());
+        return userData.hasFloatData() && sameValues(userData.getFloatValues(), &v, 1);
+    } else if (values.IsHolding<VtVec2fArray>()) {
+        const VtVec2fArray& v = values.UncheckedGet<VtVec2fArray>();
+        const Vec2f* p = reinterpret_cast<const Vec2f*>(v.cdata());
+        return userData.hasVec2fData() && sameValues(userData.getVec2fValues(), p, v.size());
+    } else if (values.IsHolding<VtVec3fArray>()) {
+        const VtVec3fArray& v = values.UncheckedGet<VtVec3fArray>();
+        if (role == HdPrimvarRoleTokens->color) {
+            const Rgb* p = reinterpret_cast<const Rgb*>(v.cdata());
+            return userData.hasColorData() && sameValues(userData.getColorValues(), p, v.size());
+        } else {
+            const Vec3f* p = reinterpret_cast<const Vec3f*>(v.cdata());
+            return userData.hasVec3fData() && sameValues(userData.getVec3fValues(), p, v.size());
+        }
+    } else if (values.IsHolding<GfVec3f>()) {
+        const GfVec3f& v = values.UncheckedGet<GfVec3f>();
+        if (role == HdPrimvarRoleTokens->color) {
+            const Rgb* p = reinterpret_cast<const Rgb*>(&v);
+            return userData.hasColorData() && sameValues(userData.getColorValues(), p, 1);
+        } else {
+            const Vec3f* p = reinterpret_cast<const Vec3f*>(&v);
+            return userData.hasVec3fData() && sameValues(userData.getVec3fValues(), p, 1);
+        }
+    } else if (values.IsHolding<VtStringArray>()) {
+        const VtStringArray& v = values.UncheckedGet<VtStringArray>();
+        return userData.hasStringData() && sameValues(userData.getStringValues(), v.cdata(), v.size());
+    } else if (values.IsHolding<std::string>()) {
+        const std::string& v = values.UncheckedGet<std::string>();
+        return userData.hasStringData() && sameValues(userData.getStringValues(), &v, 1);
+    } else if (values.IsHolding<VtUIntArray>()) {
+        const VtUIntArray& v = values.UncheckedGet<VtUIntArray>();
+        const float* p = reinterpret_cast<const float*>(v.cdata());
+        return userData.hasFloatData() && sameValues(userData.getFloatValues(), p, v.size());
+    } else if (values.IsHolding<VtIntArray>()) {
+        const VtIntArray& v = values.UncheckedGet<VtIntArray>();
+        const float* p = reinterpret_cast<const float*>(v.cdata());
+        return userData.hasFloatData() && sameValues(userData.getFloatValues(), p, v.size());
+    } else if (values.IsHolding<int>()) {
+        int v = values.UncheckedGet<int>();
+        return userData.hasIntData() && sameValues(userData.getIntValues(), &v, 1);
+    } else if (values.IsHolding<long>()) {
+        int v = int(values.UncheckedGet<long>());
+        return userData.hasIntData() && sameValues(userData.getIntValues(), &v, 1);
+    } else if (values.IsHolding<VtBoolArray>()) {
+        const VtBoolArray& v = values.UncheckedGet<VtBoolArray>();
+        return userData.hasBoolData() && sameValues(userData.getBoolValues(), v.cdata(), v.size());
+    }
+    // not translated, so there is nothing to tell values of this type apart
+    return true;
+}
+
 } // namespace {
 
 namespace hdMoonray {
@@ -335,16 +477,68 @@ GeometryMixin::primvarUserData(RenderDelegate& renderDelegate,
 
     if (value.IsEmpty()) {
         // indicates primvar was removed, so we should remove user data
+       releaseSharedUserData(renderDelegate, mUserData[name]);
        mUserData.erase(name);
+       for (Chunk& chunk : mChunks) chunk.userData.erase(name);
        // cannot delete actual RDL object...
        mUserDataChanged = true;
        return;
     }
 
+    if (mChunks.empty() || interp == HdInterpolationConstant) {
+        // remove any per-chunk UserData left from a non-constant primvar
+        for (Chunk& chunk : mChunks) {
+            if (chunk.userData.erase(name)) mUserDataChanged = true;
+        }
+        if (not renderDelegate.getSharePrimvars()) {
+            releaseSharedUserData(renderDelegate, mUserData[name]);
+            updateUserData(renderDelegate, mUserData[name], geometry()->getName(),
+                           name, value, interp, role);
+            return;
+        }
+        // share the UserData with any other geometry that has the same values
+        UserData* shared = renderDelegate.resourceRegistry().acquireUserData(
+            name, value, interp, role,
+            [&](const UserData& userData) { return userDataMatches(userData, value, role); },
+            [&](UserData* userData) {
+                setUserDataInterpolation(userData, interp);
+                setUserDataValues(userData, name, value, role);
+            });
+        if (shared) {
+            UserData*& userData = mUserData[name];
+            if (userData != shared) {
+                releaseSharedUserData(renderDelegate, userData);
+                userData = shared;
+                mUserDataChanged = true;
+            } else {
+                // values have not changed : keep a single reference
+                renderDelegate.resourceRegistry().releaseUserData(shared);
+            }
+        }
+    } else {
+        // each chunk has its own UserData, holding its part of the values.
+        // Chunk 0 must not write to a shared object
+        releaseSharedUserData(renderDelegate, mUserData[name]);
+        for (size_t c = 0; c < mChunks.size(); ++c) {
+            UserData*& userData = c ? mChunks[c].userData[name] : mUserData[name];
+            updateUserData(renderDelegate, userData, chunkGeometry(c)->getName(),
+                           name, chunkValue(value, c), interp, role);
+        }
+    }
+}
+
+void
+GeometryMixin::updateUserData(RenderDelegate& renderDelegate,
+                              UserData*& userData,
+                              const std::string& geometryName,
+                              const TfToken& name,
+                              const VtValue& value,
+                              const HdInterpolation& interp,
+                              const TfToken& role)
+{
     // create UserData object if it doesn't already exist
-    auto& userData = mUserData[name];
     if (!userData) {
-        std::string childName = geometry()->getName() + ".primvars:" + name.GetString();
+        std::string childName = geometryName + ".primvars:" + name.GetString();
         SceneObject* object = renderDelegate.createSceneObject("UserData", childName);
         if (!object) return;
         userData = object->asA<UserData>();
@@ -357,6 +551,58 @@ GeometryMixin::primvarUserData(RenderDelegate& renderDelegate,
     setUserDataValues(userData, name, value, role);
 }
 
+void
+GeometryMixin::releaseSharedUserData(RenderDelegate& renderDelegate, UserData*& userData)
+{
+    // does nothing if userData is not shared, so that updateUserData reuses it
+    if (renderDelegate.resourceRegistry().releaseUserData(userData)) {
+        userData = nullptr;
+        mUserDataChanged = true;
+    }
+}
+
+void
+GeometryMixin::releaseAllSharedUserData(RenderDelegate& renderDelegate)
+{
+    for (auto it = mUserData.begin(); it != mUserData.end();) {
+        if (renderDelegate.resourceRegistry().releaseUserData(it->second)) {
+            it = mUserData.erase(it);
+            mUserDataChanged = true;
+        } else {
+            ++it;
+        }
+    }
+}
+
+VtValue
+GeometryMixin::chunkValue(const VtValue& value, size_t chunk) const
+{
+    const size_t size = value.GetArraySize();
+    const VtIntArray* indices = nullptr;
+    if (size == mChunkVertexCount) indices = &mChunks[chunk].vertices;
+    else if (size == mChunkElementCount) indices = &mChunks[chunk].elements;
+    if (indices) {
+        VtValue part = gatherValue(value, *indices);
+        if (not part.IsEmpty()) return part;
+    }
+    if (chunk == 0) {
+        Logger::warn(rprim.GetId(), ": ", value.GetTypeName(), " with ", size,
+                     " values cannot be split between chunks");
+    }
+    return value;
+}
+
+void
+GeometryMixin::setVec3fAttribute(const std::string& rdlName, const VtValue& values)
+{
+    if (values.IsHolding<VtVec3fArray>()) {
+        const VtVec3fArray& va = values.UncheckedGet<VtVec3fArray>();
+        const Vec3f* p = reinterpret_cast<const Vec3f*>(&va[0]);
+        setChunkedAttribute(rdlName, Vec3fVector(p, p + va.size()));
+    } else {
+        Logger::warn(rdlName, " requires a Vec3f array");
+    }
+}
 
 // set a Vec3f attribute from a primvar, with motion blur samples
 // if present. Resets attribute to default if value is empty
@@ -365,13 +611,21 @@ GeometryMixin::setVec3fPrimvarMb(HdSceneDelegate* sceneDelegate,
                                  const TfToken& hydraName,
                                  const VtValue& value,
                                  const std::string& rdlName_0,
-                                 const std::string& rdlName_1)
+                                 const std::string& rdlName_1,
+                                 bool singleSample)
 {
     try {
         if (value.IsEmpty()) {
             // primvar was deleted
-            mGeometry->resetToDefault(rdlName_0);
-            mGeometry->resetToDefault(rdlName_1);
+            resetChunkedAttribute(rdlName_0);
+            resetChunkedAttribute(rdlName_1);
+            return;
+        }
+
+        if (singleSample) {
+            // no need to fetch the other samples
+            setVec3fAttribute(rdlName_0, value);
+            resetChunkedAttribute(rdlName_1);
             return;
         }
    
@@ -379,21 +633,22 @@ GeometryMixin::setVec3fPrimvarMb(HdSceneDelegate* sceneDelegate,
         sceneDelegate->SamplePrimvar(rprim.GetId(), hydraName, &vals);
 
         if (vals.count <= 1) {
-            setVec3fPrimvar(mGeometry, rdlName_0, value);
-            mGeometry->resetToDefault(rdlName_1);
+            setVec3fAttribute(rdlName_0, value);
+            resetChunkedAttribute(rdlName_1);
         } else {
             const bool sizesMatch =
                 vals.values[0].Get<pxr::VtVec3fArray>().size() ==
                 vals.values[vals.count - 1].Get<pxr::VtVec3fArray>().size();
 
+            // value has already been expanded, but the samples have not
             if (sizesMatch) {
-                setVec3fPrimvar(mGeometry, rdlName_0, vals.values[0]);
-                setVec3fPrimvar(mGeometry, rdlName_1, vals.values[vals.count - 1]);
+                setVec3fAttribute(rdlName_0, expandVertexPrimvar(vals.values[0]));
+                setVec3fAttribute(rdlName_1, expandVertexPrimvar(vals.values[vals.count - 1]));
                                  
             } else {
                 // If the sizes of the arrays don't match, then the topology
                 // is changing and we should just use the second set of values
-                setVec3fPrimvar(mGeometry, rdlName_0, vals.values[vals.count - 1]);
+                setVec3fAttribute(rdlName_0, expandVertexPrimvar(vals.values[vals.count - 1]));
             }
         }          
     } catch (std::exception& e) {
@@ -63,19 +63,16 @@ Procedural::syncAttributes(HdSceneDelegate* sceneDelegate,
                            const TfToken& reprToken)
 {
     // sync all attributes "procedural:xyx" to RDL attr xyz
-    const SceneClass& sceneClass = geometry()->getSceneClass();
-    for (auto it = sceneClass.beginAttributes(); 
-              it != sceneClass.endAttributes(); 
-              ++it) {
-        const std::string& attrName = (*it)->getName();
-        const TfToken primvarName("moonray:"+attrName);
-        if (not isPrimvarUsed(primvarName)) {
-            const TfToken proceduralName("procedural:"+attrName);
-            VtValue val = sceneDelegate->Get(GetId(), proceduralName);
+    const AttributePlan& plan = renderDelegate.attributePlan(geometry()->getSceneClass());
+    const std::vector<TfToken>& proceduralNames = plan.prefixed("procedural:");
+    for (size_t i = 0; i < plan.entries().size(); ++i) {
+        const AttributePlan::Entry& entry = plan.entries()[i];
+        if (not isPrimvarUsed(entry.moonrayName)) {
+            VtValue val = sceneDelegate->Get(GetId(), proceduralNames[i]);
             if (val.IsEmpty()) {
-                ValueConverter::setDefault(geometry(), *it);
+                ValueConverter::setDefault(geometry(), entry.attribute);
             } else {
-                ValueConverter::setAttribute(geometry(), *it, val);
+                ValueConverter::setAttribute(geometry(), entry.attribute, val);
             }
         }
     }
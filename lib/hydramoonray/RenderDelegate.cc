@@ -21,6 +21,8 @@
 #include <pxr/base/gf/vec2f.h>
 #include <pxr/usdImaging/usdImaging/delegate.h>
 
+#include <tbb/parallel_for.h>
+
 #include <scene_rdl2/common/except/exceptions.h>
 #include <scene_rdl2/render/logging/logging.h>
 #include <scene_rdl2/scene/rdl2/GeometrySet.h>
@@ -37,8 +39,11 @@
 
 #include <scene_rdl2/render/logging/logging.h>
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <cstdlib>
+#include <sstream>
 
 //#define DEBUG_MSG
 
@@ -72,6 +77,31 @@ namespace {
             hash += repeatableStringHash(obj->getName());
         return hash;
     }
+
+    // adaptive tessellation aims for this many pixels per tessellated segment
+    constexpr float TARGET_SEGMENT_PIXELS = 2.0f;
+    // the level must be off by this much before it is changed, so that small
+    // camera moves don't cause geometry to be retessellated
+    constexpr float LEVEL_HYSTERESIS = 0.75f;
+    // projected size used when the extent crosses the camera plane
+    constexpr float PROJECTED_SIZE_NEAR = 1e6f;
+
+    // Approximate height in pixels of an extent seen through worldToNdc
+    float projectedSize(const pxr::GfRange3d& extent, const pxr::GfMatrix4d& m, int imageHeight)
+    {
+        // project the corners of the extent and measure the NDC bounding box
+        pxr::GfRange3d ndc;
+        for (size_t i = 0; i < 8; ++i) {
+            const pxr::GfVec3d c = extent.GetCorner(i);
+            const pxr::GfVec4d p = pxr::GfVec4d(c[0], c[1], c[2], 1.0) * m;
+            // behind or at the camera : size is unbounded
+            if (p[3] <= 0) return PROJECTED_SIZE_NEAR;
+            ndc.UnionWith(pxr::GfVec3d(p[0] / p[3], p[1] / p[3], 0.0));
+        }
+        // NDC is [-1,1], so half the size is the fraction of the image
+        const pxr::GfVec3d size = ndc.GetSize();
+        return float(std::max(size[0], size[1]) * 0.5 * imageHeight);
+    }
 }
 namespace hdMoonray {
 
@@ -101,6 +131,10 @@ RenderDelegate::_constructor()
     _PopulateDefaultSettings(mRenderSettingDescriptors);
     renderParam.This = this;
     initializeSceneContext();
+    mResourceRegistry = std::make_shared<ResourceRegistry>(*this);
+    mMaterialCache.reset(new MaterialCache(*this));
+    mTexturePrefetch.reset(new TexturePrefetch);
+    mTextureWatcher.reset(new TextureWatcher);
 }
 
 RenderDelegate::~RenderDelegate()
@@ -109,7 +143,80 @@ RenderDelegate::~RenderDelegate()
 }
 
 void
-RenderDelegate::CommitResources(pxr::HdChangeTracker *tracker) {}
+RenderDelegate::CommitResources(pxr::HdChangeTracker *tracker)
+{
+    // all the prototypes have synced, so shared instance geometry can be built
+    std::set<Instancer*> instancers;
+    {   std::lock_guard<std::mutex> lock(mSharedInstancersMutex);
+        instancers.swap(mSharedInstancersToCommit);
+    }
+    for (Instancer* instancer : instancers) {
+        instancer->commitSharedInstances(*this);
+    }
+
+    // edited materials, which are independent of each other
+    std::vector<Material*> materials;
+    {   std::lock_guard<std::mutex> lock(mMaterialUpdatesMutex);
+        materials.assign(mMaterialUpdates.begin(), mMaterialUpdates.end());
+        mMaterialUpdates.clear();
+    }
+    tbb::parallel_for(size_t(0), materials.size(), [&](size_t i) {
+        materials[i]->update(*this);
+    });
+
+    // prims that synced have registered their new bounds
+    allocateTessellation();
+}
+
+void
+RenderDelegate::scheduleMaterialUpdate(Material* material)
+{
+    std::lock_guard<std::mutex> lock(mMaterialUpdatesMutex);
+    mMaterialUpdates.insert(material);
+}
+
+void
+RenderDelegate::cancelMaterialUpdate(Material* material)
+{
+    std::lock_guard<std::mutex> lock(mMaterialUpdatesMutex);
+    mMaterialUpdates.erase(material);
+}
+
+void
+RenderDelegate::addInstancedLight(Light* light)
+{
+    std::lock_guard<std::mutex> lock(mInstancedLightsMutex);
+    mInstancedLights.insert(light);
+}
+
+void
+RenderDelegate::removeInstancedLight(Light* light)
+{
+    std::lock_guard<std::mutex> lock(mInstancedLightsMutex);
+    mInstancedLights.erase(light);
+}
+
+void
+RenderDelegate::updateInstancedLights()
+{
+    std::vector<Light*> lights;
+    {   std::lock_guard<std::mutex> lock(mInstancedLightsMutex);
+        lights.assign(mInstancedLights.begin(), mInstancedLights.end());
+    }
+    for (Light* light : lights) light->updateInstances(*this);
+}
+
+void
+RenderDelegate::reloadChangedTextures()
+{
+    if (not mTextureWatcher->hasChanges()) return;
+    const std::vector<std::string> files = mTextureWatcher->takeChanged();
+    for (const std::string& file : files) {
+        Logger::info("Reloading texture ", file);
+    }
+    beginUpdate();
+    mRenderer->invalidateTextureResources(files);
+}
 
 #if PXR_VERSION >= 2108
 pxr::HdCommandDescriptors RenderDelegate::GetCommandDescriptors() const
@@ -196,9 +303,7 @@ RenderDelegate::GetSupportedBprimTypes() const
 pxr::HdResourceRegistrySharedPtr
 RenderDelegate::GetResourceRegistry() const
 {
-    static pxr::HdResourceRegistrySharedPtr ptr;
-    if (not ptr) ptr.reset(new pxr::HdResourceRegistry());
-    return ptr;
+    return mResourceRegistry;
 }
 
 // Result of this is passed to RenderBuffer::Allocate
@@ -228,6 +333,22 @@ RenderDelegate::GetRenderStats() const
             stats[rpAnn] = status;
         }
     }
+    // how well primvar UserData is shared between geometry
+    size_t references, objects;
+    mResourceRegistry->getStats(references, objects);
+    if (objects) {
+        static const pxr::TfToken primvarDedupRatio("primvarDedupRatio");
+        stats[primvarDedupRatio] = double(references) / objects;
+    }
+    // and shaders between materials
+    mResourceRegistry->getShaderStats(references, objects);
+    if (objects) {
+        static const pxr::TfToken shaderDedupRatio("shaderDedupRatio");
+        stats[shaderDedupRatio] = double(references) / objects;
+    }
+    for (const auto& p : mResourceRegistry->GetResourceAllocation()) {
+        stats[p.first] = p.second;
+    }
     return stats;
 }
 
@@ -269,6 +390,9 @@ RenderDelegate::CreateInstancer(pxr::HdSceneDelegate *sceneDelegate,
 void
 RenderDelegate::DestroyInstancer(pxr::HdInstancer *instancer)
 {
+    {   std::lock_guard<std::mutex> lock(mSharedInstancersMutex);
+        mSharedInstancersToCommit.erase(static_cast<Instancer*>(instancer));
+    }
     delete instancer;
 }
 
@@ -442,6 +566,28 @@ RenderDelegate::createSceneObject(const std::string& className, const std::strin
     }
 }
 
+const scene_rdl2::rdl2::SceneClass*
+RenderDelegate::getSceneClass(const std::string& className)
+{
+    // this returns the existing class if it is already loaded
+    try {
+        return acquireSceneContext().createSceneClass(className);
+    } catch (const std::exception& e) {
+        // caller can print a more informative error message
+        return nullptr;
+    }
+}
+
+const AttributePlan&
+RenderDelegate::attributePlan(const scene_rdl2::rdl2::SceneClass& sceneClass)
+{
+    auto found = mAttributePlans.find(&sceneClass);
+    if (found != mAttributePlans.end()) return *found->second;
+    // if another thread makes the plan for the class first, this one is dropped
+    std::unique_ptr<AttributePlan> plan(new AttributePlan(sceneClass));
+    return *mAttributePlans.emplace(&sceneClass, std::move(plan)).first->second;
+}
+
 scene_rdl2::rdl2::SceneObject*
 RenderDelegate::getSceneObject(const pxr::SdfPath& id)
 {
@@ -475,60 +621,56 @@ RenderDelegate::initializeSceneContext()
     mPrimaryCamera = wsc.createSceneObject("PerspectiveCamera", "primaryCamera")->asA<scene_rdl2::rdl2::Camera>();
 }
 
+// The defaults are only made if something uses them, so scenes with their own
+// lights and materials do not get them. std::call_once lets materials and geometry
+// syncing in parallel use them without a shared lock once they exist
 scene_rdl2::rdl2::Material*
 RenderDelegate::defaultMaterial()
 {
-    if (not mDefaultMaterial) {
-        std::lock_guard<std::mutex> lock(mCreateMutex);
-        if (not mDefaultMaterial) {
-            scene_rdl2::rdl2::SceneContext& wsc = acquireSceneContext();
-            scene_rdl2::rdl2::Map* displayColor = wsc.createSceneObject("AttributeMap", "displayColor")->asA<scene_rdl2::rdl2::Map>();
-            {   UpdateGuard guard(displayColor);
-                displayColor->set("primitive_attribute_name", std::string("displayColor"));
-                // displayColor->set("primitive_attribute_type", 3); // color
-                displayColor->set("default_value", scene_rdl2::rdl2::Rgb(0.5f,0.5f,0.5f)); // default from hdSt/shaders/mesh.glslfx
-            }
-            scene_rdl2::rdl2::Map* displayOpacity = wsc.createSceneObject("AttributeMap", "displayOpacity")->asA<scene_rdl2::rdl2::Map>();
-            {   UpdateGuard guard(displayOpacity);
-                displayOpacity->set("primitive_attribute_name", std::string("displayOpacity"));
-                displayOpacity->set("primitive_attribute_type", 0); // FLOAT
-            }
-            mDefaultMaterial = wsc.createSceneObject("UsdPreviewSurface", "defaultMaterial")->asA<scene_rdl2::rdl2::Material>();
-            UpdateGuard guard(mDefaultMaterial);
-            mDefaultMaterial->set("diffuseColor", scene_rdl2::rdl2::Rgb(1.0f,1.0f,1.0f));
-            mDefaultMaterial->setBinding("diffuseColor", displayColor);
-            mDefaultMaterial->setBinding("opacity", displayOpacity);
-            mDefaultMaterial->set("roughness", 0.3f);
+    std::call_once(mDefaultMaterialOnce, [this]() {
+        scene_rdl2::rdl2::SceneContext& wsc = acquireSceneContext();
+        scene_rdl2::rdl2::Map* displayColor = wsc.createSceneObject("AttributeMap", "displayColor")->asA<scene_rdl2::rdl2::Map>();
+        {   UpdateGuard guard(displayColor);
+            displayColor->set("primitive_attribute_name", std::string("displayColor"));
+            // displayColor->set("primitive_attribute_type", 3); // color
+            displayColor->set("default_value", scene_rdl2::rdl2::Rgb(0.5f,0.5f,0.5f)); // default from hdSt/shaders/mesh.glslfx
         }
-    }
+        scene_rdl2::rdl2::Map* displayOpacity = wsc.createSceneObject("AttributeMap", "displayOpacity")->asA<scene_rdl2::rdl2::Map>();
+        {   UpdateGuard guard(displayOpacity);
+            displayOpacity->set("primitive_attribute_name", std::string("displayOpacity"));
+            displayOpacity->set("primitive_attribute_type", 0); // FLOAT
+        }
+        scene_rdl2::rdl2::Material* material = wsc.createSceneObject("UsdPreviewSurface", "defaultMaterial")->asA<scene_rdl2::rdl2::Material>();
+        UpdateGuard guard(material);
+        material->set("diffuseColor", scene_rdl2::rdl2::Rgb(1.0f,1.0f,1.0f));
+        material->setBinding("diffuseColor", displayColor);
+        material->setBinding("opacity", displayOpacity);
+        material->set("roughness", 0.3f);
+        mDefaultMaterial = material;
+    });
     return mDefaultMaterial;
 }
 
 scene_rdl2::rdl2::Material*
 RenderDelegate::errorMaterial()
 {
-    if (not mErrorMaterial) {
-        std::lock_guard<std::mutex> lock(mCreateMutex);
-        if (not mErrorMaterial) {
-            scene_rdl2::rdl2::SceneContext& wsc = acquireSceneContext();
-            mErrorMaterial = wsc.createSceneObject("UsdPreviewSurface", "errorMaterial")->asA<scene_rdl2::rdl2::Material>();
-            UpdateGuard guard(mErrorMaterial);
-            mErrorMaterial->set("diffuseColor", scene_rdl2::rdl2::Rgb(1.0f, 0.0f, 1.0f));
-        }
-    }
+    std::call_once(mErrorMaterialOnce, [this]() {
+        scene_rdl2::rdl2::SceneContext& wsc = acquireSceneContext();
+        scene_rdl2::rdl2::Material* material = wsc.createSceneObject("UsdPreviewSurface", "errorMaterial")->asA<scene_rdl2::rdl2::Material>();
+        UpdateGuard guard(material);
+        material->set("diffuseColor", scene_rdl2::rdl2::Rgb(1.0f, 0.0f, 1.0f));
+        mErrorMaterial = material;
+    });
     return mErrorMaterial;
 }
 
 scene_rdl2::rdl2::VolumeShader*
 RenderDelegate::defaultVolumeShader()
 {
-    if (not mDefaultVolumeShader) {
-        std::lock_guard<std::mutex> lock(mCreateMutex);
-        if (not mDefaultVolumeShader) {
-            scene_rdl2::rdl2::SceneContext& wsc = acquireSceneContext();
-            mDefaultVolumeShader = wsc.createSceneObject("BaseVolume", "defaultVolumeShader")->asA<scene_rdl2::rdl2::VolumeShader>();
-        }
-    }
+    std::call_once(mDefaultVolumeShaderOnce, [this]() {
+        scene_rdl2::rdl2::SceneContext& wsc = acquireSceneContext();
+        mDefaultVolumeShader = wsc.createSceneObject("BaseVolume", "defaultVolumeShader")->asA<scene_rdl2::rdl2::VolumeShader>();
+    });
     return mDefaultVolumeShader;
 }
 
@@ -590,9 +732,8 @@ RenderDelegate::updateAssignmentFromCategories(
     const auto& mCategoryObjects = this->mCategoryObjects; // prevent non-const set operations
 
     // create the default light if there are no lights
-    if (not mNumLights && not mDefaultLight) {        
-        std::lock_guard<std::mutex> lock(mCreateMutex);
-        if (not mDefaultLight) {
+    if (not mNumLights) {
+        std::call_once(mDefaultLightOnce, [this]() {
             scene_rdl2::rdl2::SceneContext& wsc = acquireSceneContext();
             scene_rdl2::rdl2::Light* defaultLight = wsc.createSceneObject("EnvLight", "defaultLight")->asA<scene_rdl2::rdl2::Light>();
             setCategory(defaultLight, CategoryType::LightLink, pxr::TfToken());
@@ -601,8 +742,8 @@ RenderDelegate::updateAssignmentFromCategories(
             defaultLight->set("max_shadow_distance", 100.0f);
             //defaultLight->set("sample_upper_hemisphere_only", true);
             mDefaultLight = defaultLight;
-        }
-    } 
+        });
+    }
 
     std::set<scene_rdl2::rdl2::SceneObject*> sets[CategoryType::COUNT];
 
@@ -770,6 +911,14 @@ void RenderDelegate::setDoubleSided(bool v)
     }
 }
 
+void RenderDelegate::setVelocityMotionBlur(bool v)
+{
+    if (v != mVelocityMotionBlur) {
+        mVelocityMotionBlur = v;
+        markAllRprimsDirty(pxr::HdChangeTracker::DirtyPoints);
+    }
+}
+
 void RenderDelegate::setForcePolygon(bool v)
 {
     if (v != mForcePolygon) {
@@ -778,6 +927,317 @@ void RenderDelegate::setForcePolygon(bool v)
     }
 }
 
+void RenderDelegate::setGeometryChunkSize(int v)
+{
+    const size_t chunkSize = v > 0 ? size_t(v) : 0;
+    if (chunkSize != mGeometryChunkSize) {
+        mGeometryChunkSize = chunkSize;
+        // points and topology are used to determine the chunk layout
+        markAllRprimsDirty(pxr::HdChangeTracker::DirtyPoints | pxr::HdChangeTracker::DirtyTopology);
+    }
+}
+
+void RenderDelegate::setSharePrimvars(bool v)
+{
+    if (v != mSharePrimvars) {
+        mSharePrimvars = v;
+        // every UserData moves between the registry and its geometry
+        markAllRprimsDirty(pxr::HdChangeTracker::DirtyPrimvar | pxr::HdChangeTracker::DirtyPrimID);
+    }
+}
+
+void RenderDelegate::setCachedSkinning(bool v)
+{
+    if (v != mCachedSkinning) {
+        mCachedSkinning = v;
+        markAllRprimsDirty(pxr::HdChangeTracker::DirtyPoints);
+    }
+}
+
+void RenderDelegate::setSharedInstancers(bool v)
+{
+    if (v != mSharedInstancers) {
+        mSharedInstancers = v;
+        // prototypes move between their own instancer and the shared one
+        markAllRprimsDirty(pxr::HdChangeTracker::DirtyInstancer);
+    }
+}
+
+void RenderDelegate::setFlattenInstanceLimit(int v)
+{
+    const size_t limit = v > 0 ? size_t(v) : 0;
+    if (limit != mFlattenInstanceLimit) {
+        mFlattenInstanceLimit = limit;
+        markAllRprimsDirty(pxr::HdChangeTracker::DirtyInstancer);
+    }
+}
+
+void RenderDelegate::addSharedInstancer(Instancer* instancer)
+{
+    std::lock_guard<std::mutex> lock(mSharedInstancersMutex);
+    mSharedInstancersToCommit.insert(instancer);
+}
+
+bool RenderDelegate::isProxy(const pxr::SdfPath& id) const
+{
+    if (not mBoundingBoxProxies) return false;
+    for (const pxr::SdfPath& path : mFullGeometryPaths) {
+        if (id.HasPrefix(path)) return false;
+    }
+    return true;
+}
+
+void RenderDelegate::setBoundingBoxProxies(bool enable, const std::string& fullPaths)
+{
+    std::vector<pxr::SdfPath> paths;
+    std::istringstream stream(fullPaths);
+    std::string path;
+    while (stream >> path) {
+        if (pxr::SdfPath::IsValidPathString(path)) paths.emplace_back(path);
+        else Logger::warn("Full Geometry Paths: invalid path '", path, "'");
+    }
+    if (enable == mBoundingBoxProxies && paths == mFullGeometryPaths) return;
+
+    // only rprims that switch between proxy and full geometry are resynced
+    std::vector<pxr::SdfPath> proxied;
+    if (mRenderIndex) {
+        for (const pxr::SdfPath& id : mRenderIndex->GetRprimIds()) {
+            const GeometryMixin* geometry = dynamic_cast<const GeometryMixin*>(mRenderIndex->GetRprim(id));
+            if (geometry && geometry->supportsProxy() && isProxy(id)) proxied.push_back(id);
+        }
+    }
+    mBoundingBoxProxies = enable;
+    mFullGeometryPaths = std::move(paths);
+    if (mRenderIndex) {
+        pxr::HdChangeTracker& changeTracker = mRenderIndex->GetChangeTracker();
+        std::sort(proxied.begin(), proxied.end());
+        for (const pxr::SdfPath& id : mRenderIndex->GetRprimIds()) {
+            const GeometryMixin* geometry = dynamic_cast<const GeometryMixin*>(mRenderIndex->GetRprim(id));
+            if (not geometry || not geometry->supportsProxy()) continue;
+            const bool wasProxy = std::binary_search(proxied.begin(), proxied.end(), id);
+            if (wasProxy != isProxy(id)) {
+                changeTracker.MarkRprimDirty(id, pxr::HdChangeTracker::AllDirty);
+            }
+        }
+    }
+}
+
+void RenderDelegate::setAdaptiveTessellation(bool v)
+{
+    if (v != mAdaptiveTessellation) {
+        mAdaptiveTessellation = v;
+        markAllRprimsDirty(pxr::HdChangeTracker::DirtyDisplayStyle);
+    }
+}
+
+void RenderDelegate::setTessellationBudget(int v)
+{
+    const int64_t budget = v > 0 ? v : 0;
+    if (budget != mTessellationBudget) {
+        mTessellationBudget = budget;
+        std::lock_guard<std::mutex> lock(mTessellationMutex);
+        mTessellationDirty = true;
+    }
+}
+
+void RenderDelegate::setInstanceCulling(bool enable, float margin, float minPixels)
+{
+    margin = std::max(margin, 0.0f);
+    minPixels = std::max(minPixels, 0.0f);
+    if (enable == mInstanceCulling && margin == mInstanceCullMargin && minPixels == mInstanceCullPixels) {
+        return;
+    }
+    mInstanceCulling = enable;
+    mInstanceCullMargin = margin;
+    mInstanceCullPixels = minPixels;
+    // re-cull from the render camera, if it is known
+    if (mTessellationImageHeight > 0) {
+        updateCullingCamera(mTessellationCamera, mTessellationImageHeight, true);
+    } else if (const Camera* camera = mRenderIndex ? renderCamera(*mRenderIndex) : nullptr) {
+        updateCullingCamera(camera->worldToNdc(), 0, true);
+    } else if (mHasCullingCamera) {
+        updateCullingCamera(mCullingCamera, mCullingImageHeight, true);
+    }
+}
+
+// The camera to cull instances with : the camera of the last render pass or, before
+// the first one, the only camera of the scene
+const Camera* RenderDelegate::renderCamera(const pxr::HdRenderIndex& renderIndex) const
+{
+    pxr::SdfPath id = mRenderCameraId;
+    if (id.IsEmpty()) {
+        const pxr::SdfPathVector ids = renderIndex.GetSprimSubtree(pxr::HdPrimTypeTokens->camera,
+                                                                   pxr::SdfPath::AbsoluteRootPath());
+        if (ids.size() != 1) return nullptr;
+        id = ids[0];
+    }
+    return dynamic_cast<const Camera*>(renderIndex.GetSprim(pxr::HdPrimTypeTokens->camera, id));
+}
+
+void RenderDelegate::syncCullingCamera(const Camera& camera, const pxr::HdRenderIndex& renderIndex)
+{
+    if (not mInstanceCulling || renderCamera(renderIndex) != &camera) return;
+    // the image height is only known once a render pass has run
+    updateCullingCamera(camera.worldToNdc(), mCullingImageHeight, false);
+}
+
+// imageHeight is 0 if it is not known yet, in which case the pixel threshold is not used
+void RenderDelegate::updateCullingCamera(const pxr::GfMatrix4d& worldToNdc, int imageHeight, bool force)
+{
+    if (not force) {
+        if (not mInstanceCulling) return;
+        // the image height only matters for the pixel threshold
+        if (mHasCullingCamera && (imageHeight == mCullingImageHeight || mInstanceCullPixels <= 0)) {
+            // How far points that were in the old view moved in NDC. Test the corners
+            // of the image at a near and a far depth
+            bool moved = false;
+            const pxr::GfMatrix4d oldToNew = mCullingCamera.GetInverse() * worldToNdc;
+            for (double z : {0.0, 0.9}) {
+                for (double x : {-1.0, 1.0}) {
+                    for (double y : {-1.0, 1.0}) {
+                        const pxr::GfVec4d p = pxr::GfVec4d(x, y, z, 1.0) * oldToNew;
+                        if (p[3] <= 0 ||
+                            std::abs(p[0] / p[3] - x) > mInstanceCullMargin * 0.5 ||
+                            std::abs(p[1] / p[3] - y) > mInstanceCullMargin * 0.5) {
+                            moved = true;
+                        }
+                    }
+                }
+            }
+            if (not moved) {
+                mCullingImageHeight = imageHeight;
+                return;
+            }
+        }
+    }
+    mHasCullingCamera = true;
+    mCullingCamera = worldToNdc;
+    mCullingImageHeight = imageHeight;
+
+    // re-cull : only instanced prims are resynced
+    if (mRenderIndex) {
+        pxr::HdChangeTracker& changeTracker = mRenderIndex->GetChangeTracker();
+        for (const pxr::SdfPath& id : mRenderIndex->GetRprimIds()) {
+            const pxr::HdRprim* rprim = mRenderIndex->GetRprim(id);
+            if (rprim && not rprim->GetInstancerId().IsEmpty()) {
+                changeTracker.MarkRprimDirty(id, pxr::HdChangeTracker::DirtyInstancer);
+            }
+        }
+    }
+}
+
+void RenderDelegate::setShareShaders(bool v)
+{
+    if (v != mShareShaders) {
+        mShareShaders = v;
+        // shaders move between the registry and their materials
+        if (mRenderIndex) {
+            for (const pxr::SdfPath& id : mRenderIndex->GetSprimSubtree(pxr::HdPrimTypeTokens->material,
+                                                                        pxr::SdfPath::AbsoluteRootPath())) {
+                mRenderIndex->GetChangeTracker().MarkSprimDirty(id, pxr::HdMaterial::DirtyResource);
+            }
+        }
+    }
+}
+
+void RenderDelegate::setTessellationCamera(const pxr::GfMatrix4d& worldToNdc, int imageHeight)
+{
+    // the levels are picked again from the bounds the prims registered, so no
+    // rprim is resynced. Only the prims whose level changes are updated
+    if (worldToNdc != mTessellationCamera || imageHeight != mTessellationImageHeight) {
+        mTessellationCamera = worldToNdc;
+        mTessellationImageHeight = imageHeight;
+        {   std::lock_guard<std::mutex> lock(mTessellationMutex);
+            mTessellationDirty = true;
+        }
+        allocateTessellation();
+        updateCullingCamera(worldToNdc, imageHeight, false);
+    }
+}
+
+void RenderDelegate::setTessellationPrim(const pxr::SdfPath& id, const TessellationPrim& prim)
+{
+    std::lock_guard<std::mutex> lock(mTessellationMutex);
+    auto it = mTessellationPrims.find(id);
+    if (it == mTessellationPrims.end()) {
+        mTessellationPrims.emplace(id, prim);
+    } else {
+        // keep the hysteresis state and the applied level
+        TessellationPrim& entry = it->second;
+        const bool hasDesiredLevel = entry.hasDesiredLevel;
+        const float desiredLevel = entry.desiredLevel;
+        const int level = entry.level;
+        entry = prim;
+        entry.hasDesiredLevel = hasDesiredLevel;
+        entry.desiredLevel = desiredLevel;
+        entry.level = level;
+    }
+    mTessellationDirty = true;
+}
+
+void RenderDelegate::removeTessellationPrim(const pxr::SdfPath& id)
+{
+    std::lock_guard<std::mutex> lock(mTessellationMutex);
+    if (mTessellationPrims.erase(id)) mTessellationDirty = true;
+}
+
+void RenderDelegate::allocateTessellation()
+{
+    std::lock_guard<std::mutex> lock(mTessellationMutex);
+    if (not mTessellationDirty) return;
+    mTessellationDirty = false;
+    if (mTessellationPrims.empty()) return;
+
+    // the level each prim wants, with hysteresis. The map is ordered by path, so
+    // the result does not depend on the order the prims synced in
+    std::vector<TessellationPrim*> prims;
+    std::vector<int> levels;
+    prims.reserve(mTessellationPrims.size());
+    levels.reserve(mTessellationPrims.size());
+    int maxLevel = 0;
+    for (auto& it : mTessellationPrims) {
+        TessellationPrim& prim = it.second;
+        int level = prim.maxLevel;
+        if (mTessellationImageHeight > 0 && not prim.extent.IsEmpty()) {
+            const float elementPixels = projectedSize(prim.extent, prim.xform * mTessellationCamera,
+                                                      mTessellationImageHeight) / prim.elementsAcross;
+            const float desired = std::log2(std::max(elementPixels, 1e-6f) / TARGET_SEGMENT_PIXELS);
+            if (not prim.hasDesiredLevel || std::abs(desired - prim.desiredLevel) > LEVEL_HYSTERESIS) {
+                prim.desiredLevel = desired;
+                prim.hasDesiredLevel = true;
+            }
+            level = int(std::ceil(prim.desiredLevel - 0.5f));
+        }
+        level = std::min(std::max(level, 0), prim.maxLevel);
+        maxLevel = std::max(maxLevel, level);
+        prims.push_back(&prim);
+        levels.push_back(level);
+    }
+
+    // over the budget, every prim drops by the same number of levels, the smallest
+    // number that fits
+    const int64_t budget = getTessellationBudget();
+    if (budget > 0) {
+        auto cost = [&](int drop) {
+            int64_t total = 0;
+            for (size_t i = 0; i < prims.size(); ++i) {
+                total += int64_t(prims[i]->elementCount) << (prims[i]->costExponent * std::max(levels[i] - drop, 0));
+            }
+            return total;
+        };
+        int drop = 0;
+        while (drop < maxLevel && cost(drop) > budget) ++drop;
+        for (int& level : levels) level = std::max(level - drop, 0);
+    }
+
+    for (size_t i = 0; i < prims.size(); ++i) {
+        if (prims[i]->level != levels[i]) {
+            prims[i]->level = levels[i];
+            prims[i]->geometry->applyTessellationLevel(*this, levels[i]);
+        }
+    }
+}
+
 void RenderDelegate::markAllRprimsDirty(pxr::HdDirtyBits bits)
 {
     if (mRenderIndex) mRenderIndex->GetChangeTracker().MarkAllRprimsDirty(bits);
@@ -3,10 +3,21 @@
 
 #pragma once
 
+#include "AttributePlan.h"
+#include "MaterialCache.h"
 #include "RenderSettings.h"
+#include "ResourceRegistry.h"
+#include "TexturePrefetch.h"
+#include "TextureWatcher.h"
 
+#include <pxr/base/gf/matrix4d.h>
+#include <pxr/base/gf/range3d.h>
 #include <pxr/imaging/hd/renderDelegate.h>
 #include <pxr/usdImaging/usdImaging/delegate.h>
+#include <tbb/concurrent_unordered_map.h>
+
+#include <atomic>
+#include <mutex>
 
 namespace scene_rdl2 {namespace rdl2 {
 class Camera;
@@ -16,6 +27,7 @@ class Layer;
 class LayerAssignment;
 class LightSet;
 class Material;
+class SceneClass;
 class SceneObject;
 class LayerAssignment;
 class VolumeShader;
@@ -23,6 +35,11 @@ class VolumeShader;
 
 namespace hdMoonray {
 
+class Camera;
+class GeometryMixin;
+class Instancer;
+class Light;
+class Material;
 class Renderer;
 
 /// This is the object created by RendererPlugin that implements all
@@ -49,6 +66,7 @@ public:
     const pxr::TfTokenVector &GetSupportedBprimTypes() const override;
 
     /// Returns the HdResourceRegistry instance used by this render delegate.
+    /// This shares primvar UserData objects between geometry (see ResourceRegistry.h)
     pxr::HdResourceRegistrySharedPtr GetResourceRegistry() const override;
 
     /// Returns a list of user-configurable render settings.
@@ -197,6 +215,23 @@ public:
     /// The Renderer hides the different backends, such as renderfarm vs local
     Renderer& renderer() const { return *mRenderer; }
 
+    /// Store of primvar UserData shared between geometry
+    ResourceRegistry& resourceRegistry() const { return *mResourceRegistry; }
+
+    /// On-disk cache of material translations (see MaterialCache.h)
+    MaterialCache& materialCache() const { return *mMaterialCache; }
+    void setMaterialCache(const std::string& directory) { mMaterialCache->setDirectory(directory); }
+
+    /// Background reading of textures (see TexturePrefetch.h)
+    TexturePrefetch& texturePrefetch() const { return *mTexturePrefetch; }
+    void setTexturePrefetchBudget(int megabytes) { mTexturePrefetch->setBudget(megabytes > 0 ? size_t(megabytes) << 20 : 0); }
+
+    /// Watcher of the texture files used by materials (see TextureWatcher.h)
+    TextureWatcher& textureWatcher() const { return *mTextureWatcher; }
+    void setWatchTextures(bool v) { mTextureWatcher->setEnabled(v); }
+    /// Make the renderer reload the texture files that changed. Called before each render pass
+    void reloadChangedTextures();
+
     /// Create or update the renderer to match current settings. This is fast
     /// if no settings have changed. You must call this before renderer().
     Renderer& getRendererApplySettings();
@@ -214,6 +249,10 @@ public:
     scene_rdl2::rdl2::SceneObject* createSceneObject(const std::string& className, const pxr::SdfPath& id);
     scene_rdl2::rdl2::SceneObject* createSceneObject(const std::string& className, const std::string& id);
 
+    // Returns the class, loading it if needed. Returns null if there is no such class
+    const scene_rdl2::rdl2::SceneClass* getSceneClass(const std::string& className);
+    // Returns the attribute names of a class, made on first use
+    const AttributePlan& attributePlan(const scene_rdl2::rdl2::SceneClass& sceneClass);
     scene_rdl2::rdl2::SceneObject* getSceneObject(const pxr::SdfPath& id);
     scene_rdl2::rdl2::SceneObject* getSceneObject(const std::string& id);
 
@@ -279,7 +318,106 @@ public:
     void setDecodeNormals(bool v);
     bool getEnableMotionBlur() const { return mEnableMotionBlur; }
     void setEnableMotionBlur(bool v) { mEnableMotionBlur = v; }
+    // if true, geometry with velocities sends a single position sample and uses
+    // moonray's velocity/acceleration motion blur instead of two position samples
+    bool getVelocityMotionBlur() const { return mVelocityMotionBlur; }
+    void setVelocityMotionBlur(bool v);
     bool getForcePolygon() const {return mForcePolygon;}
+    // Points and BasisCurves with more elements than this are split into spatially
+    // coherent chunks, each a separate RDL geometry. 0 disables chunking
+    size_t getGeometryChunkSize() const { return mGeometryChunkSize; }
+    void setGeometryChunkSize(int v);
+    // if true, primvar UserData with identical values is shared between geometry through
+    // the resource registry, instead of each geometry having its own
+    bool getSharePrimvars() const { return mSharePrimvars; }
+    void setSharePrimvars(bool v);
+    // if true, UsdSkel skinned points are computed here from cached rest points and
+    // influences, and are only resent when the joint transforms change
+    bool getCachedSkinning() const { return mCachedSkinning; }
+    void setCachedSkinning(bool v);
+    // if enabled, meshes, curves and points are translated as boxes made from their
+    // extent, except for prims under one of the whitespace-separated fullPaths
+    void setBoundingBoxProxies(bool enable, const std::string& fullPaths);
+    bool isProxy(const pxr::SdfPath& id) const;
+    // if true, each point instancer puts all its prototypes in a single RDL instance
+    // geometry, using refIndices to select the prototype of each instance. Instancers
+    // that are culled or have per-instance light linking still use one per prototype
+    bool getSharedInstancers() const { return mSharedInstancers; }
+    void setSharedInstancers(bool v);
+    // queue an instancer to build its shared instance geometry in CommitResources()
+    void addSharedInstancer(Instancer* instancer);
+    // queue a material whose network changed to update its terminals in CommitResources()
+    void scheduleMaterialUpdate(Material* material);
+    void cancelMaterialUpdate(Material* material);
+    // lights that are prototypes of an instancer, whose instances updateInstancedLights()
+    // updates if the instancer changed without the light syncing
+    void addInstancedLight(Light* light);
+    void removeInstancedLight(Light* light);
+    // called by RenderPass::_Sync(), after the sprims and before the rprims sync, so
+    // that the rprims that must add new light copies to their LightSets sync this time
+    void updateInstancedLights();
+    // nested instancers with at most this many instances in total are flattened into
+    // one RDL instancer per prototype. 0 disables flattening
+    size_t getFlattenInstanceLimit() const { return mFlattenInstanceLimit; }
+    void setFlattenInstanceLimit(int v);
+    // if true, mesh resolution and curve tessellation rate are chosen per prim from
+    // its size in the render camera, up to the level set by the display style
+    bool getAdaptiveTessellation() const { return mAdaptiveTessellation; }
+    void setAdaptiveTessellation(bool v);
+    // maximum number of micro-polygons (in millions) adaptive tessellation may
+    // generate in total. 0 is unlimited
+    int64_t getTessellationBudget() const { return mTessellationBudget * int64_t(1000000); }
+    void setTessellationBudget(int v);
+    // A prim whose tessellation level is chosen by allocateTessellation()
+    struct TessellationPrim {
+        GeometryMixin* geometry = nullptr;
+        pxr::GfRange3d extent;       // local bounds. Empty uses maxLevel (instanced prims)
+        pxr::GfMatrix4d xform{1.0};
+        float elementsAcross = 1;    // projected size / this = size of one element
+        size_t elementCount = 0;     // elements at level 0
+        int maxLevel = 0;
+        int costExponent = 1;        // each level multiplies the elements by 2^costExponent
+        bool hasDesiredLevel = false;
+        float desiredLevel = 0;      // last level the hysteresis accepted
+        int level = -1;              // level applied to the geometry
+    };
+    // Meshes and curves register here as they sync (keeping the state of an existing
+    // entry), and remove themselves when their geometry goes away
+    void setTessellationPrim(const pxr::SdfPath& id, const TessellationPrim& prim);
+    void removeTessellationPrim(const pxr::SdfPath& id);
+    // Pick the level of every registered prim from its size in the render camera, apply
+    // the budget, and set the level of the prims whose level changed. Only does work
+    // if prims were registered or the camera changed since the last call. Must not
+    // run during Sync()
+    void allocateTessellation();
+    // world-to-NDC matrix and image height of the render camera, set by RenderPass.
+    // Image height is 0 until the first render pass
+    void setTessellationCamera(const pxr::GfMatrix4d& worldToNdc, int imageHeight);
+    const pxr::GfMatrix4d& getTessellationCamera() const { return mTessellationCamera; }
+    int getTessellationImageHeight() const { return mTessellationImageHeight; }
+    // if true, instances of non-nested instancers outside the render camera frustum
+    // (expanded by the margin, a fraction of the image size) or smaller than minPixels
+    // on screen are not translated
+    void setInstanceCulling(bool enable, float margin, float minPixels);
+    bool getInstanceCulling() const { return mInstanceCulling; }
+    float getInstanceCullMargin() const { return mInstanceCullMargin; }
+    float getInstanceCullPixels() const { return mInstanceCullPixels; }
+    // the render camera when instances were last culled. This only follows the render
+    // camera once it has moved by more than half the margin, so that instancers are
+    // not rebuilt for every small camera move
+    bool hasCullingCamera() const { return mHasCullingCamera; }
+    const pxr::GfMatrix4d& getCullingCamera() const { return mCullingCamera; }
+    // image height when instances were last culled, 0 before the first render pass
+    int getCullingImageHeight() const { return mCullingImageHeight; }
+    // the camera of the last render pass
+    void setRenderCameraId(const pxr::SdfPath& id) { mRenderCameraId = id; }
+    // called when a camera syncs, before the rprims do : if it is the render camera
+    // the culling camera follows it, so instances are culled in the same sync
+    void syncCullingCamera(const Camera& camera, const pxr::HdRenderIndex& renderIndex);
+    // if true, identical shader nodes with output channels are shared between materials
+    // through the resource registry, instead of each material having its own
+    bool getShareShaders() const { return mShareShaders; }
+    void setShareShaders(bool v);
 
     bool getPruneProcedural(const std::string& rdlName) const
         { return mPrunedProcedurals.count(rdlName) > 0; }
@@ -313,6 +451,10 @@ private:
 
     Renderer* mRenderer = nullptr;
     RenderSettings mRenderSettings;
+    std::shared_ptr<ResourceRegistry> mResourceRegistry;
+    std::unique_ptr<MaterialCache> mMaterialCache;
+    std::unique_ptr<TexturePrefetch> mTexturePrefetch;
+    std::unique_ptr<TextureWatcher> mTextureWatcher;
     unsigned mPreviousRenderSettings = 0;
     pxr::HdRenderSettingDescriptorList mRenderSettingDescriptors;
 
@@ -321,7 +463,34 @@ private:
     bool mDecodeNormals = false;
     bool mDecodeNormalsChanged = false;
     bool mEnableMotionBlur = false;
+    bool mVelocityMotionBlur = false;
     bool mForcePolygon = false;
+    size_t mGeometryChunkSize = 0;
+    bool mSharePrimvars = false;
+    bool mCachedSkinning = false;
+    bool mBoundingBoxProxies = false;
+    std::vector<pxr::SdfPath> mFullGeometryPaths;
+    bool mSharedInstancers = false;
+    std::set<Instancer*> mSharedInstancersToCommit;
+    std::mutex mSharedInstancersMutex;
+    size_t mFlattenInstanceLimit = 0;
+    bool mAdaptiveTessellation = false;
+    int64_t mTessellationBudget = 0;
+    std::map<pxr::SdfPath, TessellationPrim> mTessellationPrims; // ordered, so allocation is deterministic
+    bool mTessellationDirty = false;
+    std::mutex mTessellationMutex;
+    pxr::GfMatrix4d mTessellationCamera{1.0};
+    int mTessellationImageHeight = 0;
+    bool mInstanceCulling = false;
+    float mInstanceCullMargin = 0.25f;
+    float mInstanceCullPixels = 0.0f;
+    bool mHasCullingCamera = false;
+    pxr::GfMatrix4d mCullingCamera{1.0};
+    int mCullingImageHeight = 0;
+    pxr::SdfPath mRenderCameraId;
+    const Camera* renderCamera(const pxr::HdRenderIndex& renderIndex) const;
+    void updateCullingCamera(const pxr::GfMatrix4d& worldToNdc, int imageHeight, bool force);
+    bool mShareShaders = false;
     std::set<std::string> mPrunedProcedurals; // stores RDL2 name
     bool mPruneVolume = false;
     bool mDisableRender = false;
@@ -337,6 +506,10 @@ private:
     scene_rdl2::rdl2::Material* mErrorMaterial = nullptr;
     scene_rdl2::rdl2::VolumeShader* mDefaultVolumeShader = nullptr;
     scene_rdl2::rdl2::Light* mDefaultLight = nullptr;
+    std::once_flag mDefaultMaterialOnce;
+    std::once_flag mErrorMaterialOnce;
+    std::once_flag mDefaultVolumeShaderOnce;
+    std::once_flag mDefaultLightOnce;
     scene_rdl2::rdl2::LightSet* mEmptyLightSet = nullptr;
 
     unsigned mNumLights = 0;
@@ -351,7 +524,17 @@ private:
     std::map<size_t, scene_rdl2::rdl2::LightFilterSet*> mLightFilterSets;
 
     std::mutex mCategoriesMutex;
-    std::mutex mCreateMutex;
+
+    // found without locking by rprims and materials syncing in parallel
+    tbb::concurrent_unordered_map<const scene_rdl2::rdl2::SceneClass*,
+                                  std::unique_ptr<AttributePlan>> mAttributePlans;
+
+    // materials edited since the last CommitResources()
+    std::set<Material*> mMaterialUpdates;
+    std::mutex mMaterialUpdatesMutex;
+
+    std::set<Light*> mInstancedLights;
+    std::mutex mInstancedLightsMutex;
 
     std::string mRdlOutput;
     pxr::TfTokenVector mRenderTags;
@@ -31,7 +31,11 @@ RenderPass::IsConverged() const
     // It does not call RenderBuffer::Resolve after IsConverged returns true, so
     // it never shows the last generated image. Fix this by requiring IsConverged()
     // to be called twice to return true and disable the _Execute call between them.
-    if (mDeferIsConverged) {
+    if (renderDelegate.textureWatcher().hasChanges()) {
+        // keep Hydra calling _Execute() so that changed textures are reloaded
+        mDeferIsConverged = false;
+        return false;
+    } else if (mDeferIsConverged) {
         return true;
     } else {
         mDeferIsConverged = renderDelegate.renderer().isFrameComplete();
@@ -47,6 +51,8 @@ RenderPass::_MarkCollectionDirty()
 void
 RenderPass::_Sync()
 {
+    // lights whose instancer changed. This syncs the instancers early
+    renderDelegate.updateInstancedLights();
 }
 
 void
@@ -83,6 +89,9 @@ RenderPass::_Execute(const pxr::HdRenderPassStateSharedPtr& renderPassState,
         return;
     }
     const_cast<Camera*>(camera)->setAsPrimaryCamera(renderDelegate, double(w)/h);
+    renderDelegate.setRenderCameraId(camera->GetId());
+    renderDelegate.setTessellationCamera(renderPassState->GetWorldToViewMatrix() *
+                                         renderPassState->GetProjectionMatrix(), h);
 
     float frame = 0;
     scene_rdl2::rdl2::FloatVector motionSteps(2);
@@ -132,6 +141,8 @@ RenderPass::_Execute(const pxr::HdRenderPassStateSharedPtr& renderPassState,
         buffer->bind(aovBinding, camera);      
     }
 
+    renderDelegate.reloadChangedTextures();
+
     if (renderDelegate.renderer().isUpdateActive()) {      
         mDeferIsConverged = false;
     }
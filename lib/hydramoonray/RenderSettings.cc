@@ -25,12 +25,29 @@ TF_DEFINE_PRIVATE_TOKENS(Tokens,
     (doubleSided)
     (decodeNormals)
     (enableMotionBlur)
+    (velocityMotionBlur)
     (pruneWillow)
     (pruneFurDeform)
     (pruneCurveDeform)
     (pruneVolume)
     (pruneWrapDeform)
     (forcePolygon)
+    (geometryChunkSize)
+    (adaptiveTessellation)
+    (tessellationBudget)
+    (sharePrimvars)
+    (cachedSkinning)
+    (boundingBoxProxies)
+    (fullGeometryPaths)
+    (sharedInstancers)
+    (flattenInstanceLimit)
+    (instanceCulling)
+    (instanceCullMargin)
+    (instanceCullPixels)
+    (shareShaders)
+    (materialCache)
+    (texturePrefetchBudget)
+    (watchTextures)
     (executionMode)
 );
 
@@ -52,12 +69,29 @@ RenderSettings::addDescriptors(HdRenderSettingDescriptorList& descriptorList) co
         { "DoubleSided",          Tokens->doubleSided,         VtValue(getEnv("HDMOONRAY_DOUBLESIDED", false)) },
         { "Decode Normals",       Tokens->decodeNormals,       VtValue(getEnv("HDMOONRAY_DOUBLESIDED", false)) },
         { "Enable Motion Blur",   Tokens->enableMotionBlur,    VtValue(getEnv("HDMOONRAY_ENABLE_MOTION_BLUR", true)) },
+        { "Velocity Motion Blur", Tokens->velocityMotionBlur,  VtValue(getEnv("HDMOONRAY_VELOCITY_MOTION_BLUR", false)) },
         { "Prune Willow",         Tokens->pruneWillow,         VtValue(getEnv("HDMOONRAY_PRUNE_WILLOW", false)) },
         { "Prune FurDeform",      Tokens->pruneFurDeform,      VtValue(getEnv("HDMOONRAY_PRUNE_FURDEFORM", false)) },
         { "Prune Volumes",        Tokens->pruneVolume,         VtValue(getEnv("HDMOONRAY_PRUNE_VOLUME", false)) },
         { "Prune WrapDeform",     Tokens->pruneWrapDeform,     VtValue(getEnv("HDMOONRAY_PRUNE_WRAPDEFORM", false)) },
         { "Prune CurveDeform",    Tokens->pruneCurveDeform,    VtValue(getEnv("HDMOONRAY_PRUNE_CURVEDEFORM", false)) },
         { "Force Polygon",        Tokens->forcePolygon,        VtValue(getEnv("HDMOONRAY_FORCE_POLYGON", false)) },
+        { "Geometry Chunk Size",  Tokens->geometryChunkSize,   VtValue(getEnv("HDMOONRAY_GEOMETRY_CHUNK_SIZE", 0)) },
+        { "Adaptive Tessellation", Tokens->adaptiveTessellation, VtValue(getEnv("HDMOONRAY_ADAPTIVE_TESSELLATION", false)) },
+        { "Tessellation Budget",  Tokens->tessellationBudget,  VtValue(getEnv("HDMOONRAY_TESSELLATION_BUDGET", 0)) },
+        { "Share Primvars",       Tokens->sharePrimvars,       VtValue(getEnv("HDMOONRAY_SHARE_PRIMVARS", false)) },
+        { "Cached Skinning",      Tokens->cachedSkinning,      VtValue(getEnv("HDMOONRAY_CACHED_SKINNING", false)) },
+        { "Bounding Box Proxies", Tokens->boundingBoxProxies,  VtValue(getEnv("HDMOONRAY_BOUNDING_BOX_PROXIES", false)) },
+        { "Full Geometry Paths",  Tokens->fullGeometryPaths,   VtValue(getEnv("HDMOONRAY_FULL_GEOMETRY_PATHS", "")) },
+        { "Shared Instancers",    Tokens->sharedInstancers,    VtValue(getEnv("HDMOONRAY_SHARED_INSTANCERS", false)) },
+        { "Flatten Instance Limit", Tokens->flattenInstanceLimit, VtValue(getEnv("HDMOONRAY_FLATTEN_INSTANCE_LIMIT", 0)) },
+        { "Instance Culling",     Tokens->instanceCulling,     VtValue(getEnv("HDMOONRAY_INSTANCE_CULLING", false)) },
+        { "Instance Cull Margin", Tokens->instanceCullMargin,  VtValue(getEnv("HDMOONRAY_INSTANCE_CULL_MARGIN", 0.25f)) },
+        { "Instance Cull Pixels", Tokens->instanceCullPixels,  VtValue(getEnv("HDMOONRAY_INSTANCE_CULL_PIXELS", 0.0f)) },
+        { "Share Shaders",        Tokens->shareShaders,        VtValue(getEnv("HDMOONRAY_SHARE_SHADERS", false)) },
+        { "Material Cache",       Tokens->materialCache,       VtValue(getEnv("HDMOONRAY_MATERIAL_CACHE", "")) },
+        { "Texture Prefetch Budget", Tokens->texturePrefetchBudget, VtValue(getEnv("HDMOONRAY_TEXTURE_PREFETCH_BUDGET", 0)) },
+        { "Watch Textures",       Tokens->watchTextures,       VtValue(getEnv("HDMOONRAY_WATCH_TEXTURES", false)) },
         { "Execution Mode",       Tokens->executionMode,       VtValue(getEnv("HDMOONRAY_EXEC_MODE", "auto")) },
     };
     for (const auto& desc : descriptors) {
@@ -99,22 +133,17 @@ void RenderSettings::apply()
     scene_rdl2::rdl2::SceneVariables& sv = mDelegate.acquireSceneContext().getSceneVariables();
     {
         UpdateGuard guard(sv);
-        const SceneClass& sceneClass = sv.getSceneClass();
-        for (auto it = sceneClass.beginAttributes(); it != sceneClass.endAttributes(); ++it) {
-
-            const std::string& attrName = (*it)->getName();
-            if (sDontWrite.count(attrName)) continue;
-
-            TfToken key = TfToken("moonray:sceneVariable:" + attrName);
-            VtValue val = mDelegate.GetRenderSetting(key);
+        const AttributePlan& plan = mDelegate.attributePlan(sv.getSceneClass());
+        const std::vector<TfToken>& keys = plan.prefixed("moonray:sceneVariable:");
+        const std::vector<TfToken>& oldKeys = plan.prefixed("sceneVariable_");
+        for (size_t i = 0; i < plan.entries().size(); ++i) {
+            const AttributePlan::Entry& entry = plan.entries()[i];
+            if (sDontWrite.count(entry.name.GetString())) continue;
+
+            VtValue val = mDelegate.GetRenderSetting(keys[i]);
+            if (val.IsEmpty()) val = mDelegate.GetRenderSetting(oldKeys[i]);
             if (not val.IsEmpty()) {
-                ValueConverter::setAttribute(&sv, *it, val);
-            } else {
-                key = TfToken("sceneVariable_" + attrName);
-                val = mDelegate.GetRenderSetting(key);
-                if (not val.IsEmpty()) {
-                    ValueConverter::setAttribute(&sv, *it, val);
-                }
+                ValueConverter::setAttribute(&sv, entry.attribute, val);
             }
         }
 
@@ -128,12 +157,29 @@ void RenderSettings::apply()
     mDelegate.setDoubleSided(get<bool>(Tokens->doubleSided));
     mDelegate.setDecodeNormals(get<bool>(Tokens->decodeNormals));
     mDelegate.setEnableMotionBlur(get<bool>(Tokens->enableMotionBlur));
+    mDelegate.setVelocityMotionBlur(get<bool>(Tokens->velocityMotionBlur));
     mDelegate.setPruneProcedural("WillowGeometry_v3", get<bool>(Tokens->pruneWillow));
     mDelegate.setPruneProcedural("FurDeformGeometry", get<bool>(Tokens->pruneFurDeform));
     mDelegate.setPruneProcedural("CurveDeformGeometry", get<bool>(Tokens->pruneCurveDeform));
     mDelegate.setPruneProcedural("WrapDeformGeometry", get<bool>(Tokens->pruneWrapDeform));
     mDelegate.setPruneVolume(get<bool>(Tokens->pruneVolume));
     mDelegate.setForcePolygon(get<bool>(Tokens->forcePolygon));
+    mDelegate.setGeometryChunkSize(get<int>(Tokens->geometryChunkSize));
+    mDelegate.setAdaptiveTessellation(get<bool>(Tokens->adaptiveTessellation));
+    mDelegate.setTessellationBudget(get<int>(Tokens->tessellationBudget));
+    mDelegate.setSharePrimvars(get<bool>(Tokens->sharePrimvars));
+    mDelegate.setCachedSkinning(get<bool>(Tokens->cachedSkinning));
+    mDelegate.setBoundingBoxProxies(get<bool>(Tokens->boundingBoxProxies),
+                                    get<std::string>(Tokens->fullGeometryPaths));
+    mDelegate.setSharedInstancers(get<bool>(Tokens->sharedInstancers));
+    mDelegate.setFlattenInstanceLimit(get<int>(Tokens->flattenInstanceLimit));
+    mDelegate.setInstanceCulling(get<bool>(Tokens->instanceCulling),
+                                 get<float>(Tokens->instanceCullMargin),
+                                 get<float>(Tokens->instanceCullPixels));
+    mDelegate.setShareShaders(get<bool>(Tokens->shareShaders));
+    mDelegate.setMaterialCache(get<std::string>(Tokens->materialCache));
+    mDelegate.setTexturePrefetchBudget(get<int>(Tokens->texturePrefetchBudget));
+    mDelegate.setWatchTextures(get<bool>(Tokens->watchTextures));
     setDeepIdAttributeName();
 
 }
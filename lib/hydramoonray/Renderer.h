@@ -76,6 +76,8 @@ public:
     void setIsHoudini(bool v) { mIsHoudini = v; }
 
     virtual void invalidateAllTextureResources()=0;
+    /// Reload just these texture files
+    virtual void invalidateTextureResources(const std::vector<std::string>& files)=0;
     virtual void restartRenderer()=0;
     virtual void outputRdl(const std::string& rdlOutput) {
         if (not rdlOutput.empty()) {
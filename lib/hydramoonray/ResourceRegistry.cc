@@ -0,0 +1,257 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ResourceRegistry.h"
+#include "RenderDelegate.h"
+
+#include <scene_rdl2/scene/rdl2/SceneObject.h>
+#include <scene_rdl2/scene/rdl2/UserData.h>
+
+using namespace pxr;
+using scene_rdl2::rdl2::UserData;
+
+namespace {
+
+const TfToken sharedPrimvarReferences("sharedPrimvarReferences");
+const TfToken sharedPrimvarObjects("sharedPrimvarObjects");
+const TfToken sharedShaderReferences("sharedShaderReferences");
+const TfToken sharedShaderObjects("sharedShaderObjects");
+
+size_t
+hashCombine(size_t seed, size_t h)
+{
+    return seed ^ (h + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
+}
+
+namespace hdMoonray {
+
+UserData*
+ResourceRegistry::acquireUserData(const TfToken& name,
+                                  const VtValue& value,
+                                  HdInterpolation interp,
+                                  const TfToken& role,
+                                  const UserDataMatch& matches,
+                                  const UserDataSetup& setup)
+{
+    size_t hash = value.GetHash();
+    hash = hashCombine(hash, name.Hash());
+    hash = hashCombine(hash, role.Hash());
+    hash = hashCombine(hash, size_t(interp));
+
+    UserData* userData = nullptr;
+    Entry* created = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        bool waited;
+        do {
+            waited = false;
+            auto range = mEntries.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it) {
+                Entry& entry = it->second;
+                if (entry.name != name || entry.interp != interp || entry.role != role) continue;
+                if (not entry.ready) {
+                    // contents cannot be compared until the creator has filled them.
+                    // Entries may be added or removed while waiting, so search again
+                    mReady.wait(lock);
+                    waited = true;
+                    break;
+                }
+                if (matches(*entry.userData)) {
+                    ++entry.refCount;
+                    ++mReferences;
+                    return entry.userData;
+                }
+            }
+        } while (waited);
+
+        // new value : reuse an unreferenced object if possible
+        if (not mFree.empty()) {
+            userData = mFree.back();
+            mFree.pop_back();
+        } else {
+            const std::string objectName = "sharedPrimvar" + std::to_string(mCreated);
+            scene_rdl2::rdl2::SceneObject* object =
+                mRenderDelegate.createSceneObject("UserData", objectName);
+            // if there was an error this already printed an error message
+            if (not object) return nullptr;
+            ++mCreated;
+            userData = object->asA<UserData>();
+        }
+        auto it = mEntries.emplace(hash, Entry{name, interp, role, userData, 1, false});
+        mObjects[userData] = it;
+        // elements do not move when the map rehashes
+        created = &it->second;
+        ++mReferences;
+    }
+
+    // geometry that released a reused object no longer reads it, and values are
+    // not read by the renderer until the render starts after sync
+    {
+        UpdateGuard guard(mRenderDelegate, userData);
+        userData->resetAllToDefault();
+        setup(userData);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        created->ready = true;
+    }
+    mReady.notify_all();
+    return userData;
+}
+
+bool
+ResourceRegistry::releaseUserData(const UserData* userData)
+{
+    if (not userData) return false;
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto found = mObjects.find(userData);
+    if (found == mObjects.end()) return false;
+    Entry& entry = found->second->second;
+    --mReferences;
+    if (--entry.refCount == 0) {
+        mFree.push_back(entry.userData);
+        mEntries.erase(found->second);
+        mObjects.erase(found);
+    }
+    return true;
+}
+
+void
+ResourceRegistry::getStats(size_t& references, size_t& objects) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    references = mReferences;
+    objects = mEntries.size();
+}
+
+scene_rdl2::rdl2::SceneObject*
+ResourceRegistry::acquireShader(const std::string& className,
+                                size_t key,
+                                scene_rdl2::rdl2::SceneObject* previous,
+                                bool& isNew)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto previousIt = mShaderObjects.end();
+    for (;;) {
+        ShaderEntry* entry = nullptr;
+        auto range = mShaders.equal_range(key);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.className == className) {
+                entry = &it->second;
+                break;
+            }
+        }
+        if (not entry) break;
+        if (entry->state == ShaderState::Pending) {
+            // another material is setting it up. Entries may be added or removed
+            // while waiting, so search again
+            mReady.wait(lock);
+            continue;
+        }
+        if (entry->shader != previous) {
+            ++entry->refCount;
+            ++mShaderReferences;
+            if (previous) previousIt = mShaderObjects.find(previous);
+            if (previousIt != mShaderObjects.end()) releaseShaderLocked(previousIt->second);
+        }
+        // if the setup failed, this caller tries again
+        isNew = entry->state == ShaderState::Failed;
+        if (isNew) entry->state = ShaderState::Pending;
+        return entry->shader;
+    }
+
+    isNew = true;
+    if (previous) previousIt = mShaderObjects.find(previous);
+    if (previousIt != mShaderObjects.end()) {
+        ShaderMap::iterator old = previousIt->second;
+        if (old->second.refCount == 1 && old->second.className == className) {
+            // nobody else uses it, so change it rather than forking
+            ShaderEntry entry = old->second;
+            entry.state = ShaderState::Pending;
+            mShaders.erase(old);
+            mShaderObjects[previous] = mShaders.emplace(key, std::move(entry));
+            return previous;
+        }
+        releaseShaderLocked(old);
+    }
+
+    // new shader : reuse an unreferenced object of the class if possible
+    scene_rdl2::rdl2::SceneObject* shader = nullptr;
+    std::vector<scene_rdl2::rdl2::SceneObject*>& free = mFreeShaders[className];
+    if (not free.empty()) {
+        shader = free.back();
+        free.pop_back();
+    } else {
+        const std::string objectName = "sharedShader" + std::to_string(mShadersCreated);
+        shader = mRenderDelegate.createSceneObject(className, objectName);
+        // if there was an error this already printed an error message
+        if (not shader) return nullptr;
+        ++mShadersCreated;
+    }
+    mShaderObjects[shader] = mShaders.emplace(key, ShaderEntry{className, shader, 1, ShaderState::Pending});
+    ++mShaderReferences;
+    return shader;
+}
+
+void
+ResourceRegistry::setShaderReady(const scene_rdl2::rdl2::SceneObject* shader, bool ok)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto found = mShaderObjects.find(shader);
+        if (found == mShaderObjects.end()) return;
+        found->second->second.state = ok ? ShaderState::Ready : ShaderState::Failed;
+    }
+    mReady.notify_all();
+}
+
+void
+ResourceRegistry::releaseShaderLocked(ShaderMap::iterator it)
+{
+    ShaderEntry& entry = it->second;
+    --mShaderReferences;
+    if (--entry.refCount == 0) {
+        mFreeShaders[entry.className].push_back(entry.shader);
+        mShaderObjects.erase(entry.shader);
+        mShaders.erase(it);
+        // in case it was dropped before it was set up
+        mReady.notify_all();
+    }
+}
+
+bool
+ResourceRegistry::releaseShader(const scene_rdl2::rdl2::SceneObject* shader)
+{
+    if (not shader) return false;
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto found = mShaderObjects.find(shader);
+    if (found == mShaderObjects.end()) return false;
+    releaseShaderLocked(found->second);
+    return true;
+}
+
+void
+ResourceRegistry::getShaderStats(size_t& references, size_t& objects) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    references = mShaderReferences;
+    objects = mShaders.size();
+}
+
+VtDictionary
+ResourceRegistry::GetResourceAllocation() const
+{
+    VtDictionary dictionary;
+    size_t references, objects;
+    getStats(references, objects);
+    dictionary[sharedPrimvarReferences] = VtValue(references);
+    dictionary[sharedPrimvarObjects] = VtValue(objects);
+    getShaderStats(references, objects);
+    dictionary[sharedShaderReferences] = VtValue(references);
+    dictionary[sharedShaderObjects] = VtValue(objects);
+    return dictionary;
+}
+
+}
@@ -0,0 +1,140 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <pxr/imaging/hd/resourceRegistry.h>
+#include <pxr/imaging/hd/enums.h>
+#include <pxr/base/tf/token.h>
+#include <pxr/base/vt/dictionary.h>
+#include <pxr/base/vt/value.h>
+
+namespace scene_rdl2 {namespace rdl2 { class SceneObject; class UserData; } }
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace hdMoonray {
+
+class RenderDelegate;
+
+// Content-addressed store of primvar UserData objects
+//
+// With "Share Primvars" on, primvars with identical values (the same uvs on several LOD
+// copies, constant colors, shared normals, ...) are stored in a single RDL UserData
+// object, which is referenced by the "primitive_attributes" of every geometry using it.
+// Entries are found by a hash of the primvar name, interpolation, role and value, and
+// collisions are ruled out by comparing the values to the contents of the UserData, so
+// the registry does not keep the Hydra data alive. An entry is only shared once the
+// thread that created it has filled its UserData : other threads asking for the same
+// value wait until then. Shared objects are numbered in the order they are created,
+// which depends on the order the rprims sync in, so this is off by default.
+//
+// With "Share Shaders" on, shader nodes are shared the same way between materials :
+// identical nodes (the same ImageMap of the same texture in many materials, ...) are
+// found by a hash of the node and everything upstream of it, computed by the caller.
+//
+// RDL objects cannot be deleted, so a UserData or shader whose last reference is
+// released is kept and reused for the next new value.
+
+class ResourceRegistry final : public pxr::HdResourceRegistry
+{
+public:
+    explicit ResourceRegistry(RenderDelegate& renderDelegate): mRenderDelegate(renderDelegate) {}
+
+    // returns true if a UserData already holds the values of the primvar
+    using UserDataMatch = std::function<bool(const scene_rdl2::rdl2::UserData&)>;
+    // sets the rate and values of an empty UserData from the primvar
+    using UserDataSetup = std::function<void(scene_rdl2::rdl2::UserData*)>;
+
+    // Returns a UserData object for the primvar, shared with all other users of the
+    // same name, interpolation, role and value. A new object is filled by setup before
+    // anyone else can get it. Returns null if the object could not be created. Each
+    // successful call must be balanced by releaseUserData()
+    scene_rdl2::rdl2::UserData* acquireUserData(const pxr::TfToken& name,
+                                                const pxr::VtValue& value,
+                                                pxr::HdInterpolation interp,
+                                                const pxr::TfToken& role,
+                                                const UserDataMatch& matches,
+                                                const UserDataSetup& setup);
+
+    // Drop a reference returned by acquireUserData(). Returns false (and does
+    // nothing) if userData was not created by this registry
+    bool releaseUserData(const scene_rdl2::rdl2::UserData* userData);
+
+    // number of references held, and number of distinct UserData objects they use
+    void getStats(size_t& references, size_t& objects) const;
+
+    // Returns a shader of className shared with all other users of the same key. previous
+    // is a shader from this registry that the caller is replacing, or null : its reference
+    // is dropped, unless the caller holds the only reference to it and no shader has the
+    // key, in which case it is kept under the new key instead of being forked. If isNew is
+    // set the caller must set up the shader (which may be previous) and then report the
+    // result with setShaderReady(). Until then other callers asking for the key wait, and
+    // if the setup failed the next one is given the shader to set up again. Returns null if
+    // the object could not be created. Each successful call must be balanced by releaseShader()
+    scene_rdl2::rdl2::SceneObject* acquireShader(const std::string& className,
+                                                 size_t key,
+                                                 scene_rdl2::rdl2::SceneObject* previous,
+                                                 bool& isNew);
+
+    // Ends the setup of a shader returned by acquireShader() with isNew set. Must be
+    // called before acquiring another shader, or callers may wait for each other
+    void setShaderReady(const scene_rdl2::rdl2::SceneObject* shader, bool ok);
+
+    // Drop a reference returned by acquireShader(). Returns false (and does
+    // nothing) if shader was not created by this registry
+    bool releaseShader(const scene_rdl2::rdl2::SceneObject* shader);
+
+    // number of shader references held, and number of distinct shaders they use
+    void getShaderStats(size_t& references, size_t& objects) const;
+
+    // the stats above as a dictionary
+    pxr::VtDictionary GetResourceAllocation() const override;
+
+private:
+    struct Entry {
+        pxr::TfToken name;
+        pxr::HdInterpolation interp;
+        pxr::TfToken role;
+        scene_rdl2::rdl2::UserData* userData;
+        size_t refCount;
+        // false until the creator has filled userData
+        bool ready;
+    };
+    using EntryMap = std::unordered_multimap<size_t, Entry>;
+
+    RenderDelegate& mRenderDelegate;
+    mutable std::mutex mMutex;
+    // notified when a UserData or shader entry becomes ready
+    std::condition_variable mReady;
+    EntryMap mEntries;
+    std::unordered_map<const scene_rdl2::rdl2::UserData*, EntryMap::iterator> mObjects;
+    // objects that are no longer referenced, and can be reused
+    std::vector<scene_rdl2::rdl2::UserData*> mFree;
+    size_t mReferences = 0;
+    size_t mCreated = 0;
+
+    enum class ShaderState { Pending, Ready, Failed };
+    struct ShaderEntry {
+        std::string className;
+        scene_rdl2::rdl2::SceneObject* shader;
+        size_t refCount;
+        ShaderState state;
+    };
+    using ShaderMap = std::unordered_multimap<size_t, ShaderEntry>;
+    ShaderMap mShaders;
+    std::unordered_map<const scene_rdl2::rdl2::SceneObject*, ShaderMap::iterator> mShaderObjects;
+    // unreferenced shaders by class name
+    std::unordered_map<std::string, std::vector<scene_rdl2::rdl2::SceneObject*>> mFreeShaders;
+    size_t mShaderReferences = 0;
+    size_t mShadersCreated = 0;
+    // must hold mMutex
+    void releaseShaderLocked(ShaderMap::iterator it);
+};
+
+}
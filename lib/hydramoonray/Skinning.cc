@@ -0,0 +1,168 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+// Contains the cached UsdSkel skinning function on GeometryMixin
+//
+// UsdSkelImaging presents a skinned prim's points as the output of an ExtComputation,
+// whose inputs are the rest points, joint influences and geomBindXform (from an
+// "aggregator" computation) and the per-frame skinning transforms. Normally Hydra reruns
+// the computation, fetching all the inputs, on every frame, and the full set of points
+// is resent. When the "Cached Skinning" setting is on, the rest data is fetched once and
+// cached, each frame only fetches the joint transforms, and the points are only
+// recomputed and resent if the transforms changed. The points are still skinned on the
+// cpu and sent as vertex_list : Moonray has no deformer applying joints at render time.
+//
+// Only classic linear blend skinning without blend shapes is handled : other cases are
+// left to Hydra. The rest data is assumed to only change with the topology.
+
+#include "GeometryMixin.h"
+#include "Gather.h"
+#include "RenderDelegate.h"
+#include <pxr/imaging/hd/sceneDelegate.h>
+#include <algorithm>
+
+using namespace pxr;
+using scene_rdl2::logging::Logger;
+
+namespace {
+
+// input names used by UsdSkelImaging
+const TfToken restPointsToken("restPoints");
+const TfToken geomBindXformToken("geomBindXform");
+const TfToken influencesToken("influences");
+const TfToken numInfluencesPerComponentToken("numInfluencesPerComponent");
+const TfToken hasConstantInfluencesToken("hasConstantInfluences");
+const TfToken skinningXformsToken("skinningXforms");
+const TfToken primWorldToLocalToken("primWorldToLocal");
+const TfToken skelLocalToWorldToken("skelLocalToWorld");
+const TfToken blendShapeWeightsToken("blendShapeWeights");
+const TfToken skinningMethodToken("skinningMethod");
+const TfToken classicLinearToken("classicLinear");
+
+GfMatrix4d
+getMatrix4d(const VtValue& value)
+{
+    if (value.IsHolding<GfMatrix4d>()) return value.UncheckedGet<GfMatrix4d>();
+    if (value.IsHolding<GfMatrix4f>()) return GfMatrix4d(value.UncheckedGet<GfMatrix4f>());
+    return GfMatrix4d(1.0);
+}
+
+}
+
+namespace hdMoonray {
+
+bool
+GeometryMixin::syncSkinnedPoints(HdSceneDelegate* sceneDelegate,
+                                 RenderDelegate& renderDelegate,
+                                 const HdExtComputationPrimvarDescriptor& compPrimvar,
+                                 HdDirtyBits dirtyBits,
+                                 bool force)
+{
+    const SdfPath& compId = compPrimvar.sourceComputationId;
+
+    // recognize the skinning computation by its scene inputs
+    const TfTokenVector sceneInputs = sceneDelegate->GetExtComputationSceneInputNames(compId);
+    auto hasInput = [&](const TfToken& name) {
+        return std::find(sceneInputs.begin(), sceneInputs.end(), name) != sceneInputs.end();
+    };
+    if (not hasInput(skinningXformsToken) ||
+        not hasInput(primWorldToLocalToken) ||
+        not hasInput(skelLocalToWorldToken)) {
+        return false;
+    }
+    if (hasInput(skinningMethodToken)) {
+        VtValue method = sceneDelegate->GetExtComputationInput(compId, skinningMethodToken);
+        if (method.IsHolding<TfToken>() && method.UncheckedGet<TfToken>() != classicLinearToken) {
+            return false;
+        }
+    }
+    if (hasInput(blendShapeWeightsToken) &&
+        sceneDelegate->GetExtComputationInput(compId, blendShapeWeightsToken).GetArraySize() > 0) {
+        return false;
+    }
+
+    // fetch and check the rest data, which comes from the computation inputs
+    const bool restChanged = compId != mSkinning.computationId ||
+                             (dirtyBits & HdChangeTracker::DirtyTopology);
+    if (restChanged) {
+        mSkinning = SkinningCache();
+        for (const HdExtComputationInputDescriptor& input :
+                 sceneDelegate->GetExtComputationInputDescriptors(compId)) {
+            VtValue value = sceneDelegate->GetExtComputationInput(input.sourceComputationId,
+                                                                  input.sourceComputationOutputName);
+            if (input.name == restPointsToken && value.IsHolding<VtVec3fArray>()) {
+                mSkinning.restPoints = value.UncheckedGet<VtVec3fArray>();
+            } else if (input.name == geomBindXformToken) {
+                mSkinning.geomBindXform = GfMatrix4f(getMatrix4d(value));
+            } else if (input.name == influencesToken && value.IsHolding<VtVec2fArray>()) {
+                mSkinning.influences = value.UncheckedGet<VtVec2fArray>();
+            } else if (input.name == numInfluencesPerComponentToken && value.IsHolding<int>()) {
+                mSkinning.numInfluencesPerPoint = value.UncheckedGet<int>();
+            } else if (input.name == hasConstantInfluencesToken && value.IsHolding<bool>()) {
+                mSkinning.hasConstantInfluences = value.UncheckedGet<bool>();
+            }
+        }
+        const size_t n = mSkinning.numInfluencesPerPoint;
+        const size_t expected = mSkinning.hasConstantInfluences ? n : n * mSkinning.restPoints.size();
+        if (mSkinning.restPoints.empty() || n == 0 || mSkinning.influences.size() != expected) {
+            Logger::warn(rprim.GetId(), ": skinning inputs not recognized, using Hydra skinning");
+            mSkinning = SkinningCache();
+            return false;
+        }
+        mSkinning.computationId = compId;
+    }
+
+    // per-frame inputs
+    VtValue xformsValue = sceneDelegate->GetExtComputationInput(compId, skinningXformsToken);
+    if (not xformsValue.IsHolding<VtMatrix4fArray>()) {
+        mSkinning = SkinningCache();
+        return false;
+    }
+    const VtMatrix4fArray& xforms = xformsValue.UncheckedGet<VtMatrix4fArray>();
+    const GfMatrix4d skelToPrim =
+        getMatrix4d(sceneDelegate->GetExtComputationInput(compId, skelLocalToWorldToken)) *
+        getMatrix4d(sceneDelegate->GetExtComputationInput(compId, primWorldToLocalToken));
+
+    // the points sent last time are still correct if nothing moved
+    if (not restChanged && not force &&
+        xforms == mSkinning.skinningXforms && skelToPrim == mSkinning.skelToPrim) {
+        return true;
+    }
+    mSkinning.skinningXforms = xforms;
+    mSkinning.skelToPrim = skelToPrim;
+
+    // linear blend skinning, matching UsdSkelSkinPointsLBS followed by the
+    // skeleton to prim transform applied by UsdSkelImaging
+    const VtVec3fArray& rest = mSkinning.restPoints;
+    const VtVec2fArray& influences = mSkinning.influences;
+    const size_t n = mSkinning.numInfluencesPerPoint;
+    const bool constant = mSkinning.hasConstantInfluences;
+    const GfMatrix4f& geomBindXform = mSkinning.geomBindXform;
+    const GfMatrix4f toPrim(skelToPrim);
+    const size_t jointCount = xforms.size();
+    VtVec3fArray points(rest.size());
+    GfVec3f* out = points.data();
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, rest.size(), PARALLEL_GATHER_GRAIN),
+        [&](const tbb::blocked_range<size_t>& r) {
+            for (size_t i = r.begin(); i < r.end(); ++i) {
+                const GfVec3f bindP = geomBindXform.Transform(rest[i]);
+                const GfVec2f* influence = &influences[constant ? 0 : i * n];
+                GfVec3f p(0.0f);
+                for (size_t k = 0; k < n; ++k) {
+                    const int joint = int(influence[k][0]);
+                    const float weight = influence[k][1];
+                    if (weight != 0.0f && joint >= 0 && size_t(joint) < jointCount) {
+                        p += xforms[joint].Transform(bindP) * weight;
+                    }
+                }
+                out[i] = toPrim.Transform(p);
+            }
+        });
+
+    primvarChanged(sceneDelegate, renderDelegate, compPrimvar.name,
+                   expandVertexPrimvar(VtValue(std::move(points))),
+                   compPrimvar.interpolation, compPrimvar.role);
+    return true;
+}
+
+}
@@ -0,0 +1,140 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "TexturePrefetch.h"
+
+#include <OpenImageIO/imageio.h>
+
+#include <algorithm>
+
+#include <glob.h>
+#include <sys/stat.h>
+
+namespace {
+
+// the reads are I/O bound, so a few threads are enough to keep the file system busy
+constexpr unsigned numThreads = 4;
+
+// only mip levels up to this size are read : finer ones are sampled by later passes,
+// by which time Moonray has read them itself
+constexpr int maxPrefetchResolution = 512;
+
+// files matching a path, which may contain a <UDIM> tag
+std::vector<std::string>
+expandUdim(const std::string& path)
+{
+    std::vector<std::string> result;
+    const size_t tag = path.find("<UDIM>");
+    if (tag == std::string::npos) {
+        result.push_back(path);
+        return result;
+    }
+    const std::string pattern = path.substr(0, tag) + "[1-9][0-9][0-9][0-9]" + path.substr(tag + 6);
+    glob_t matches;
+    if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+        for (size_t i = 0; i < matches.gl_pathc; ++i) result.emplace_back(matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+    return result;
+}
+
+}
+
+namespace hdMoonray {
+
+TexturePrefetch::~TexturePrefetch()
+{
+    {   std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+        mQueue.clear();
+    }
+    mCondition.notify_all();
+    for (std::thread& thread : mThreads) thread.join();
+}
+
+void
+TexturePrefetch::setBudget(size_t bytes)
+{
+    mBudget = bytes;
+}
+
+void
+TexturePrefetch::add(const std::string& path)
+{
+    if (path.empty() || not mBudget || mBytesRead >= mBudget) return;
+    std::vector<std::string> files = expandUdim(path);
+    {   std::lock_guard<std::mutex> lock(mMutex);
+        for (std::string& file : files) {
+            if (mSeen.insert(file).second) mQueue.push_back(std::move(file));
+        }
+        if (mThreads.empty()) {
+            for (unsigned i = 0; i < numThreads; ++i) mThreads.emplace_back(&TexturePrefetch::run, this);
+        }
+    }
+    mCondition.notify_all();
+}
+
+void
+TexturePrefetch::run()
+{
+    while (true) {
+        std::string filename;
+        {   std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this] { return mStop || not mQueue.empty(); });
+            if (mStop) return;
+            filename = std::move(mQueue.front());
+            mQueue.pop_front();
+        }
+        if (mBytesRead < mBudget) prefetch(filename);
+    }
+}
+
+bool
+TexturePrefetch::reserve(size_t bytes)
+{
+    size_t current = mBytesRead;
+    do {
+        if (current + bytes > mBudget) return false;
+    } while (not mBytesRead.compare_exchange_weak(current, current + bytes));
+    return true;
+}
+
+void
+TexturePrefetch::prefetch(const std::string& filename)
+{
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0) return; // Moonray reports missing textures
+
+    // opening reads the header
+    auto in = OIIO::ImageInput::open(filename);
+    if (not in) {
+        OIIO::geterror();
+        return;
+    }
+    // decoded size of each level, to estimate the part of the file each one takes
+    std::vector<size_t> levelBytes;
+    size_t totalBytes = 0;
+    while (in->seek_subimage(0, int(levelBytes.size()))) {
+        levelBytes.push_back(in->spec().image_bytes(true));
+        totalBytes += levelBytes.back();
+    }
+
+    // coarsest levels first, until one is too large or does not fit in the budget.
+    // The budget is charged with the compressed size of the level on disk
+    std::vector<char> pixels;
+    for (int level = int(levelBytes.size()) - 1; level >= 0; --level) {
+        if (not in->seek_subimage(0, level)) break;
+        const OIIO::ImageSpec& spec = in->spec();
+        if (std::max(spec.width, spec.height) > maxPrefetchResolution) break;
+        const size_t fileBytes = size_t(double(info.st_size) * levelBytes[level] / totalBytes);
+        if (not reserve(fileBytes)) break;
+        pixels.resize(levelBytes[level]);
+        if (not in->read_image(0, level, 0, spec.nchannels, OIIO::TypeDesc::UNKNOWN, pixels.data())) {
+            break;
+        }
+    }
+    in->geterror(); // clear errors from seeking past the last level
+    in->close();
+}
+
+}
@@ -0,0 +1,61 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace hdMoonray {
+
+// Background reading of the textures used by materials
+//
+// Moonray opens textures lazily, the first time a ray reaches them, so the first
+// progressive passes of a scene with many textures (UDIM sets especially) stall on file
+// I/O in every render thread. When a shader is set up its texture paths are queued here,
+// and a few background threads open each file (reading its header) and read its
+// coarsest mip levels, up to 512 pixels across, the ones sampled by the first low
+// resolution passes, so that they are in the file system cache by the time the render
+// asks for them.
+//
+// The number of bytes read from disk in a session is limited by the "Texture Prefetch
+// Budget" setting. Each file is read at most once. The budget is 0 (off) by default :
+// this only helps a renderer reading the files on this host, not a remote (Arras) one.
+
+class TexturePrefetch
+{
+public:
+    TexturePrefetch() = default;
+    ~TexturePrefetch();
+
+    // 0 disables prefetching
+    void setBudget(size_t bytes);
+
+    // Queue the files of a texture path, which may contain a <UDIM> tag
+    void add(const std::string& path);
+
+    size_t bytesRead() const { return mBytesRead; }
+
+private:
+    void run();
+    void prefetch(const std::string& filename);
+    // take bytes from the budget, returns false if there is not enough left
+    bool reserve(size_t bytes);
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<std::string> mQueue;
+    std::unordered_set<std::string> mSeen;
+    std::vector<std::thread> mThreads;
+    bool mStop = false;
+    std::atomic<size_t> mBudget{0};
+    std::atomic<size_t> mBytesRead{0};
+};
+
+}
@@ -0,0 +1,172 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "TextureWatcher.h"
+
+#include <scene_rdl2/render/logging/logging.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+
+using scene_rdl2::logging::Logger;
+
+namespace hdMoonray {
+
+TextureWatcher::~TextureWatcher()
+{
+    stop();
+}
+
+void
+TextureWatcher::setEnabled(bool enabled)
+{
+    if (enabled == mEnabled) return;
+    mEnabled = enabled;
+    if (not enabled) {
+        stop();
+        return;
+    }
+    // watch the textures added before, or while it was off
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const std::string& path : mPaths) {
+        if (not mEnabled) break; // inotify failed
+        watchLocked(path);
+    }
+}
+
+void
+TextureWatcher::stop()
+{
+    std::thread thread;
+    int fd = -1;
+    {   std::lock_guard<std::mutex> lock(mMutex);
+        thread = std::move(mThread);
+        fd = mFd;
+        mFd = -1;
+        mDirectories.clear();
+        mWatches.clear();
+        mChanged.clear();
+        mHasChanges = false;
+    }
+    // the thread sees that mFd changed and exits. It takes mMutex to do so, and a
+    // later add() may already have started another one
+    if (thread.joinable()) thread.join();
+#ifdef __linux__
+    if (fd >= 0) close(fd);
+#endif
+}
+
+void
+TextureWatcher::add(const std::string& path)
+{
+    if (path.empty()) return;
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (not mPaths.insert(path).second) return;
+    if (mEnabled) watchLocked(path);
+}
+
+void
+TextureWatcher::watchLocked(const std::string& path)
+{
+#ifdef __linux__
+    const size_t slash = path.rfind('/');
+    const std::string dir = slash == std::string::npos ? std::string(".") : path.substr(0, slash);
+    const std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+    if (mFd < 0) {
+        mFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (mFd < 0) {
+            Logger::warn("Watch Textures: ", std::strerror(errno));
+            mEnabled = false;
+            return;
+        }
+        mThread = std::thread(&TextureWatcher::run, this, mFd);
+    }
+
+    auto watch = mWatches.find(dir);
+    if (watch == mWatches.end()) {
+        // watching the directory sees files that are replaced by a rename
+        const int wd = inotify_add_watch(mFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0) {
+            // missing directories are reported by Moonray, but not running out of watches
+            if (errno == ENOSPC) Logger::warn("Watch Textures: too many directories to watch");
+            return;
+        }
+        watch = mWatches.emplace(dir, wd).first;
+        mDirectories[wd].path = dir;
+    }
+    Directory& directory = mDirectories[watch->second];
+    const size_t tag = name.find("<UDIM>");
+    if (tag == std::string::npos) {
+        directory.names.insert(name);
+    } else {
+        directory.udims.emplace(name.substr(0, tag), name.substr(tag + 6));
+    }
+#endif
+}
+
+std::vector<std::string>
+TextureWatcher::takeChanged()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::vector<std::string> result(mChanged.begin(), mChanged.end());
+    mChanged.clear();
+    mHasChanges = false;
+    return result;
+}
+
+void
+TextureWatcher::changed(int fd, int wd, const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (fd != mFd) return; // stopped
+    auto it = mDirectories.find(wd);
+    if (it == mDirectories.end()) return;
+    const Directory& directory = it->second;
+    bool match = directory.names.count(name) > 0;
+    for (auto udim = directory.udims.begin(); not match && udim != directory.udims.end(); ++udim) {
+        const std::string& before = udim->first;
+        const std::string& after = udim->second;
+        match = name.size() == before.size() + 4 + after.size() &&
+                name.compare(0, before.size(), before) == 0 &&
+                name.compare(before.size() + 4, after.size(), after) == 0 &&
+                std::all_of(name.begin() + before.size(), name.begin() + before.size() + 4,
+                            [](unsigned char c) { return std::isdigit(c); });
+    }
+    if (match) {
+        mChanged.insert(directory.path + "/" + name);
+        mHasChanges = true;
+    }
+}
+
+void
+TextureWatcher::run(int fd)
+{
+#ifdef __linux__
+    alignas(inotify_event) char buffer[16384];
+    while (true) {
+        {   std::lock_guard<std::mutex> lock(mMutex);
+            if (fd != mFd) return;
+        }
+        // wake up regularly to check if stopped
+        pollfd pfd{fd, POLLIN, 0};
+        if (poll(&pfd, 1, 250) <= 0) continue;
+        const ssize_t n = read(fd, buffer, sizeof(buffer));
+        for (ssize_t i = 0; i < n; ) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + i);
+            if (event->len) changed(fd, event->wd, event->name);
+            i += sizeof(inotify_event) + event->len;
+        }
+    }
+#endif
+}
+
+}
@@ -0,0 +1,76 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace hdMoonray {
+
+// Watches the texture files used by materials for changes
+//
+// When the "Watch Textures" setting is on, the directories holding the textures of
+// every shader that is set up are watched with inotify. Files that are written or
+// replaced (editors often save to a temporary file and rename it) are collected, and
+// RenderDelegate::reloadChangedTextures() invalidates just those in the renderer,
+// instead of the "reload_textures" command throwing away every texture.
+//
+// Paths are remembered while the setting is off, so turning it back on watches them
+// again. This does nothing on platforms without inotify. Changes made on another host to a
+// network file system may not be reported.
+
+class TextureWatcher
+{
+public:
+    TextureWatcher() = default;
+    ~TextureWatcher();
+
+    void setEnabled(bool enabled);
+    bool enabled() const { return mEnabled; }
+
+    // Watch the files of a texture path, which may contain a <UDIM> tag
+    void add(const std::string& path);
+
+    // True if files changed since the last call to takeChanged()
+    bool hasChanges() const { return mHasChanges; }
+    // The files that changed since the last call
+    std::vector<std::string> takeChanged();
+
+private:
+    void stop();
+    // must hold mMutex
+    void watchLocked(const std::string& path);
+    // reads the events of fd until stop() replaces it
+    void run(int fd);
+    void changed(int fd, int wd, const std::string& name);
+
+    // the files watched in a directory : names, and <UDIM> patterns as the
+    // text before and after the tag
+    struct Directory {
+        std::string path;
+        std::set<std::string> names;
+        std::set<std::pair<std::string, std::string>> udims;
+    };
+
+    std::atomic<bool> mEnabled{false};
+    std::atomic<bool> mHasChanges{false};
+    std::mutex mMutex;
+    // inotify descriptor and the thread reading it, guarded by mMutex
+    int mFd = -1;
+    std::thread mThread;
+    // every path given to add(), watched or not
+    std::set<std::string> mPaths;
+    std::unordered_map<int, Directory> mDirectories; // by watch descriptor
+    std::map<std::string, int> mWatches; // directory path to watch descriptor
+    std::set<std::string> mChanged;
+};
+
+}
@@ -340,4 +340,61 @@ void ValueConverter::setBinding(SceneObject* sceneObj, const Attribute* attr, Sc
         sceneObj->setBinding(attr->getName(),binding);
 }
 
+template <typename T>
+static void _copyIfChanged(SceneObject* dst, const SceneObject& src, const Attribute* attr)
+{
+    const AttributeKey<T> key(*attr);
+    if (dst->get(key, TIMESTEP_BEGIN) != src.get(key, TIMESTEP_BEGIN)) {
+        dst->set(key, src.get(key, TIMESTEP_BEGIN), TIMESTEP_BEGIN);
+    }
+    if (attr->isBlurrable() && dst->get(key, TIMESTEP_END) != src.get(key, TIMESTEP_END)) {
+        dst->set(key, src.get(key, TIMESTEP_END), TIMESTEP_END);
+    }
+}
+
+void
+ValueConverter::copyAttribute(SceneObject* dst, const SceneObject& src, const Attribute* attr)
+{
+    switch(attr->getType()) {
+    case TYPE_BOOL:   _copyIfChanged<Bool>(dst, src, attr); break;
+    case TYPE_INT:    _copyIfChanged<Int>(dst, src, attr); break;
+    case TYPE_LONG:   _copyIfChanged<Long>(dst, src, attr); break;
+    case TYPE_FLOAT:  _copyIfChanged<Float>(dst, src, attr); break;
+    case TYPE_DOUBLE: _copyIfChanged<Double>(dst, src, attr); break;
+    case TYPE_STRING: _copyIfChanged<String>(dst, src, attr); break;
+    case TYPE_RGB:    _copyIfChanged<Rgb>(dst, src, attr); break;
+    case TYPE_RGBA:   _copyIfChanged<Rgba>(dst, src, attr); break;
+    case TYPE_VEC2F:  _copyIfChanged<Vec2f>(dst, src, attr); break;
+    case TYPE_VEC2D:  _copyIfChanged<Vec2d>(dst, src, attr); break;
+    case TYPE_VEC3F:  _copyIfChanged<Vec3f>(dst, src, attr); break;
+    case TYPE_VEC3D:  _copyIfChanged<Vec3d>(dst, src, attr); break;
+    case TYPE_VEC4F:  _copyIfChanged<Vec4f>(dst, src, attr); break;
+    case TYPE_VEC4D:  _copyIfChanged<Vec4d>(dst, src, attr); break;
+    case TYPE_MAT4F:  _copyIfChanged<Mat4f>(dst, src, attr); break;
+    case TYPE_MAT4D:  _copyIfChanged<Mat4d>(dst, src, attr); break;
+    case TYPE_SCENE_OBJECT: _copyIfChanged<SceneObject*>(dst, src, attr); break;
+    case TYPE_BOOL_VECTOR:   _copyIfChanged<BoolVector>(dst, src, attr); break;
+    case TYPE_INT_VECTOR:    _copyIfChanged<IntVector>(dst, src, attr); break;
+    case TYPE_LONG_VECTOR:   _copyIfChanged<LongVector>(dst, src, attr); break;
+    case TYPE_FLOAT_VECTOR:  _copyIfChanged<FloatVector>(dst, src, attr); break;
+    case TYPE_DOUBLE_VECTOR: _copyIfChanged<DoubleVector>(dst, src, attr); break;
+    case TYPE_STRING_VECTOR: _copyIfChanged<StringVector>(dst, src, attr); break;
+    case TYPE_RGB_VECTOR:    _copyIfChanged<RgbVector>(dst, src, attr); break;
+    case TYPE_RGBA_VECTOR:   _copyIfChanged<RgbaVector>(dst, src, attr); break;
+    case TYPE_VEC2F_VECTOR:  _copyIfChanged<Vec2fVector>(dst, src, attr); break;
+    case TYPE_VEC2D_VECTOR:  _copyIfChanged<Vec2dVector>(dst, src, attr); break;
+    case TYPE_VEC3F_VECTOR:  _copyIfChanged<Vec3fVector>(dst, src, attr); break;
+    case TYPE_VEC3D_VECTOR:  _copyIfChanged<Vec3dVector>(dst, src, attr); break;
+    case TYPE_VEC4F_VECTOR:  _copyIfChanged<Vec4fVector>(dst, src, attr); break;
+    case TYPE_VEC4D_VECTOR:  _copyIfChanged<Vec4dVector>(dst, src, attr); break;
+    case TYPE_MAT4F_VECTOR:  _copyIfChanged<Mat4fVector>(dst, src, attr); break;
+    case TYPE_MAT4D_VECTOR:  _copyIfChanged<Mat4dVector>(dst, src, attr); break;
+    case TYPE_SCENE_OBJECT_VECTOR: _copyIfChanged<SceneObjectVector>(dst, src, attr); break;
+    case TYPE_SCENE_OBJECT_INDEXABLE: // not used by geometry
+    default:
+        Logger::error("copyAttribute not implemented for ", attributeTypeName(attr->getType()));
+        break;
+    }
+}
+
 }
@@ -33,5 +33,10 @@ void setDefault(SceneObject* sceneObj, const Attribute*);
 // set a binding on an attribute (also sets value to unit)
 void setBinding(SceneObject* sceneObject, const Attribute*,SceneObject* binding);
 
+// copy an attribute value (all timesteps) from one object to another object of
+// the same class. The value is only set if it differs, so unchanged attributes
+// are not marked as changed.
+void copyAttribute(SceneObject* dst, const SceneObject& src, const Attribute*);
+
 }}
 
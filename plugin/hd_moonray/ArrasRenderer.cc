@@ -74,6 +74,21 @@ ArrasRenderer::invalidateAllTextureResources()
     }
 }
 
+void
+ArrasRenderer::invalidateTextureResources(const std::vector<std::string>& files)
+{
+    if (mSDK) {
+        auto p{mcrt::RenderMessages::createInvalidateResourcesMessage(files)};
+        try {
+            mSDK->sendMessage(p);
+            forceUpdate();
+        } catch (std::exception& ex) {
+            Logger::error("Reload textures message send failed: ", ex.what());
+            hdmLogArras("reloadTexturesSendFailed");
+        }
+    }
+}
+
 void
 ArrasRenderer::restartRenderer()
 {
@@ -47,6 +47,7 @@ public:
     void applySettings(const RenderSettings&) override;
 
     void invalidateAllTextureResources() override;
+    void invalidateTextureResources(const std::vector<std::string>& files) override;
     void restartRenderer() override;
 private:
 
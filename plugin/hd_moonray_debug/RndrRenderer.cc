@@ -247,6 +247,16 @@ RndrRenderer::invalidateAllTextureResources()
     }
 }
 
+void
+RndrRenderer::invalidateTextureResources(const std::vector<std::string>& files)
+{
+    try {
+        mRenderContext->invalidateTextureResources(files);
+    } catch (const std::exception &e) {
+        Logger::warn(e.what());
+    }
+}
+
 void
 RndrRenderer::restartRenderer()
 {
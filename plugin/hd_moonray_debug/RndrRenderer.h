@@ -40,6 +40,7 @@ public:
     void setExecMode(std::string mode);
 
     void invalidateAllTextureResources() override;
+    void invalidateTextureResources(const std::vector<std::string>& files) override;
     void restartRenderer() override;
     
 private: